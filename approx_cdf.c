@@ -0,0 +1,303 @@
+#include "approx_cdf.h"
+
+/*  approximate CDF with a bounded number of nodes, see approx_cdf.h */
+
+
+/***********************************************************************
+ * callbacks for the tree of buckets
+ ***********************************************************************/
+static int BucketCmp(const void* a, const void* b) {
+     double x = ((const rb_approx_bucket*)a)->mean;
+     double y = ((const rb_approx_bucket*)b)->mean;
+     if(x > y) return 1;
+     if(x < y) return -1;
+     return 0;
+}
+
+static double BucketWeight(const void* a, const void* par) {
+     return ((const rb_approx_bucket*)a)->weight;
+}
+
+static void BucketDest(void* a) {
+     free(a);
+}
+
+static void InfoDest(void* a) {
+     ;
+}
+
+static void InfoPrint(void* a) {
+     ;
+}
+
+#define BUCKET(x) ((rb_approx_bucket*)((x)->key))
+
+
+/***********************************************************************/
+/*  FUNCTION:  ApproxCDFCreate */
+/**/
+/*    INPUTS:  eps is the error parameter (0 < eps < 1), Weight is the */
+/*             weight function for the values (0 means weight 1 for each */
+/*             value) and wparam is passed to it */
+/**/
+/*    OUTPUT:  a new, empty structure */
+/***********************************************************************/
+
+rb_approx_cdf* ApproxCDFCreate(double eps, double (*Weight)(double x, void* wparam), void* wparam) {
+     rb_approx_cdf* cdf = (rb_approx_cdf*)SafeMalloc(sizeof(rb_approx_cdf));
+     cdf->tree = RBTreeCreate(BucketCmp,BucketDest,InfoDest,NullFunction,InfoPrint,BucketWeight,0);
+     cdf->Weight = Weight;
+     cdf->wparam = wparam;
+     cdf->eps = eps;
+     cdf->total = 0.0;
+     cdf->min = 0.0;
+     cdf->max = 0.0;
+     cdf->count = 0;
+     cdf->nodes = 0;
+     /* after compressing, there are at most 2/eps + 1 buckets, this leaves
+      * room for at least as many new ones before the next compression */
+     cdf->maxNodes = (size_t)ceil(4.0/eps) + 2;
+     return cdf;
+}
+
+void ApproxCDFDestroy(rb_approx_cdf* cdf) {
+     RBTreeDestroy(cdf->tree);
+     free(cdf);
+}
+
+
+/***********************************************************************
+ * find the last bucket with mean <= x (a) and the first with mean > x
+ * (b); nil if there is no such bucket
+ ***********************************************************************/
+static void ApproxFind(const rb_approx_cdf* cdf, double x, int strict,
+          rb_red_blk_node** a, rb_red_blk_node** b) {
+     rb_red_blk_tree* tree = cdf->tree;
+     rb_red_blk_node* nil = tree->nil;
+     rb_red_blk_node* y = tree->root->left;
+     *a = nil;
+     *b = nil;
+     while(y != nil) {
+          double m = BUCKET(y)->mean;
+          if(m < x || (!strict && m == x)) {
+               *a = y;
+               y = y->right;
+          }
+          else {
+               *b = y;
+               y = y->left;
+          }
+     }
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  ApproxCDFCompress */
+/**/
+/*    EFFECT:  Walks over the buckets in order and merges each into the */
+/*             previous one if their weights sum to at most eps times */
+/*             the total; afterwards any two neighboring buckets have */
+/*             more weight than this, so there are at most 2/eps + 1 */
+/*             buckets. */
+/***********************************************************************/
+
+void ApproxCDFCompress(rb_approx_cdf* cdf) {
+     rb_red_blk_tree* tree = cdf->tree;
+     rb_red_blk_node* nil = tree->nil;
+     rb_red_blk_node* x = TreeFirst(tree);
+     double limit = cdf->eps * cdf->total;
+
+     while(x != nil) {
+          rb_red_blk_node* y = TreeSuccessor(tree,x);
+          rb_approx_bucket* a;
+          rb_approx_bucket* b;
+          if(y == nil) break;
+          a = BUCKET(x);
+          b = BUCKET(y);
+          if(a->weight + b->weight <= limit) {
+               /* the new mean is between the two, so the order is kept */
+               double w = a->weight + b->weight;
+               if(w > 0.0) a->mean = (a->mean*a->weight + b->mean*b->weight)/w;
+               a->weight = w;
+               a->count += b->count;
+               RBDelete(tree,y); /* the nodes other than y stay valid */
+               RBUpdateWeight(tree,x);
+               cdf->nodes--;
+          }
+          else x = y;
+     }
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  ApproxCDFInsert */
+/**/
+/*    EFFECT:  Adds the value x: it is merged into the closer one of the */
+/*             two neighboring buckets if that bucket has enough room, */
+/*             otherwise a new bucket is created (with the neighbor as */
+/*             a hint for the insert). If there are too many buckets, */
+/*             they are compressed (this happens rarely enough to be */
+/*             O(log(n)) amortized). */
+/***********************************************************************/
+
+void ApproxCDFInsert(rb_approx_cdf* cdf, double x) {
+     rb_red_blk_tree* tree = cdf->tree;
+     rb_red_blk_node* nil = tree->nil;
+     rb_red_blk_node* a;
+     rb_red_blk_node* b;
+     rb_red_blk_node* c = 0; /* bucket to merge into */
+     double w = cdf->Weight ? cdf->Weight(x,cdf->wparam) : 1.0;
+     double limit;
+
+     if(cdf->count == 0 || x < cdf->min) cdf->min = x;
+     if(cdf->count == 0 || x > cdf->max) cdf->max = x;
+     cdf->count++;
+     cdf->total += w;
+     limit = cdf->eps * cdf->total;
+
+     ApproxFind(cdf,x,0,&a,&b);
+     if(a != nil && b != nil) {
+          rb_approx_bucket* ba = BUCKET(a);
+          rb_approx_bucket* bb = BUCKET(b);
+          /* try the closer one first */
+          if(x - ba->mean <= bb->mean - x) {
+               if(ba->weight + w <= limit) c = a;
+               else if(bb->weight + w <= limit) c = b;
+          }
+          else {
+               if(bb->weight + w <= limit) c = b;
+               else if(ba->weight + w <= limit) c = a;
+          }
+     }
+     else if(a != nil) {
+          if(BUCKET(a)->weight + w <= limit) c = a;
+     }
+     else if(b != nil) {
+          if(BUCKET(b)->weight + w <= limit) c = b;
+     }
+
+     if(c) {
+          rb_approx_bucket* bc = BUCKET(c);
+          double w2 = bc->weight + w;
+          if(w2 > 0.0) bc->mean = (bc->mean*bc->weight + x*w)/w2;
+          bc->weight = w2;
+          bc->count++;
+          RBUpdateWeight(tree,c);
+     }
+     else {
+          rb_approx_bucket* bn = (rb_approx_bucket*)SafeMalloc(sizeof(rb_approx_bucket));
+          bn->mean = x;
+          bn->weight = w;
+          bn->count = 1;
+          RBTreeInsertHint(tree,(a != nil) ? a : b,bn,0);
+          cdf->nodes++;
+          if(cdf->nodes >= cdf->maxNodes) ApproxCDFCompress(cdf);
+     }
+}
+
+
+/***********************************************************************
+ * the CDF is interpolated linearly between the buckets: the weight of
+ * each bucket is considered to be centered at its mean, i.e. the
+ * cumulative weight at the mean of bucket i is the sum of the weights
+ * before it plus half of its own weight; below the first and above the
+ * last bucket, the interpolation is done to the minimum and maximum
+ ***********************************************************************/
+
+/***********************************************************************/
+/*  FUNCTION:  ApproxCDFRank */
+/**/
+/*    OUTPUT:  the estimated sum of weights of the values smaller than x */
+/***********************************************************************/
+
+double ApproxCDFRank(const rb_approx_cdf* cdf, double x) {
+     rb_red_blk_tree* tree = cdf->tree;
+     rb_red_blk_node* nil = tree->nil;
+     rb_red_blk_node* a;
+     rb_red_blk_node* b;
+     double x0,y0,x1,y1;
+
+     if(cdf->count == 0 || x <= cdf->min) return 0.0;
+     if(x > cdf->max) return cdf->total;
+     ApproxFind(cdf,x,1,&a,&b);
+     if(a != nil) {
+          x0 = BUCKET(a)->mean;
+          y0 = GetNodeRank(tree,a) + 0.5*BUCKET(a)->weight;
+          if(b != nil) {
+               x1 = BUCKET(b)->mean;
+               y1 = y0 + 0.5*(BUCKET(a)->weight + BUCKET(b)->weight);
+          }
+          else {
+               x1 = cdf->max;
+               y1 = cdf->total;
+          }
+     }
+     else {
+          x0 = cdf->min;
+          y0 = 0.0;
+          x1 = BUCKET(b)->mean;
+          y1 = 0.5*BUCKET(b)->weight;
+     }
+     if(x1 <= x0) return y1;
+     return y0 + (y1 - y0)*(x - x0)/(x1 - x0);
+}
+
+double ApproxCDF(const rb_approx_cdf* cdf, double x) {
+     if(cdf->total <= 0.0) return 0.0;
+     return ApproxCDFRank(cdf,x) / cdf->total;
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  ApproxCDFQuantile */
+/**/
+/*    INPUTS:  p is between 0 and 1 */
+/**/
+/*    OUTPUT:  the value where the estimated CDF crosses p (the inverse */
+/*             of ApproxCDF); 0 if there are no values */
+/***********************************************************************/
+
+double ApproxCDFQuantile(const rb_approx_cdf* cdf, double p) {
+     rb_red_blk_tree* tree = cdf->tree;
+     rb_red_blk_node* nil = tree->nil;
+     rb_red_blk_node* x;
+     rb_red_blk_node* y;
+     double t, before, c;
+     double x0,y0,x1,y1;
+
+     if(cdf->count == 0) return 0.0;
+     if(p <= 0.0) return cdf->min;
+     if(p >= 1.0) return cdf->max;
+     t = p * cdf->total;
+     x = RBWeightSelect(tree,t,&before);
+     c = before + 0.5*BUCKET(x)->weight; /* cumulative weight at the mean of x */
+     if(t < c) {
+          y = TreePredecessor(tree,x);
+          if(y != nil) {
+               x0 = BUCKET(y)->mean;
+               y0 = before - 0.5*BUCKET(y)->weight;
+          }
+          else {
+               x0 = cdf->min;
+               y0 = 0.0;
+          }
+          x1 = BUCKET(x)->mean;
+          y1 = c;
+     }
+     else {
+          y = TreeSuccessor(tree,x);
+          x0 = BUCKET(x)->mean;
+          y0 = c;
+          if(y != nil) {
+               x1 = BUCKET(y)->mean;
+               y1 = before + BUCKET(x)->weight + 0.5*BUCKET(y)->weight;
+          }
+          else {
+               x1 = cdf->max;
+               y1 = cdf->total;
+          }
+     }
+     if(y1 <= y0) return x0;
+     return x0 + (x1 - x0)*(t - y0)/(y1 - y0);
+}
+
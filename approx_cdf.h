@@ -0,0 +1,62 @@
+#ifndef APPROX_CDF_H
+#define APPROX_CDF_H
+
+#include "red_black_tree.h"
+
+/**************************************************
+ * approximate, bounded memory CDF of a stream of values
+ *
+ * values (doubles) are not stored one node each, but merged into
+ * buckets (similarly to the centroids of a t-digest): each bucket
+ * stores the weighted mean and the sum of the weights of the values
+ * in it, and the buckets are the nodes of a red-black tree ordered by
+ * their mean, so the sums in the tree give the CDF as before
+ *
+ * the weight of a value x is Weight(x,wparam) (similarly to DistFunc,
+ * or 1 for each value if Weight is 0)
+ *
+ * error parameter eps: a value is only merged into a bucket if the
+ * weight of the bucket stays at most eps times the total weight, so
+ * the estimated CDF and quantiles are accurate to about eps (this bounds
+ * the weight of each bucket; as with the t-digest, it is not a strict
+ * worst case bound for the interpolated CDF); the number of buckets is
+ * at most 4/eps + 2, independent of the number of values
+ **************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rb_approx_bucket {
+  double mean; /* weighted mean of the values in this bucket */
+  double weight; /* sum of the weights of the values */
+  uint64_t count; /* number of values */
+} rb_approx_bucket;
+
+typedef struct rb_approx_cdf {
+  rb_red_blk_tree* tree; /* keys are pointers to rb_approx_bucket, ordered by mean */
+  double (*Weight)(double x, void* wparam);
+  void* wparam;
+  double eps;
+  double total; /* sum of all weights */
+  double min; /* smallest and largest value seen */
+  double max;
+  uint64_t count; /* number of values */
+  size_t nodes; /* current number of buckets */
+  size_t maxNodes; /* buckets are compressed when reaching this */
+} rb_approx_cdf;
+
+rb_approx_cdf* ApproxCDFCreate(double eps, double (*Weight)(double x, void* wparam), void* wparam);
+void ApproxCDFInsert(rb_approx_cdf*, double x);
+double ApproxCDFRank(const rb_approx_cdf*, double x); //!! estimated sum of the weights of the values < x
+double ApproxCDF(const rb_approx_cdf*, double x); //!! ApproxCDFRank divided by the total weight
+double ApproxCDFQuantile(const rb_approx_cdf*, double p); //!! value where the CDF crosses p
+void ApproxCDFCompress(rb_approx_cdf*); //!! merge neighboring buckets as much as possible
+void ApproxCDFDestroy(rb_approx_cdf*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,206 @@
+#include "combining_tree.h"
+#include <stdint.h>
+#ifndef RB_NO_THREADS
+#include <sched.h>
+#endif
+
+/*  flat combining front end, see combining_tree.h */
+
+/* the combiner repeats collecting requests at most this many times */
+#define RB_FC_PASSES 4
+
+#ifndef RB_NO_THREADS
+#define FC_TRYLOCK(m) pthread_mutex_trylock(m)
+#define FC_UNLOCK(m) pthread_mutex_unlock(m)
+#define FC_YIELD() sched_yield()
+#else
+#define FC_TRYLOCK(m) 0
+#define FC_UNLOCK(m) ((void)0)
+#define FC_YIELD() ((void)0)
+#endif
+
+
+rb_fc_tree* FCTreeCreate(rb_red_blk_tree* tree, size_t maxSlots, void (*UpdateKey)(void* key, void* arg)) {
+     rb_fc_tree* fc = (rb_fc_tree*)SafeMalloc(sizeof(rb_fc_tree));
+     size_t i;
+     fc->tree = tree;
+     fc->maxSlots = maxSlots;
+     fc->UpdateKey = UpdateKey;
+     fc->used = 0;
+     fc->slotMem = SafeMalloc(sizeof(rb_fc_slot)*maxSlots + RB_FC_LINE);
+     fc->slots = (rb_fc_slot*)(((uintptr_t)(fc->slotMem) + RB_FC_LINE - 1) & ~(uintptr_t)(RB_FC_LINE - 1));
+     fc->batch = (rb_fc_slot**)SafeMalloc(sizeof(rb_fc_slot*)*maxSlots);
+     for(i=0;i<maxSlots;i++) {
+          fc->slots[i].state = RB_FC_FREE;
+          fc->slots[i].node = 0;
+     }
+#ifndef RB_NO_THREADS
+     pthread_mutex_init(&(fc->lock),0);
+#endif
+     return fc;
+}
+
+void FCTreeDestroy(rb_fc_tree* fc) {
+#ifndef RB_NO_THREADS
+     pthread_mutex_destroy(&(fc->lock));
+#endif
+     free(fc->slotMem);
+     free(fc->batch);
+     free(fc);
+}
+
+rb_fc_slot* FCTreeRegister(rb_fc_tree* fc) {
+     size_t i = __atomic_fetch_add(&(fc->used),1,__ATOMIC_ACQ_REL);
+     if(i >= fc->maxSlots) {
+          __atomic_fetch_sub(&(fc->used),1,__ATOMIC_ACQ_REL);
+          return 0;
+     }
+     return fc->slots + i;
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  FCTreeSubmit */
+/**/
+/*    INPUTS:  slot is a slot of the calling thread without a request in */
+/*             it; op is RB_FC_INSERT (key and info are used), RB_FC_DELETE */
+/*             or RB_FC_UPDATE (node is used, and info is passed to */
+/*             UpdateKey) */
+/**/
+/*    EFFECT:  Publishes the request; it is done by a combiner thread at */
+/*             some point, the latest when the caller calls FCTreeWait. */
+/***********************************************************************/
+
+void FCTreeSubmit(rb_fc_slot* slot, int op, void* key, void* info, rb_red_blk_node* node) {
+     slot->op = op;
+     slot->key = key;
+     slot->info = info;
+     slot->node = node;
+     __atomic_store_n(&(slot->state),RB_FC_PENDING,__ATOMIC_RELEASE);
+}
+
+int FCTreePoll(rb_fc_slot* slot) {
+     return __atomic_load_n(&(slot->state),__ATOMIC_ACQUIRE) == RB_FC_DONE;
+}
+
+
+/***********************************************************************
+ * order of the requests in a batch: by op, then by key (for the inserts
+ * and deletes) or by node (for the updates, so that the same node is
+ * next to each other)
+ ***********************************************************************/
+static int FCRequestCmp(const rb_red_blk_tree* tree, const rb_fc_slot* a, const rb_fc_slot* b) {
+     if(a->op != b->op) return (a->op > b->op) ? 1 : -1;
+     if(a->op == RB_FC_INSERT) return tree->Compare(a->key,b->key);
+     if(a->op == RB_FC_DELETE) return tree->Compare(a->node->key,b->node->key);
+     if(a->node != b->node) return (a->node > b->node) ? 1 : -1;
+     return 0;
+}
+
+/***********************************************************************
+ * sort the batch (insertion sort: there is at most one request per
+ * slot, and batches are typically small)
+ ***********************************************************************/
+static void FCSortBatch(const rb_red_blk_tree* tree, rb_fc_slot** batch, size_t k) {
+     size_t i,j;
+     for(i=1;i<k;i++) {
+          rb_fc_slot* s = batch[i];
+          for(j=i;j>0 && FCRequestCmp(tree,batch[j-1],s) == 1;j--) batch[j] = batch[j-1];
+          batch[j] = s;
+     }
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  FCCombine */
+/**/
+/*    EFFECT:  Collects the pending requests of all slots, sorts them and */
+/*             applies them to the tree as one batch (RBTreeBeginBatch */
+/*             and RBTreeEndBatch, so the sums above the changed nodes */
+/*             are updated together at the end), then marks them done; */
+/*             repeats this while there are new requests, up to */
+/*             RB_FC_PASSES times. Must be called with the lock held. */
+/***********************************************************************/
+
+static void FCCombine(rb_fc_tree* fc) {
+     rb_red_blk_tree* tree = fc->tree;
+     int pass;
+     for(pass=0;pass<RB_FC_PASSES;pass++) {
+          size_t used = __atomic_load_n(&(fc->used),__ATOMIC_ACQUIRE);
+          size_t i, k = 0;
+          rb_red_blk_node* hint = 0;
+          for(i=0;i<used;i++) {
+               rb_fc_slot* s = fc->slots + i;
+               if(__atomic_load_n(&(s->state),__ATOMIC_ACQUIRE) == RB_FC_PENDING)
+                    fc->batch[k++] = s;
+          }
+          if(k == 0) break;
+          FCSortBatch(tree,fc->batch,k);
+          RBTreeBeginBatch(tree);
+          for(i=0;i<k;i++) {
+               rb_fc_slot* s = fc->batch[i];
+               switch(s->op) {
+                    case RB_FC_UPDATE:
+                         if(fc->UpdateKey) fc->UpdateKey(s->node->key,s->info);
+                         /* the weight is recomputed once per node and batch */
+                         if(i+1 == k || fc->batch[i+1]->op != RB_FC_UPDATE ||
+                              fc->batch[i+1]->node != s->node) RBUpdateWeight(tree,s->node);
+                         break;
+                    case RB_FC_DELETE:
+                         RBDelete(tree,s->node);
+                         s->node = 0;
+                         break;
+                    case RB_FC_INSERT:
+                         /* keys are sorted, the previous node is a good hint */
+                         hint = RBTreeInsertHint(tree,hint,s->key,s->info);
+                         s->node = hint;
+                         break;
+               }
+          }
+          RBTreeEndBatch(tree);
+          for(i=0;i<k;i++) __atomic_store_n(&(fc->batch[i]->state),RB_FC_DONE,__ATOMIC_RELEASE);
+     }
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  FCTreeWait */
+/**/
+/*    OUTPUT:  the result of the request in slot (the new node for an */
+/*             insert, 0 otherwise); the slot can be used again after */
+/*             this */
+/**/
+/*    EFFECT:  Waits until the request is done; whenever the lock is */
+/*             free, takes it and acts as the combiner. */
+/***********************************************************************/
+
+rb_red_blk_node* FCTreeWait(rb_fc_tree* fc, rb_fc_slot* slot) {
+     rb_red_blk_node* ret;
+     int spins = 0;
+     while(__atomic_load_n(&(slot->state),__ATOMIC_ACQUIRE) != RB_FC_DONE) {
+          if(FC_TRYLOCK(&(fc->lock)) == 0) {
+               FCCombine(fc);
+               FC_UNLOCK(&(fc->lock));
+          }
+          else if(++spins % 64 == 0) FC_YIELD();
+     }
+     ret = slot->node;
+     __atomic_store_n(&(slot->state),RB_FC_FREE,__ATOMIC_RELAXED);
+     return ret;
+}
+
+rb_red_blk_node* FCTreeInsert(rb_fc_tree* fc, rb_fc_slot* slot, void* key, void* info) {
+     FCTreeSubmit(slot,RB_FC_INSERT,key,info,0);
+     return FCTreeWait(fc,slot);
+}
+
+void FCTreeDelete(rb_fc_tree* fc, rb_fc_slot* slot, rb_red_blk_node* node) {
+     FCTreeSubmit(slot,RB_FC_DELETE,0,0,node);
+     FCTreeWait(fc,slot);
+}
+
+void FCTreeUpdateWeight(rb_fc_tree* fc, rb_fc_slot* slot, rb_red_blk_node* node, void* arg) {
+     FCTreeSubmit(slot,RB_FC_UPDATE,0,arg,node);
+     FCTreeWait(fc,slot);
+}
+
@@ -0,0 +1,97 @@
+#ifndef COMBINING_TREE_H
+#define COMBINING_TREE_H
+
+#include "red_black_tree.h"
+#ifndef RB_NO_THREADS
+#include <pthread.h>
+#endif
+
+/**************************************************
+ * flat combining front end for using one tree from many threads
+ *
+ * instead of each thread taking a lock for each operation (and waiting
+ * for the others), the threads publish their requests (insert, delete
+ * or update the weight of a node) in slots; whichever thread gets the
+ * lock (the combiner) applies all the published requests in one batch,
+ * while the others wait for their results without taking the lock
+ * (Hendler, Incze, Shavit and Tzafrir, 2010)
+ *
+ * a batch is sorted (updates, then deletes, then inserts; each group by
+ * key), so the inserts can use RBTreeInsertHint with the previous new
+ * node as the hint, and repeated weight updates of the same node are
+ * applied once; the batch is applied between RBTreeBeginBatch and
+ * RBTreeEndBatch, so the sums above the changed nodes are recomputed
+ * once for the whole batch, in one pass over the union of their paths
+ *
+ * a thread gets a slot by FCTreeRegister, and can have one request in
+ * it at a time; requests are asynchronous: FCTreeSubmit returns at once,
+ * and FCTreeWait returns the result (the new node for an insert), so a
+ * thread can use more slots to have more requests in progress; the
+ * FCTreeInsert, FCTreeDelete and FCTreeUpdateWeight functions do both
+ *
+ * a weight update calls UpdateKey(node->key,info) in the combiner (if
+ * UpdateKey is given), since the tree must not see the new DistFunc
+ * value before RBUpdateWeight is called for the node
+ *
+ * the slots are aligned to cache lines (RB_FC_LINE bytes), so threads
+ * writing their own slots do not share cache lines
+ *
+ * all modifications of the tree have to go through the front end while
+ * it is in use; it needs the GCC __atomic builtins and POSIX threads
+ * (with RB_NO_THREADS, there is no lock, and FCTreeWait applies the
+ * requests in the calling thread)
+ **************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RB_FC_UPDATE 1 /* UpdateKey(node->key,info), then RBUpdateWeight(tree,node) */
+#define RB_FC_DELETE 2 /* RBDelete(tree,node) */
+#define RB_FC_INSERT 3 /* RBTreeInsert(tree,key,info) */
+
+#define RB_FC_LINE 64 /* size of a cache line */
+
+/* slot states */
+#define RB_FC_FREE 0
+#define RB_FC_PENDING 1
+#define RB_FC_DONE 2
+
+typedef struct rb_fc_slot {
+  int state; /* accessed atomically */
+  int op;
+  void* key;
+  void* info;
+  rb_red_blk_node* node; /* node to update or delete; the new node after an insert */
+  char pad[RB_FC_LINE - 2*sizeof(int) - 3*sizeof(void*)]; /* one slot per cache line */
+} rb_fc_slot;
+
+typedef struct rb_fc_tree {
+  rb_red_blk_tree* tree;
+  rb_fc_slot* slots; /* aligned to RB_FC_LINE */
+  void* slotMem; /* allocated memory of the slots */
+  size_t maxSlots;
+  size_t used; /* slots given out by FCTreeRegister, accessed atomically */
+  rb_fc_slot** batch; /* requests collected by the combiner */
+  void (*UpdateKey)(void* key, void* arg); /* changes the weight for RB_FC_UPDATE */
+#ifndef RB_NO_THREADS
+  pthread_mutex_t lock; /* held by the combiner */
+#endif
+} rb_fc_tree;
+
+rb_fc_tree* FCTreeCreate(rb_red_blk_tree* tree, size_t maxSlots, void (*UpdateKey)(void* key, void* arg)); //!! the tree is not destroyed by FCTreeDestroy
+rb_fc_slot* FCTreeRegister(rb_fc_tree*); //!! get a new slot (0 if all maxSlots are used)
+void FCTreeSubmit(rb_fc_slot*, int op, void* key, void* info, rb_red_blk_node* node); //!! publish a request
+int FCTreePoll(rb_fc_slot*); //!! nonzero if the request in the slot is done
+rb_red_blk_node* FCTreeWait(rb_fc_tree*, rb_fc_slot*); //!! wait for the request (combining if possible), free the slot
+rb_red_blk_node* FCTreeInsert(rb_fc_tree*, rb_fc_slot*, void* key, void* info);
+void FCTreeDelete(rb_fc_tree*, rb_fc_slot*, rb_red_blk_node*);
+void FCTreeUpdateWeight(rb_fc_tree*, rb_fc_slot*, rb_red_blk_node*, void* arg);
+void FCTreeDestroy(rb_fc_tree*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -20,9 +20,17 @@
 /*                names beginning with "g".  An example of a global */
 /*                variable name is gNewtonsConstant. */
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void Assert(int assertion, char* error);
 void * SafeMalloc(size_t size);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 
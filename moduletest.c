@@ -0,0 +1,821 @@
+#include "red_black_tree.h"
+#include "sharded_tree.h"
+#include "combining_tree.h"
+#include "query_pool.h"
+#include "tree_log.h"
+#include "range_tree.h"
+#include "approx_cdf.h"
+#include "sampler.h"
+#include "tree_perf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifndef RB_NO_THREADS
+#include <pthread.h>
+#endif
+
+
+/*  regression tests for the modules built on the tree (sharded_tree,
+ * 	combining_tree, query_pool, tree_log, range_tree, approx_cdf, sampler
+ * 	and tree_perf): each module is used with random data, and the
+ * 	results are compared to the ones computed by brute force or by the
+ * 	functions of a single tree
+ *
+ * 	parameters:
+ * 	-N n       number of operations in each test (default: 20000)
+ * 	-s seed    random seed (default: the current time)
+ * 	-d dir     directory for the temporary files of the tree_log test
+ * 	           (default: .)
+ * 	-v         print the name of each test as it runs
+ *
+ * 	the program returns 1 if there were errors */
+
+
+#define KEYS 1000 /* keys are in [0,KEYS) */
+static double W[KEYS]; /* weight of each key */
+static const char* testName = "";
+static const char* tmpDir = ".";
+static int errors = 0;
+
+static double DistW(const void* a, const void* par) {
+	return W[(int64_t)a];
+}
+
+static void Error(const char* fmt, ...) {
+	va_list ap;
+	errors++;
+	if(errors > 20) return;
+	fprintf(stderr,"%s: ",testName);
+	va_start(ap,fmt);
+	vfprintf(stderr,fmt,ap);
+	va_end(ap);
+	fprintf(stderr,"\n");
+}
+
+static inline int Close(double a, double b, double scale) {
+	return fabs(a-b) <= 1e-9*(fabs(a) + fabs(b) + scale);
+}
+
+static inline int64_t RandKey(void) {
+	return ((int64_t)rand()) % KEYS;
+}
+
+static void RandomWeights(void) {
+	int i;
+	for(i=0;i<KEYS;i++) W[i] = (double)(rand()%20);
+}
+
+static rb_red_blk_tree* NewTree(void) {
+	return RBTreeCreate(CmpInt64,(void (*)(void*))NullFunction,(void (*)(void*))NullFunction,
+		NullFunction,(void (*)(void*))NullFunction,DistW,0);
+}
+
+/* sum of the weights of the keys smaller than q, with count[k] nodes for
+ * each key */
+static double BruteRank(const unsigned int* count, int64_t q) {
+	double r = 0.0;
+	int64_t k;
+	for(k=0;k<KEYS && k<q;k++) r += W[k]*count[k];
+	return r;
+}
+
+/* the keys of the tree in order are the ones given by count */
+static int SameKeys(rb_red_blk_tree* tree, const unsigned int* count) {
+	rb_red_blk_node* x = TreeFirst(tree);
+	int64_t k;
+	unsigned int c;
+	for(k=0;k<KEYS;k++) for(c=0;c<count[k];c++) {
+		if(x == tree->nil || (int64_t)x->key != k) return 0;
+		x = TreeSuccessor(tree,x);
+	}
+	return x == tree->nil;
+}
+
+/* sharded tree: ranks, deletes and rebalancing */
+#ifndef RB_NO_THREADS
+typedef struct {
+	rb_sharded_tree* st;
+	int id;
+	int nthreads;
+	unsigned int n;
+} shard_job;
+
+static void* ShardWriter(void* arg) {
+	shard_job* job = (shard_job*)arg;
+	unsigned int i;
+	for(i=0;i<job->n;i++) ShardedTreeInsert(job->st,(void*)(int64_t)((i*job->nthreads + job->id) % KEYS),0);
+	return 0;
+}
+#endif
+
+static void TestSharded(unsigned int N) {
+	size_t Ps[3] = {1, 4, 16};
+	unsigned int* count = (unsigned int*)SafeMalloc(sizeof(unsigned int)*KEYS);
+	int p;
+	RandomWeights();
+	for(p=0;p<3;p++) {
+		size_t P = Ps[p];
+		void* splits[15];
+		rb_sharded_tree* st;
+		unsigned int i;
+		size_t n = 0, j;
+		for(j=0;j+1<P;j++) splits[j] = (void*)(int64_t)((j+1)*KEYS/P);
+		/* the first one starts with everything in one shard */
+		st = ShardedTreeCreate(P,p == 2 ? splits : 0,CmpInt64,(void (*)(void*))NullFunction,
+			(void (*)(void*))NullFunction,NullFunction,(void (*)(void*))NullFunction,DistW,0,0);
+		ShardedTreeSetImbalance(st,1.5);
+		memset(count,0,sizeof(unsigned int)*KEYS);
+		for(i=0;i<N;i++) {
+			int64_t k = RandKey();
+			if(rand()%3) {
+				/* skewed keys, so that the shards have to be rebalanced */
+				if(rand()%2) k = k/10;
+				ShardedTreeInsert(st,(void*)k,0);
+				count[k]++;
+				n++;
+			}
+			else {
+				int found = ShardedTreeDelete(st,(void*)k);
+				if(found != (count[k] != 0)) Error("ShardedTreeDelete: wrong result for key %ld",(long)k);
+				if(count[k]) {
+					count[k]--;
+					n--;
+				}
+			}
+			if(i % 500 == 0 || i == N-1) {
+				double total = BruteRank(count,KEYS);
+				int64_t q = (int64_t)(rand()%(KEYS+2)) - 1;
+				double r = ShardedTreeRank(st,(void*)q);
+				double b = BruteRank(count,q);
+				if(!Close(r,b,total)) Error("ShardedTreeRank: %g instead of %g for key %ld (P = %zu)",r,b,(long)q,P);
+				if(!Close(ShardedTreeTotal(st),total,total)) Error("ShardedTreeTotal: %g instead of %g",ShardedTreeTotal(st),total);
+				if(total > 0.0 && !Close(ShardedTreeCDF(st,(void*)q),b/total,1.0)) Error("ShardedTreeCDF: wrong result");
+				if(ShardedTreeSize(st) != n) Error("ShardedTreeSize: %zu instead of %zu",ShardedTreeSize(st),n);
+			}
+			if(i == N/2) ShardedTreeRebalance(st);
+		}
+		/* the shards hold consecutive key ranges, about n/P nodes each after rebalancing */
+		ShardedTreeRebalance(st);
+		{
+			int64_t prev = -1;
+			size_t sum = 0;
+			for(j=0;j<P;j++) {
+				rb_red_blk_tree* t = st->shards[j].tree;
+				rb_red_blk_node* x;
+				size_t c = 0;
+				for(x = TreeFirst(t); x != t->nil; x = TreeSuccessor(t,x)) {
+					if((int64_t)x->key < prev) Error("shard %zu is out of order",j);
+					prev = (int64_t)x->key;
+					c++;
+				}
+				if(c != st->shards[j].n) Error("shard %zu has %zu nodes instead of %zu",j,c,st->shards[j].n);
+				if(P > 1 && c > 2*n/P + 2*KEYS/100 + 10) Error("shard %zu has %zu of %zu nodes after rebalancing",j,c,n);
+				sum += c;
+			}
+			if(sum != n) Error("the shards have %zu nodes instead of %zu",sum,n);
+		}
+#ifndef RB_NO_THREADS
+		/* concurrent writers */
+		{
+			pthread_t threads[4];
+			shard_job jobs[4];
+			int t;
+			for(t=0;t<4;t++) {
+				jobs[t].st = st;
+				jobs[t].id = t;
+				jobs[t].nthreads = 4;
+				jobs[t].n = N/4;
+				pthread_create(threads+t,0,ShardWriter,jobs+t);
+			}
+			for(t=0;t<4;t++) pthread_join(threads[t],0);
+			for(t=0;t<4;t++) for(i=0;i<N/4;i++) count[(i*4 + t) % KEYS]++;
+			n += 4*(N/4);
+			if(ShardedTreeSize(st) != n) Error("ShardedTreeSize: %zu instead of %zu after concurrent inserts",ShardedTreeSize(st),n);
+			if(!Close(ShardedTreeTotal(st),BruteRank(count,KEYS),BruteRank(count,KEYS)))
+				Error("ShardedTreeTotal: wrong after concurrent inserts");
+		}
+#endif
+		ShardedTreeDestroy(st);
+	}
+	free(count);
+}
+
+
+/* flat combining: the result is the same as doing the operations directly */
+#define FC_THREADS 4
+typedef struct {
+	rb_fc_tree* fc;
+	int id;
+	unsigned int n; /* keys id, id + FC_THREADS, ... (n of them) */
+	double* newWeights;
+} fc_job;
+
+static void UpdateW(void* key, void* arg) {
+	W[(int64_t)key] = *(double*)arg;
+}
+
+static void* FCWorker(void* arg) {
+	fc_job* job = (fc_job*)arg;
+	rb_fc_slot* s[2];
+	rb_red_blk_node** nodes = (rb_red_blk_node**)SafeMalloc(sizeof(rb_red_blk_node*)*job->n);
+	unsigned int i;
+	s[0] = FCTreeRegister(job->fc);
+	s[1] = FCTreeRegister(job->fc);
+	if(!s[0] || !s[1]) {
+		Error("FCTreeRegister failed");
+		free(nodes);
+		return 0;
+	}
+	/* two requests in progress at a time */
+	for(i=0;i+1<job->n;i+=2) {
+		FCTreeSubmit(s[0],RB_FC_INSERT,(void*)(int64_t)(i*FC_THREADS + job->id),0,0);
+		FCTreeSubmit(s[1],RB_FC_INSERT,(void*)(int64_t)((i+1)*FC_THREADS + job->id),0,0);
+		FCTreePoll(s[0]);
+		nodes[i] = FCTreeWait(job->fc,s[0]);
+		nodes[i+1] = FCTreeWait(job->fc,s[1]);
+	}
+	for(;i<job->n;i++) nodes[i] = FCTreeInsert(job->fc,s[0],(void*)(int64_t)(i*FC_THREADS + job->id),0);
+	for(i=0;i<job->n;i++) if(!nodes[i] || (int64_t)nodes[i]->key != (int64_t)(i*FC_THREADS + job->id))
+		Error("FCTreeInsert returned a wrong node");
+	for(i=0;i<job->n;i++) FCTreeUpdateWeight(job->fc,s[i%2],nodes[i],job->newWeights + i*FC_THREADS + job->id);
+	for(i=0;i<job->n;i+=3) FCTreeDelete(job->fc,s[1],nodes[i]);
+	free(nodes);
+	return 0;
+}
+
+static void TestCombining(unsigned int N) {
+	rb_red_blk_tree* tree = NewTree();
+	rb_fc_tree* fc = FCTreeCreate(tree,2*FC_THREADS,UpdateW);
+	double* newWeights = (double*)SafeMalloc(sizeof(double)*KEYS);
+	unsigned int* count = (unsigned int*)SafeMalloc(sizeof(unsigned int)*KEYS);
+	fc_job jobs[FC_THREADS];
+	unsigned int per = KEYS/FC_THREADS;
+	int t;
+	int64_t k;
+#ifndef RB_NO_THREADS
+	pthread_t threads[FC_THREADS];
+#endif
+
+	for(k=0;k<KEYS;k++) {
+		W[k] = 1.0;
+		newWeights[k] = (double)(rand()%20);
+		count[k] = 0;
+	}
+	for(t=0;t<FC_THREADS;t++) {
+		unsigned int i;
+		jobs[t].fc = fc;
+		jobs[t].id = t;
+		jobs[t].n = per;
+		jobs[t].newWeights = newWeights;
+		for(i=0;i<per;i++) if(i%3) count[i*FC_THREADS + t] = 1;
+#ifndef RB_NO_THREADS
+		pthread_create(threads+t,0,FCWorker,jobs+t);
+#endif
+	}
+	for(t=0;t<FC_THREADS;t++) {
+#ifndef RB_NO_THREADS
+		pthread_join(threads[t],0);
+#else
+		FCWorker(jobs+t);
+#endif
+	}
+	if(FCTreeRegister(fc) != 0) Error("FCTreeRegister: more slots than maxSlots");
+	for(k=0;k<KEYS;k++) if(count[k] && W[k] != newWeights[k]) Error("weight of key %ld was not updated",(long)k);
+	if(!SameKeys(tree,count)) Error("wrong keys in the tree");
+	else {
+		rb_red_blk_node* x;
+		double sum = 0.0, total = BruteRank(count,KEYS);
+		for(x = TreeFirst(tree); x != tree->nil; x = TreeSuccessor(tree,x)) {
+			if(!Close(GetNodeRank(tree,x),sum,total)) {
+				Error("wrong rank after the combined updates");
+				break;
+			}
+			sum += W[(int64_t)x->key];
+		}
+		if(!Close(RBTreeTotal(tree),total,total)) Error("total %g instead of %g",RBTreeTotal(tree),total);
+	}
+	FCTreeDestroy(fc);
+	RBTreeDestroy(tree);
+	free(newWeights);
+	free(count);
+	(void)N;
+}
+
+
+/* parallel queries give the same results as the sequential ones */
+static void TestQueryPool(unsigned int N) {
+	rb_red_blk_tree* tree = NewTree();
+	size_t m = N;
+	void** keys = (void**)SafeMalloc(sizeof(void*)*m);
+	rb_red_blk_node** nodes = (rb_red_blk_node**)SafeMalloc(sizeof(rb_red_blk_node*)*m);
+	rb_red_blk_node** found = (rb_red_blk_node**)SafeMalloc(sizeof(rb_red_blk_node*)*m);
+	double* r1 = (double*)SafeMalloc(sizeof(double)*m);
+	double* r2 = (double*)SafeMalloc(sizeof(double)*m);
+	unsigned int threads[2] = {0, 3};
+	size_t i;
+	int p;
+
+	RandomWeights();
+	for(i=0;i<m;i++) {
+		nodes[i] = RBTreeInsert(tree,(void*)RandKey(),0);
+		keys[i] = (void*)((int64_t)(rand()%(KEYS+2)) - 1);
+	}
+	for(p=0;p<2;p++) {
+		rb_query_pool* pool = RBQueryPoolCreate(threads[p]);
+		RBParallelRank(pool,tree,keys,m,r1);
+		RBBatchRank(tree,keys,m,r2);
+		for(i=0;i<m;i++) if(r1[i] != r2[i]) {
+			Error("RBParallelRank: %g instead of %g",r1[i],r2[i]);
+			break;
+		}
+		RBParallelNodeRank(pool,tree,nodes,m,r1);
+		for(i=0;i<m;i++) if(r1[i] != GetNodeRank(tree,nodes[i])) {
+			Error("RBParallelNodeRank: %g instead of %g",r1[i],GetNodeRank(tree,nodes[i]));
+			break;
+		}
+		RBParallelQuery(pool,tree,keys,m,found);
+		for(i=0;i<m;i++) {
+			rb_red_blk_node* x = RBExactQuery(tree,keys[i]);
+			if((x == 0) != (found[i] == 0) || (x && found[i]->key != x->key)) {
+				Error("RBParallelQuery: wrong result for key %ld",(long)(int64_t)keys[i]);
+				break;
+			}
+		}
+		RBQueryPoolDestroy(pool);
+	}
+	free(keys);
+	free(nodes);
+	free(found);
+	free(r1);
+	free(r2);
+	RBTreeDestroy(tree);
+}
+
+
+/* the tree recovered from the checkpoint and the log is the same */
+static void TestLog(unsigned int N) {
+	char logPath[4096], ckpPath[4096];
+	rb_red_blk_tree* tree = NewTree();
+	rb_red_blk_tree* tree2;
+	rb_red_blk_node** nodes = (rb_red_blk_node**)SafeMalloc(sizeof(rb_red_blk_node*)*(N+1));
+	unsigned int* count = (unsigned int*)SafeMalloc(sizeof(unsigned int)*KEYS);
+	rb_tree_log* log;
+	size_t n = 0;
+	unsigned int i;
+	int policy;
+
+	snprintf(logPath,sizeof(logPath),"%s/moduletest.log",tmpDir);
+	snprintf(ckpPath,sizeof(ckpPath),"%s/moduletest.ckp",tmpDir);
+	RandomWeights();
+	for(policy = RB_LOG_SYNC_NONE; policy <= RB_LOG_SYNC_INTERVAL; policy++) {
+		unlink(logPath);
+		unlink(ckpPath);
+		RBTreeDestroy(tree);
+		tree = NewTree();
+		memset(count,0,sizeof(unsigned int)*KEYS);
+		n = 0;
+		tree2 = NewTree();
+		if(RBLogRecover(tree2,ckpPath,logPath,&RBLogCodecInt64) != 0 || tree2->root->left != tree2->nil)
+			Error("RBLogRecover: failed without files");
+		RBTreeDestroy(tree2);
+
+		log = RBLogOpen(logPath,&RBLogCodecInt64,policy,0.001);
+		if(!log) {
+			Error("RBLogOpen failed for %s",logPath);
+			break;
+		}
+		for(i=0;i<N;i++) {
+			int op = rand()%6;
+			if(n > 0 && op == 0) {
+				size_t j = rand()%n;
+				count[(int64_t)nodes[j]->key]--;
+				if(RBLogTreeDelete(log,tree,nodes[j]) != 0) Error("RBLogTreeDelete failed");
+				nodes[j] = nodes[--n];
+			}
+			else if(n > 0 && op == 1) {
+				/* all nodes with the key get the new weight at recovery */
+				size_t j = rand()%n;
+				W[(int64_t)nodes[j]->key] = (double)(rand()%20);
+				if(RBLogTreeUpdate(log,tree,nodes[j]) != 0) Error("RBLogTreeUpdate failed");
+			}
+			else {
+				int64_t k = RandKey();
+				nodes[n] = RBLogTreeInsert(log,tree,(void*)k,0);
+				if(nodes[n] == 0) {
+					Error("RBLogTreeInsert failed");
+					break;
+				}
+				n++;
+				count[k]++;
+			}
+			if(i % 100 == 0 && RBLogCommit(log) != 0) Error("RBLogCommit failed");
+			if(i == N/2 && RBLogCheckpoint(log,tree,ckpPath) != 0) Error("RBLogCheckpoint failed");
+		}
+		RBLogClose(log);
+
+		/* the weights are those at the end; update all nodes the same way */
+		{
+			rb_red_blk_node* x;
+			for(x = TreeFirst(tree); x != tree->nil; x = TreeSuccessor(tree,x)) RBUpdateWeight(tree,x);
+		}
+		tree2 = NewTree();
+		if(RBLogRecover(tree2,ckpPath,logPath,&RBLogCodecInt64) != 0) Error("RBLogRecover failed");
+		if(!SameKeys(tree2,count)) Error("RBLogRecover: the recovered keys differ (policy %d)",policy);
+		if(!Close(RBTreeTotal(tree2),RBTreeTotal(tree),RBTreeTotal(tree))) Error("RBLogRecover: the recovered total differs");
+		RBTreeDestroy(tree2);
+
+		/* a record which was not written completely is ignored */
+		{
+			FILE* f = fopen(logPath,"ab");
+			if(f) {
+				fputc(1,f);
+				fputc(2,f);
+				fputc(3,f);
+				fclose(f);
+			}
+			tree2 = NewTree();
+			if(RBLogRecover(tree2,ckpPath,logPath,&RBLogCodecInt64) != 0) Error("RBLogRecover failed with a torn record");
+			if(!SameKeys(tree2,count)) Error("RBLogRecover: wrong keys with a torn record");
+			RBTreeDestroy(tree2);
+		}
+
+		/* appending after the recovery */
+		log = RBLogOpen(logPath,&RBLogCodecInt64,RB_LOG_SYNC_COMMIT,0.0);
+		if(log) {
+			RBLogTreeInsert(log,tree,(void*)(int64_t)7,0);
+			count[7]++;
+			RBLogClose(log);
+			tree2 = NewTree();
+			if(RBLogRecover(tree2,ckpPath,logPath,&RBLogCodecInt64) != 0 || !SameKeys(tree2,count))
+				Error("RBLogRecover: wrong keys after appending to a recovered log");
+			RBTreeDestroy(tree2);
+		}
+
+		/* after a failed write, the operations are refused and the tree
+		 * is not changed (the writes go to /dev/full, if there is one) */
+		log = RBLogOpen(logPath,&RBLogCodecInt64,RB_LOG_SYNC_NONE,0.0);
+		if(log) {
+			int full = open("/dev/full",O_WRONLY);
+			if(full >= 0 && dup2(full,log->fd) >= 0) {
+				uint64_t written = log->written;
+				rb_red_blk_node* x;
+				RBLogTreeInsert(log,tree,(void*)(int64_t)8,0); /* only buffered */
+				count[8]++;
+				if(RBLogCommit(log) == 0) Error("RBLogCommit: no error after a failed write");
+				if(log->written != written) Error("RBLogCommit: failed write counted as written");
+				x = TreeFirst(tree);
+				if(RBLogTreeInsert(log,tree,(void*)(int64_t)9,0) != 0) Error("RBLogTreeInsert: done after a failed write");
+				if(RBLogTreeDelete(log,tree,x) == 0) Error("RBLogTreeDelete: done after a failed write");
+				if(RBLogTreeUpdate(log,tree,x) == 0) Error("RBLogTreeUpdate: done after a failed write");
+				if(!SameKeys(tree,count)) Error("RBLogTree...: the tree changed after a failed write");
+			}
+			if(full >= 0) close(full);
+			RBLogClose(log);
+		}
+	}
+	unlink(logPath);
+	unlink(ckpPath);
+	RBTreeDestroy(tree);
+	free(nodes);
+	free(count);
+}
+
+
+/* range tree: dominance and rectangle sums by brute force */
+typedef struct {
+	int64_t x;
+	int64_t y;
+	double w;
+} test_point;
+
+static int PointCmpX(const void* a, const void* b) {
+	int64_t i = ((const test_point*)a)->x;
+	int64_t j = ((const test_point*)b)->x;
+	return i > j ? 1 : (i < j ? -1 : 0);
+}
+
+static int PointCmpY(const void* a, const void* b) {
+	int64_t i = ((const test_point*)a)->y;
+	int64_t j = ((const test_point*)b)->y;
+	return i > j ? 1 : (i < j ? -1 : 0);
+}
+
+static double PointWeight(const void* a, const void* par) {
+	return ((const test_point*)a)->w;
+}
+
+static int pointsFreed;
+static void PointFree(void* a) {
+	pointsFreed++;
+	free(a);
+}
+
+static void TestRange(unsigned int N) {
+	rb_range_tree* tree = RangeTreeCreate(PointCmpX,PointCmpY,PointFree,PointWeight,0);
+	size_t maxPoints = N/2 + 1;
+	test_point** live = (test_point**)SafeMalloc(sizeof(test_point*)*maxPoints);
+	rb_range_point** handles = (rb_range_point**)SafeMalloc(sizeof(rb_range_point*)*maxPoints);
+	size_t n = 0, i;
+	unsigned int it;
+	double total = 0.0;
+
+	for(it=0;it<N;it++) {
+		int op = rand()%10;
+		if(op < 6 && n < maxPoints) {
+			test_point* p = (test_point*)SafeMalloc(sizeof(test_point));
+			p->x = rand()%200;
+			p->y = rand()%200;
+			p->w = 1 + rand()%5;
+			live[n] = p;
+			handles[n] = RangeTreeInsert(tree,p);
+			n++;
+		}
+		else if(op < 9 && n > 0) {
+			/* sometimes empty the tree completely */
+			size_t m = (rand()%500 == 0) ? n : 1;
+			while(m-- > 0) {
+				i = rand()%n;
+				RangeTreeDelete(tree,handles[i]);
+				live[i] = live[n-1];
+				handles[i] = handles[n-1];
+				n--;
+			}
+		}
+		else {
+			test_point a, b, lo, hi;
+			double d, bd = 0.0, r, br = 0.0;
+			a.x = rand()%210;
+			a.y = rand()%210;
+			b.x = rand()%210;
+			b.y = rand()%210;
+			lo.x = a.x < b.x ? a.x : b.x;
+			lo.y = a.y < b.y ? a.y : b.y;
+			hi.x = a.x < b.x ? b.x : a.x;
+			hi.y = a.y < b.y ? b.y : a.y;
+			d = RangeTreeDominance(tree,&a,&a);
+			r = RangeTreeRectSum(tree,&lo,&hi,&lo,&hi);
+			for(i=0;i<n;i++) {
+				if(live[i]->x < a.x && live[i]->y < a.y) bd += live[i]->w;
+				if(live[i]->x >= lo.x && live[i]->x < hi.x && live[i]->y >= lo.y && live[i]->y < hi.y) br += live[i]->w;
+			}
+			if(d != bd) Error("RangeTreeDominance: %g instead of %g",d,bd);
+			if(r != br) Error("RangeTreeRectSum: %g instead of %g",r,br);
+		}
+	}
+	for(i=0;i<n;i++) total += live[i]->w;
+	if(RangeTreeSize(tree) != n) Error("RangeTreeSize: %zu instead of %zu",RangeTreeSize(tree),n);
+	if(RangeTreeTotal(tree) != total) Error("RangeTreeTotal: %g instead of %g",RangeTreeTotal(tree),total);
+	pointsFreed = 0;
+	RangeTreeDestroy(tree);
+	if((size_t)pointsFreed != n) Error("RangeTreeDestroy: %d points freed instead of %zu",pointsFreed,n);
+	free(live);
+	free(handles);
+}
+
+
+/* approximate CDF: the error of the CDF and the quantiles is about eps */
+static int CmpDouble(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static double SqrtWeight(double x, void* wparam) {
+	return sqrt(x);
+}
+
+static void TestApprox(unsigned int N) {
+	double eps = 0.01;
+	size_t n = 10*N;
+	double* v = (double*)SafeMalloc(sizeof(double)*n);
+	double* prefix = (double*)SafeMalloc(sizeof(double)*(n+1));
+	int mode;
+	for(mode=0;mode<3;mode++) {
+		rb_approx_cdf* cdf = ApproxCDFCreate(eps,mode == 2 ? SqrtWeight : 0,0);
+		double maxErr = 0.0, maxQErr = 0.0, prevQ = -HUGE_VAL;
+		size_t i;
+		int j;
+		for(i=0;i<n;i++) {
+			double u = ((double)rand() + 0.5) / ((double)RAND_MAX + 1.0);
+			v[i] = (mode == 0) ? 100.0*u : ((mode == 1) ? -log(u) : (double)(i%1000)*0.5 + u);
+			ApproxCDFInsert(cdf,v[i]);
+		}
+		if(cdf->nodes > (size_t)ceil(4.0/eps) + 2) Error("%zu buckets for eps = %g",cdf->nodes,eps);
+		qsort(v,n,sizeof(double),CmpDouble);
+		prefix[0] = 0.0;
+		for(i=0;i<n;i++) prefix[i+1] = prefix[i] + (mode == 2 ? sqrt(v[i]) : 1.0);
+		if(!Close(ApproxCDFRank(cdf,v[n-1] + 1.0),prefix[n],prefix[n])) Error("ApproxCDFRank: wrong total");
+		for(j=1;j<200;j++) {
+			double p = j/200.0;
+			size_t a = (size_t)(p*n), lo = 0, hi = n;
+			double r = prefix[a]/prefix[n];
+			double q;
+			double e = fabs(ApproxCDF(cdf,v[a]) - r);
+			if(e > maxErr) maxErr = e;
+			q = ApproxCDFQuantile(cdf,r);
+			if(q < prevQ) Error("ApproxCDFQuantile is not monotone");
+			prevQ = q;
+			while(lo < hi) {
+				size_t m = (lo+hi)/2;
+				if(v[m] < q) lo = m+1;
+				else hi = m;
+			}
+			e = fabs(prefix[lo]/prefix[n] - r);
+			if(e > maxQErr) maxQErr = e;
+		}
+		if(maxErr > eps || maxQErr > eps) Error("error of the CDF %g, of the quantiles %g (eps = %g)",maxErr,maxQErr,eps);
+		i = cdf->nodes;
+		ApproxCDFCompress(cdf);
+		if(cdf->nodes > i) Error("ApproxCDFCompress: more buckets");
+		if(fabs(ApproxCDF(cdf,v[n/2]) - prefix[n/2]/prefix[n]) > 2*eps) Error("ApproxCDFCompress: wrong CDF");
+		ApproxCDFDestroy(cdf);
+	}
+	free(v);
+	free(prefix);
+}
+
+
+/* sampling: the generators, and the frequencies of the nodes drawn */
+static double CountingUniform(void* state) {
+	unsigned int* calls = (unsigned int*)state;
+	(*calls)++;
+	return 0.5;
+}
+
+/* chi-square statistic of the counts of the keys [0,k) (weights in W) */
+static double ChiSquare(const double* cnt, int k, double m) {
+	double total = 0.0, chi = 0.0;
+	int i;
+	for(i=0;i<k;i++) total += W[i];
+	for(i=0;i<k;i++) if(W[i] > 0.0) {
+		double e = m*W[i]/total;
+		chi += (cnt[i]-e)*(cnt[i]-e)/e;
+	}
+	return chi;
+}
+
+static void TestSampler(unsigned int N) {
+	rb_rng rng, rng2, child;
+	rb_red_blk_tree* tree = NewTree();
+	int k = 20; /* keys of the tree; chi-square with k-1 degrees of freedom */
+	size_t m = 10*N, i;
+	rb_red_blk_node** out = (rb_red_blk_node**)SafeMalloc(sizeof(rb_red_blk_node*)*m);
+	double cnt[20];
+	unsigned int calls = 0;
+	int v;
+
+	/* the generators */
+	RBRngSeed(&rng,12345);
+	RBRngSeed(&rng2,12345);
+	for(i=0;i<1000;i++) {
+		double u = RBRngUniform(&rng);
+		if(u != RBRngUniform(&rng2)) Error("RBRngSeed: different sequences with the same seed");
+		if(!(u >= 0.0 && u < 1.0)) Error("RBRngUniform: %g is not in [0,1)",u);
+	}
+	RBRngSplit(&rng,&child);
+	if(RBRngUniform(&child) != RBRngUniform(&rng2)) Error("RBRngSplit: the child does not continue the sequence");
+	if(RBRngUniform(&rng) == RBRngUniform(&rng2)) Error("RBRngSplit: the parent did not jump ahead");
+	RBRngSetFunc(&rng2,CountingUniform,&calls);
+	if(RBRngUniform(&rng2) != 0.5 || calls != 1) Error("RBRngSetFunc: the user generator is not used");
+
+	RBSample(tree,&rng,1,out);
+	if(out[0] != tree->nil) Error("RBSample: not nil for an empty tree");
+	for(i=0;i<(size_t)k;i++) {
+		W[i] = (double)(i%4);
+		RBTreeInsert(tree,(void*)(int64_t)i,0);
+	}
+	for(v=0;v<2;v++) {
+		memset(cnt,0,sizeof(cnt));
+		if(v == 0) RBSample(tree,&rng,m,out);
+		else RBSampleSorted(tree,&rng,m,out);
+		for(i=0;i<m;i++) {
+			int64_t key = (int64_t)out[i]->key;
+			if(W[key] == 0.0) Error("node with zero weight drawn");
+			if(v == 1 && i > 0 && (int64_t)out[i-1]->key > key) {
+				Error("RBSampleSorted: the result is not sorted");
+				break;
+			}
+			cnt[key]++;
+		}
+		/* 5 of the keys have zero weight: 14 degrees of freedom, p < 1e-6 above 50 */
+		if(ChiSquare(cnt,k,(double)m) > 50.0) Error("%s: chi-square %g",v ? "RBSampleSorted" : "RBSample",ChiSquare(cnt,k,(double)m));
+	}
+
+	/* without replacement: the first draw has the same distribution */
+	memset(cnt,0,sizeof(cnt));
+	for(i=0;i<m/10;i++) {
+		rb_red_blk_node* o[3];
+		size_t d = RBSampleDistinct(tree,&rng,3,o);
+		if(d != 3 || o[0] == o[1] || o[0] == o[2] || o[1] == o[2]) {
+			Error("RBSampleDistinct: wrong sample");
+			break;
+		}
+		cnt[(int64_t)o[0]->key]++;
+	}
+	if(ChiSquare(cnt,k,(double)(m/10)) > 50.0) Error("RBSampleDistinct: chi-square %g",ChiSquare(cnt,k,(double)(m/10)));
+	if(RBSampleDistinct(tree,&rng,m,out) != 15) Error("RBSampleDistinct: not all nodes with positive weight drawn");
+	if(!Close(RBTreeTotal(tree),30.0,30.0)) Error("RBSampleDistinct: the total changed");
+	free(out);
+	RBTreeDestroy(tree);
+}
+
+
+/* hardware counters: whichever are available give sensible numbers */
+static void TestPerf(unsigned int N) {
+	rb_red_blk_tree* tree = NewTree();
+	rb_perf perf;
+	int available, c, open = 0;
+	unsigned int i;
+	FILE* f;
+
+	RandomWeights();
+	for(i=0;i<N;i++) RBTreeInsert(tree,(void*)RandKey(),0);
+	available = RBPerfOpen(&perf);
+	for(c=0;c<RB_PERF_NCOUNTERS;c++) if(perf.fd[c] >= 0) open++;
+	if(available != open || available < 0 || available > RB_PERF_NCOUNTERS) Error("RBPerfOpen: %d counters reported, %d open",available,open);
+	RBPerfStart(&perf);
+	for(i=0;i<N;i++) RBExactQuery(tree,(void*)RandKey());
+	RBPerfStop(&perf,N);
+	if(perf.ops != N) Error("RBPerfStop: %lu operations instead of %u",(unsigned long)perf.ops,N);
+	for(c=0;c<RB_PERF_NCOUNTERS;c++) {
+		double x = RBPerfPerOp(&perf,c);
+		if(perf.fd[c] < 0 ? x != -1.0 : x < 0.0) Error("RBPerfPerOp: %g for counter %d",x,c);
+	}
+	f = tmpfile();
+	if(f) {
+		RBPerfPrint(&perf,f,"query");
+		if(ftell(f) <= 0) Error("RBPerfPrint: nothing written");
+		fclose(f);
+	}
+	RBPerfReset(&perf);
+	if(perf.ops != 0) Error("RBPerfReset: the totals are not cleared");
+	RBPerfClose(&perf);
+	RBTreeDestroy(tree);
+}
+
+
+typedef struct {
+	const char* name;
+	void (*Run)(unsigned int N);
+} module_test;
+
+static const module_test tests[] = {
+	{"sharded_tree", TestSharded},
+	{"combining_tree", TestCombining},
+	{"query_pool", TestQueryPool},
+	{"tree_log", TestLog},
+	{"range_tree", TestRange},
+	{"approx_cdf", TestApprox},
+	{"sampler", TestSampler},
+	{"tree_perf", TestPerf},
+	{0, 0}
+};
+
+
+int main(int argc, char** argv) {
+	unsigned int N = 20000;
+	unsigned int seed = (unsigned int)time(0);
+	int verbose = 0;
+	int i;
+
+	for(i=1;i<argc;i++) if(argv[i][0] == '-') switch(argv[i][1]) {
+		case 'N':
+			if(i+1 < argc) N = atoi(argv[i+1]);
+			break;
+		case 's':
+			if(i+1 < argc) seed = atoi(argv[i+1]);
+			break;
+		case 'd':
+			if(i+1 < argc) tmpDir = argv[i+1];
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr,"unrecognized parameter: %s!\n",argv[i]);
+			break;
+	}
+	if(N < 100) N = 100;
+
+	srand(seed);
+	for(i=0;tests[i].name;i++) {
+		int before = errors;
+		testName = tests[i].name;
+		if(verbose) fprintf(stderr,"%s\n",testName);
+		tests[i].Run(N);
+		if(errors > before) fprintf(stderr,"%s: %d errors\n",testName,errors - before);
+	}
+
+	if(errors) {
+		fprintf(stderr,"%d errors (seed: %u)\n",errors,seed);
+		return 1;
+	}
+	fprintf(stderr,"all tests passed (seed: %u)\n",seed);
+	return 0;
+}
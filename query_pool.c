@@ -0,0 +1,204 @@
+#include "query_pool.h"
+#include <string.h>
+#ifndef RB_NO_THREADS
+#include <unistd.h>
+#endif
+
+/*  parallel read-only queries, see query_pool.h */
+
+#define RB_QUERY_CHUNK 1024 /* queries taken by a worker at once */
+
+#define RB_QUERY_FIND 0
+#define RB_QUERY_RANK 1
+#define RB_QUERY_NODERANK 2
+
+
+/***********************************************************************
+ * answer chunks of queries of the current job until there is none left;
+ * the tree structure is copied, so the counters (with RB_STATS) are
+ * updated in the copy only (the nodes are shared, but only read)
+ ***********************************************************************/
+static void QueryRun(rb_query_pool* pool) {
+     rb_red_blk_tree t = *(pool->tree);
+     size_t m = pool->m;
+#ifdef RB_STATS
+     memset(&(t.stats),0,sizeof(rb_tree_stats));
+#endif
+     for(;;) {
+          size_t i = __atomic_fetch_add(&(pool->next),RB_QUERY_CHUNK,__ATOMIC_RELAXED);
+          size_t n, j;
+          if(i >= m) break;
+          n = (m - i < RB_QUERY_CHUNK) ? m - i : RB_QUERY_CHUNK;
+          switch(pool->op) {
+               case RB_QUERY_FIND:
+                    RBBatchQuery(&t,pool->keys + i,n,(rb_red_blk_node**)(pool->out) + i);
+                    break;
+               case RB_QUERY_RANK:
+                    RBBatchRank(&t,pool->keys + i,n,(double*)(pool->out) + i);
+                    break;
+               case RB_QUERY_NODERANK:
+                    for(j=i;j<i+n;j++) ((double*)(pool->out))[j] = GetNodeRank(&t,pool->nodes[j]);
+                    break;
+          }
+     }
+#ifdef RB_STATS
+     {
+          uint64_t* dst = (uint64_t*)&(pool->stats);
+          uint64_t* src = (uint64_t*)&(t.stats);
+          size_t k;
+#ifndef RB_NO_THREADS
+          pthread_mutex_lock(&(pool->lock));
+#endif
+          for(k=0;k<sizeof(rb_tree_stats)/sizeof(uint64_t);k++) dst[k] += src[k];
+#ifndef RB_NO_THREADS
+          pthread_mutex_unlock(&(pool->lock));
+#endif
+     }
+#endif
+}
+
+#ifndef RB_NO_THREADS
+static void* QueryWorker(void* arg) {
+     rb_query_pool* pool = (rb_query_pool*)arg;
+     unsigned int seen = 0;
+     pthread_mutex_lock(&(pool->lock));
+     for(;;) {
+          while(!pool->stop && pool->job == seen) pthread_cond_wait(&(pool->start),&(pool->lock));
+          if(pool->stop) break;
+          seen = pool->job;
+          pthread_mutex_unlock(&(pool->lock));
+          QueryRun(pool);
+          pthread_mutex_lock(&(pool->lock));
+          if(--(pool->running) == 0) pthread_cond_signal(&(pool->done));
+     }
+     pthread_mutex_unlock(&(pool->lock));
+     return 0;
+}
+#endif
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBQueryPoolCreate */
+/**/
+/*    INPUTS:  nthreads is the number of threads to use for the queries */
+/*             (including the calling thread), or 0 to use the number of */
+/*             online CPUs */
+/**/
+/*    OUTPUT:  a new pool, with nthreads-1 worker threads started */
+/***********************************************************************/
+
+rb_query_pool* RBQueryPoolCreate(unsigned int nthreads) {
+     rb_query_pool* pool = (rb_query_pool*)SafeMalloc(sizeof(rb_query_pool));
+     pool->nthreads = 0;
+     pool->tree = 0;
+     pool->next = 0;
+     pool->running = 0;
+     pool->job = 0;
+     pool->stop = 0;
+#ifndef RB_NO_THREADS
+     unsigned int i;
+     if(nthreads == 0) {
+          long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+          nthreads = (ncpu > 0) ? (unsigned int)ncpu : 1;
+     }
+     pthread_mutex_init(&(pool->lock),0);
+     pthread_cond_init(&(pool->start),0);
+     pthread_cond_init(&(pool->done),0);
+     pool->threads = (pthread_t*)SafeMalloc(sizeof(pthread_t)*nthreads);
+     for(i=0;i+1<nthreads;i++) {
+          if(pthread_create(pool->threads + i,0,QueryWorker,pool)) break;
+          pool->nthreads++;
+     }
+#endif
+     return pool;
+}
+
+void RBQueryPoolDestroy(rb_query_pool* pool) {
+#ifndef RB_NO_THREADS
+     unsigned int i;
+     pthread_mutex_lock(&(pool->lock));
+     pool->stop = 1;
+     pthread_cond_broadcast(&(pool->start));
+     pthread_mutex_unlock(&(pool->lock));
+     for(i=0;i<pool->nthreads;i++) pthread_join(pool->threads[i],0);
+     pthread_mutex_destroy(&(pool->lock));
+     pthread_cond_destroy(&(pool->start));
+     pthread_cond_destroy(&(pool->done));
+     free(pool->threads);
+#endif
+     free(pool);
+}
+
+
+/***********************************************************************
+ * run a job on the workers and the calling thread, and wait for it
+ ***********************************************************************/
+static void QueryJob(rb_query_pool* pool, int op, const rb_red_blk_tree* tree,
+          void* const* keys, rb_red_blk_node* const* nodes, size_t m, void* out) {
+     pool->op = op;
+     pool->tree = tree;
+     pool->keys = keys;
+     pool->nodes = nodes;
+     pool->m = m;
+     pool->out = out;
+     pool->next = 0;
+#ifdef RB_STATS
+     memset(&(pool->stats),0,sizeof(rb_tree_stats));
+#endif
+#ifndef RB_NO_THREADS
+     pthread_mutex_lock(&(pool->lock));
+     pool->running = pool->nthreads;
+     pool->job++;
+     pthread_cond_broadcast(&(pool->start));
+     pthread_mutex_unlock(&(pool->lock));
+#endif
+     QueryRun(pool);
+#ifndef RB_NO_THREADS
+     pthread_mutex_lock(&(pool->lock));
+     while(pool->running > 0) pthread_cond_wait(&(pool->done),&(pool->lock));
+     pthread_mutex_unlock(&(pool->lock));
+#endif
+#ifdef RB_STATS
+     {
+          uint64_t* dst = (uint64_t*)&(((rb_red_blk_tree*)tree)->stats);
+          uint64_t* src = (uint64_t*)&(pool->stats);
+          size_t k;
+          for(k=0;k<sizeof(rb_tree_stats)/sizeof(uint64_t);k++) dst[k] += src[k];
+     }
+#endif
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBParallelQuery */
+/**/
+/*    EFFECT:  nodes[i] is set to a node with key equal to keys[i] (as */
+/*             RBExactQuery), or 0 if there is none */
+/***********************************************************************/
+
+void RBParallelQuery(rb_query_pool* pool, const rb_red_blk_tree* tree, void* const* keys, size_t m, rb_red_blk_node** nodes) {
+     QueryJob(pool,RB_QUERY_FIND,tree,keys,0,m,nodes);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBParallelRank */
+/**/
+/*    EFFECT:  out[i] is set to the sum of DistFunc over the nodes with */
+/*             key smaller than keys[i] (as RBBatchRank; divided by */
+/*             RBTreeTotal(tree), this is the CDF) */
+/***********************************************************************/
+
+void RBParallelRank(rb_query_pool* pool, const rb_red_blk_tree* tree, void* const* keys, size_t m, double* out) {
+     QueryJob(pool,RB_QUERY_RANK,tree,keys,0,m,out);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBParallelNodeRank */
+/**/
+/*    EFFECT:  out[i] is set to GetNodeRank(tree,nodes[i]) */
+/***********************************************************************/
+
+void RBParallelNodeRank(rb_query_pool* pool, const rb_red_blk_tree* tree, rb_red_blk_node* const* nodes, size_t m, double* out) {
+     QueryJob(pool,RB_QUERY_NODERANK,tree,0,nodes,m,out);
+}
+
@@ -0,0 +1,70 @@
+#ifndef QUERY_POOL_H
+#define QUERY_POOL_H
+
+#include "red_black_tree.h"
+#ifndef RB_NO_THREADS
+#include <pthread.h>
+#endif
+
+/**************************************************
+ * parallel read-only queries on a tree which is not modified
+ *
+ * a pool of worker threads (created once, reused by each call) splits
+ * an array of queries into chunks; each worker takes the next chunk and
+ * answers it with the batched lookups (RBBatchQuery, RBBatchRank) or
+ * GetNodeRank; the calling thread works on the chunks as well
+ *
+ * nothing shared is written during the queries: the lookups used here
+ * only read the nodes (including nil and root; GetNodeRank does not
+ * store its result, unlike GetNodeRankCached); each worker uses its own
+ * copy of the rb_red_blk_tree structure, so that the counters of
+ * RB_STATS are not shared either (they are added to the tree at the
+ * end); with the treap engine, the priorities of the nodes found are
+ * not increased (as with RBExactQuery, unlike with RBTreeAccess)
+ *
+ * the tree must not be modified while a query runs; Compare and
+ * DistFunc are called from several threads at the same time
+ *
+ * with RB_NO_THREADS, all work is done in the calling thread
+ **************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rb_query_pool {
+  unsigned int nthreads; /* worker threads, besides the calling one */
+  /* current job */
+  int op;
+  const rb_red_blk_tree* tree;
+  void* const* keys;
+  rb_red_blk_node* const* nodes;
+  size_t m;
+  void* out;
+  size_t next; /* first query not taken by a worker yet, accessed atomically */
+  unsigned int running; /* workers still working on the job */
+  unsigned int job; /* incremented for each job */
+  int stop;
+#ifdef RB_STATS
+  rb_tree_stats stats; /* counters of the workers for the current job */
+#endif
+#ifndef RB_NO_THREADS
+  pthread_t* threads;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+#endif
+} rb_query_pool;
+
+rb_query_pool* RBQueryPoolCreate(unsigned int nthreads); //!! nthreads == 0: one thread per online CPU
+void RBQueryPoolDestroy(rb_query_pool*);
+void RBParallelQuery(rb_query_pool*, const rb_red_blk_tree*, void* const* keys, size_t m, rb_red_blk_node** nodes); //!! RBExactQuery for each key
+void RBParallelRank(rb_query_pool*, const rb_red_blk_tree*, void* const* keys, size_t m, double* out); //!! sum of DistFunc below each key
+void RBParallelNodeRank(rb_query_pool*, const rb_red_blk_tree*, rb_red_blk_node* const* nodes, size_t m, double* out); //!! GetNodeRank for each node
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,377 @@
+#include "range_tree.h"
+#include <string.h>
+
+/*  two-dimensional weighted range tree, see range_tree.h */
+
+
+/***********************************************************************
+ * callbacks for the inner trees: the keys are rb_range_point pointers,
+ * ordered by y; points with equal y are ordered by their address, so
+ * that each point can be found exactly; a query point (node == 0) is
+ * before all points with the same y
+ ***********************************************************************/
+static int RangePointCmp(const void* a, const void* b) {
+     const rb_range_point* p = (const rb_range_point*)a;
+     const rb_range_point* q = (const rb_range_point*)b;
+     int c = p->CompY(p->key,q->key);
+     if(c) return c;
+     if(p->node == 0 || q->node == 0) {
+          if(p->node == q->node) return 0;
+          return (p->node == 0) ? -1 : 1;
+     }
+     if(p < q) return -1;
+     if(p > q) return 1;
+     return 0;
+}
+
+static double RangePointWeight(const void* a, const void* par) {
+     return ((const rb_range_point*)a)->weight;
+}
+
+static void RangeNullDest(void* a) {
+     ;
+}
+
+static rb_red_blk_tree* RangeInnerCreate(void) {
+     return RBTreeCreate(RangePointCmp,RangeNullDest,RangeNullDest,NullFunction,
+          RangeNullDest,RangePointWeight,0);
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RangeTreeCreate */
+/**/
+/*    INPUTS:  CompX and CompY compare two keys by their x and y */
+/*             coordinates (returning 1, -1 or 0 as Compare in */
+/*             red_black_tree.h), DestFunc destroys a key when its */
+/*             point is deleted, DistFunc(key,dfparam) is the weight */
+/**/
+/*    OUTPUT:  a new, empty tree */
+/***********************************************************************/
+
+rb_range_tree* RangeTreeCreate(int (*CompX)(const void*, const void*),
+			      int (*CompY)(const void*, const void*),
+			      void (*DestFunc)(void*),
+			      double (*DistFunc)(const void*, const void*),
+			      void* dfparam) {
+     rb_range_tree* tree = (rb_range_tree*)SafeMalloc(sizeof(rb_range_tree));
+     tree->root = 0;
+     tree->n = 0;
+     tree->maxN = 0;
+     tree->CompX = CompX;
+     tree->CompY = CompY;
+     tree->DestroyKey = DestFunc;
+     tree->DistFunc = DistFunc;
+     tree->dfparam = dfparam;
+     return tree;
+}
+
+
+/***********************************************************************
+ * rebuilding a subtree: its points are collected in x order, and a
+ * perfectly balanced subtree is built from them; the points of each new
+ * subtree are sorted by y along the way (merging the sorted halves), and
+ * the inner trees are filled in this order with RBTreeInsertHint
+ ***********************************************************************/
+static void RangeCollect(rb_range_node* v, rb_range_point** xs, size_t* m) {
+     while(v) {
+          rb_range_node* r = v->right;
+          RangeCollect(v->left,xs,m);
+          xs[(*m)++] = v->point;
+          RBTreeDestroy(v->inner);
+          free(v);
+          v = r;
+     }
+}
+
+static rb_range_node* RangeBuild(rb_range_point** xs, rb_range_point** ys, rb_range_point** tmp,
+          size_t lo, size_t hi, rb_range_node* parent) {
+     rb_range_node* v;
+     rb_red_blk_node* hint = 0;
+     size_t mid, i, j, k;
+     if(lo >= hi) return 0;
+     mid = lo + (hi - lo)/2;
+     v = (rb_range_node*)SafeMalloc(sizeof(rb_range_node));
+     v->point = xs[mid];
+     v->point->node = v;
+     v->parent = parent;
+     v->size = hi - lo;
+     v->left = RangeBuild(xs,ys,tmp,lo,mid,v);
+     v->right = RangeBuild(xs,ys,tmp,mid+1,hi,v);
+
+     /* ys[lo..mid) and ys[mid+1..hi) are sorted by y, ys[mid] is the */
+     /* point of v: move it to its place in the right part, then merge */
+     for(i=mid; i+1<hi && RangePointCmp(ys[i+1],ys[i]) < 0; i++) {
+          rb_range_point* p = ys[i];
+          ys[i] = ys[i+1];
+          ys[i+1] = p;
+     }
+     for(i=lo,j=mid,k=lo; k<hi; k++) {
+          if(j >= hi || (i < mid && RangePointCmp(ys[i],ys[j]) < 0)) tmp[k] = ys[i++];
+          else tmp[k] = ys[j++];
+     }
+     memcpy(ys + lo,tmp + lo,sizeof(rb_range_point*)*(hi - lo));
+
+     v->inner = RangeInnerCreate();
+     for(k=lo;k<hi;k++) hint = RBTreeInsertHint(v->inner,hint,ys[k],0);
+     return v;
+}
+
+/* rebuild the subtree of v, returns its new root */
+static rb_range_node* RangeRebuild(rb_range_node* v) {
+     rb_range_node* parent = v->parent;
+     size_t m = v->size;
+     size_t k = 0;
+     rb_range_point** xs = (rb_range_point**)SafeMalloc(sizeof(rb_range_point*)*3*m);
+     rb_range_point** ys = xs + m;
+     RangeCollect(v,xs,&k);
+     memcpy(ys,xs,sizeof(rb_range_point*)*m);
+     v = RangeBuild(xs,ys,ys + m,0,m,parent);
+     free(xs);
+     return v;
+}
+
+/* replace the child v of its parent (or the root) by w */
+static void RangeReplace(rb_range_tree* tree, rb_range_node* parent, rb_range_node* v, rb_range_node* w) {
+     if(parent == 0) tree->root = w;
+     else if(parent->left == v) parent->left = w;
+     else parent->right = w;
+}
+
+static inline size_t RangeSize(const rb_range_node* v) {
+     return v ? v->size : 0;
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RangeTreeInsert */
+/**/
+/*    INPUTS:  tree is the tree to insert into, key is the new point */
+/**/
+/*    OUTPUT:  the stored point, which can be given to RangeTreeDelete */
+/**/
+/*    EFFECT:  descends the outer tree by x, adding the point to the */
+/*             inner tree of each node on the way, and links it as a new */
+/*             leaf; then rebuilds the highest subtree on the path which */
+/*             is not balanced (if any) */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+rb_range_point* RangeTreeInsert(rb_range_tree* tree, void* key) {
+     rb_range_point* p = (rb_range_point*)SafeMalloc(sizeof(rb_range_point));
+     rb_range_node* v = tree->root;
+     rb_range_node* parent = 0;
+     rb_range_node* z;
+     rb_range_node* scapegoat = 0;
+     int left = 0;
+
+     p->key = key;
+     p->weight = tree->DistFunc(key,tree->dfparam);
+     p->CompY = tree->CompY;
+
+     z = (rb_range_node*)SafeMalloc(sizeof(rb_range_node));
+     z->point = p;
+     z->left = z->right = 0;
+     z->size = 1;
+     z->inner = RangeInnerCreate();
+     p->node = z;
+
+     while(v) {
+          RBTreeInsert(v->inner,p,0);
+          v->size++;
+          parent = v;
+          /* equal x go to the right, as in red_black_tree.c */
+          left = (1 == tree->CompX(v->point->key,key));
+          v = left ? v->left : v->right;
+     }
+     RBTreeInsert(z->inner,p,0);
+     z->parent = parent;
+     if(parent == 0) tree->root = z;
+     else if(left) parent->left = z;
+     else parent->right = z;
+     tree->n++;
+     if(tree->n > tree->maxN) tree->maxN = tree->n;
+
+     for(v = parent; v; v = v->parent) {
+          size_t s = RangeSize(v->left) > RangeSize(v->right) ? RangeSize(v->left) : RangeSize(v->right);
+          if((double)s > RB_RANGE_ALPHA * (double)(v->size)) scapegoat = v;
+     }
+     if(scapegoat) {
+          v = scapegoat->parent;
+          RangeReplace(tree,v,scapegoat,RangeRebuild(scapegoat));
+     }
+     return p;
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RangeTreeDelete */
+/**/
+/*    INPUTS:  tree is the tree in question, p is a point returned by */
+/*             RangeTreeInsert */
+/**/
+/*    OUTPUT:  none */
+/**/
+/*    EFFECT:  removes p from the inner trees of its node and all nodes */
+/*             above it; if its node has two children, the point of its */
+/*             successor (in x) is moved there and removed from the inner */
+/*             trees between them, and the successor's node is spliced */
+/*             out instead; the whole tree is rebuilt when the number of */
+/*             points falls below RB_RANGE_ALPHA times its largest value */
+/*             since the last rebuild. The key of p is destroyed. */
+/**/
+/*    Modifies Input: tree, p */
+/***********************************************************************/
+
+void RangeTreeDelete(rb_range_tree* tree, rb_range_point* p) {
+     rb_range_node* v = p->node;
+     rb_range_node* w;
+     rb_range_node* c;
+
+     for(w = v; w; w = w->parent) {
+          RBDeleteTopDown(w->inner,p);
+          w->size--;
+     }
+     if(v->left && v->right) {
+          /* move the successor s into v; it is removed from the inner */
+          /* trees of the nodes between v and s (v still has it) */
+          rb_range_node* s = v->right;
+          while(s->left) s = s->left;
+          for(w = s; w != v; w = w->parent) {
+               RBDeleteTopDown(w->inner,s->point);
+               w->size--;
+          }
+          v->point = s->point;
+          v->point->node = v;
+          v = s;
+     }
+     /* v has at most one child, splice it out */
+     c = v->left ? v->left : v->right;
+     if(c) c->parent = v->parent;
+     RangeReplace(tree,v->parent,v,c);
+     RBTreeDestroy(v->inner);
+     free(v);
+     tree->DestroyKey(p->key);
+     free(p);
+     tree->n--;
+
+     if(tree->root == 0) tree->maxN = 0; /* start over when emptied */
+     else if((double)(tree->n) < RB_RANGE_ALPHA * (double)(tree->maxN)) {
+          tree->root = RangeRebuild(tree->root);
+          tree->maxN = tree->n;
+     }
+}
+
+
+/***********************************************************************
+ * sum of the weights in the inner tree of v with y in [ylo,yhi) (where a
+ * bound of 0 means no bound), with one or two rank queries
+ ***********************************************************************/
+static double RangeInnerSum(const rb_range_node* v, const rb_range_point* ylo,
+          const rb_range_point* yhi) {
+     void* keys[2];
+     double r[2];
+     if(ylo && yhi) {
+          keys[0] = (void*)ylo;
+          keys[1] = (void*)yhi;
+          RBSortedRank(v->inner,keys,2,r);
+          return r[1] - r[0];
+     }
+     if(ylo == 0 && yhi == 0) return RBTreeTotal(v->inner);
+     keys[0] = (void*)(ylo ? ylo : yhi);
+     RBSortedRank(v->inner,keys,1,r);
+     return ylo ? RBTreeTotal(v->inner) - r[0] : r[0];
+}
+
+/***********************************************************************
+ * sum of the weights in the subtree of v with x in [xlo,xhi) and y in
+ * [ylo,yhi); loIn / hiIn are nonzero if all points in the subtree are
+ * known to be >= xlo / < xhi in x (or there is no such bound), then the
+ * subtree is answered by its inner tree; only the nodes on the search
+ * paths of xlo and xhi are visited, O(log(n)) inner queries
+ ***********************************************************************/
+static double RangeSum(const rb_range_tree* tree, const rb_range_node* v,
+          const void* xlo, const void* xhi, int loIn, int hiIn,
+          const rb_range_point* ylo, const rb_range_point* yhi) {
+     double sum = 0.0;
+     while(v) {
+          const rb_range_point* p = v->point;
+          if(loIn && hiIn) return sum + RangeInnerSum(v,ylo,yhi);
+          if(!loIn && -1 == tree->CompX(p->key,xlo)) v = v->right; /* v and its left subtree are before xlo */
+          else if(!hiIn && -1 != tree->CompX(p->key,xhi)) v = v->left; /* v and its right subtree are after xhi */
+          else {
+               if((ylo == 0 || RangePointCmp(p,ylo) > 0) && (yhi == 0 || RangePointCmp(p,yhi) < 0))
+                    sum += p->weight;
+               if(v->left) sum += RangeSum(tree,v->left,xlo,xhi,loIn,1,ylo,yhi);
+               v = v->right;
+               loIn = 1;
+          }
+     }
+     return sum;
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RangeTreeDominance */
+/**/
+/*    INPUTS:  tree is the tree in question, qx and qy are keys giving */
+/*             the x and y bound (only CompX is used with qx, and only */
+/*             CompY with qy) */
+/**/
+/*    OUTPUT:  the sum of the weights of the points with x < qx and */
+/*             y < qy (complexity: O(log^2(n))) */
+/***********************************************************************/
+
+double RangeTreeDominance(const rb_range_tree* tree, const void* qx, const void* qy) {
+     rb_range_point y;
+     y.key = (void*)qy;
+     y.CompY = tree->CompY;
+     y.node = 0;
+     return RangeSum(tree,tree->root,0,qx,1,0,0,&y);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RangeTreeRectSum */
+/**/
+/*    INPUTS:  tree is the tree in question, the keys xlo and xhi give */
+/*             the x range, ylo and yhi the y range (as for */
+/*             RangeTreeDominance) */
+/**/
+/*    OUTPUT:  the sum of the weights of the points with xlo <= x < xhi */
+/*             and ylo <= y < yhi (complexity: O(log^2(n))); each */
+/*             subtree is summed directly, not as a difference of */
+/*             dominance queries, so there is less rounding error */
+/***********************************************************************/
+
+double RangeTreeRectSum(const rb_range_tree* tree, const void* xlo, const void* xhi,
+          const void* ylo, const void* yhi) {
+     rb_range_point lo, hi;
+     if(1 == tree->CompY(ylo,yhi)) return 0.0;
+     lo.key = (void*)ylo;
+     hi.key = (void*)yhi;
+     lo.CompY = hi.CompY = tree->CompY;
+     lo.node = hi.node = 0;
+     return RangeSum(tree,tree->root,xlo,xhi,0,0,&lo,&hi);
+}
+
+double RangeTreeTotal(const rb_range_tree* tree) {
+     return tree->root ? RBTreeTotal(tree->root->inner) : 0.0;
+}
+
+size_t RangeTreeSize(const rb_range_tree* tree) {
+     return tree->n;
+}
+
+void RangeTreeDestroy(rb_range_tree* tree) {
+     size_t m = 0;
+     size_t i;
+     rb_range_point** xs = (rb_range_point**)SafeMalloc(sizeof(rb_range_point*)*(tree->n + 1));
+     RangeCollect(tree->root,xs,&m);
+     for(i=0;i<m;i++) {
+          tree->DestroyKey(xs[i]->key);
+          free(xs[i]);
+     }
+     free(xs);
+     free(tree);
+}
+
@@ -0,0 +1,89 @@
+#ifndef RANGE_TREE_H
+#define RANGE_TREE_H
+
+#include "red_black_tree.h"
+
+/**************************************************
+ * two-dimensional weighted range tree
+ *
+ * points (keys) have two coordinates, compared by CompX and CompY, and
+ * a weight DistFunc(key,dfparam); the sum of the weights of the points
+ * with x < qx and y < qy (dominance), or in a rectangle, is computed in
+ * O(log^2(n)) instead of scanning the points; the query coordinates are
+ * given as keys as well, of which only the x (or y) coordinate is used
+ *
+ * the outer tree is a binary search tree on x, each node stores one
+ * point; every node also owns an inner red-black tree of this library,
+ * which has all points of its subtree ordered by y, so the sums of the
+ * inner tree give the weight below any y; a query splits the x range
+ * into O(log(n)) subtrees, and does a rank query in the inner tree of
+ * each of them
+ *
+ * the outer tree is kept balanced as a scapegoat tree: a subtree where
+ * one side has more than RB_RANGE_ALPHA of the nodes is rebuilt after
+ * an insert (the inner trees are built from the points sorted by y, by
+ * RBTreeInsertHint), and the whole tree is rebuilt after enough deletes;
+ * insert and delete update the inner trees of the O(log(n)) nodes above
+ * the point, O(log^2(n)) (plus the amortized cost of the rebuilds,
+ * O(log^3(n)))
+ *
+ * each point is stored in O(log(n)) inner trees, so the memory use is
+ * O(n log(n)); the weight of a point is computed once at insert, and
+ * should not change while the point is in the tree
+ **************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RB_RANGE_ALPHA 0.7
+
+struct rb_range_node;
+
+typedef struct rb_range_point {
+  void* key;
+  double weight; /* DistFunc(key) */
+  int (*CompY)(const void* a, const void* b); /* for ordering the inner trees */
+  struct rb_range_node* node; /* outer node storing this point */
+} rb_range_point;
+
+typedef struct rb_range_node {
+  rb_range_point* point;
+  struct rb_range_node* left;
+  struct rb_range_node* right;
+  struct rb_range_node* parent;
+  rb_red_blk_tree* inner; /* the points of this subtree, by y */
+  size_t size; /* number of nodes in this subtree */
+} rb_range_node;
+
+typedef struct rb_range_tree {
+  rb_range_node* root; /* 0 for an empty tree */
+  size_t n; /* number of points */
+  size_t maxN; /* largest n since the last full rebuild */
+  int (*CompX)(const void* a, const void* b);
+  int (*CompY)(const void* a, const void* b);
+  void (*DestroyKey)(void* a);
+  double (*DistFunc)(const void* a, const void* par);
+  void* dfparam;
+} rb_range_tree;
+
+rb_range_tree* RangeTreeCreate(int (*CompX)(const void*, const void*),
+			      int (*CompY)(const void*, const void*),
+			      void (*DestFunc)(void*),
+			      double (*DistFunc)(const void*, const void*),
+			      void* dfparam);
+rb_range_point* RangeTreeInsert(rb_range_tree*, void* key); //!! the result is valid until the point is deleted
+void RangeTreeDelete(rb_range_tree*, rb_range_point* p);
+double RangeTreeDominance(const rb_range_tree*, const void* qx, const void* qy); //!! sum of the weights of the points with x < qx and y < qy
+double RangeTreeRectSum(const rb_range_tree*, const void* xlo, const void* xhi,
+			const void* ylo, const void* yhi); //!! sum for xlo <= x < xhi and ylo <= y < yhi
+double RangeTreeTotal(const rb_range_tree*);
+size_t RangeTreeSize(const rb_range_tree*);
+void RangeTreeDestroy(rb_range_tree*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,510 @@
+/*  benchmark for the augmented red-black tree
+ *
+ * 	runs the same workloads (insert, exact query, rank, iteration,
+ * 	mixed read / write, delete) on the red-black tree from this library,
+ * 	on std::multiset and on the GNU pb_ds order statistics tree, and
+ * 	writes the results to stdout as CSV (one line per backend and
+ * 	workload: throughput and latency percentiles in nanoseconds)
+ *
+ * 	compile e.g. with:
+ * 	gcc -O2 -c red_black_tree.c misc.c stack.c tree_perf.c
+ * 	g++ -O2 -o rbbench rbbench.cpp red_black_tree.o misc.o stack.o tree_perf.o -lm -lpthread
+ *
+ * 	parameters:
+ * 	-N n       number of elements to insert (default: 1000000)
+ * 	-d dist    key distribution: uniform, sorted, reverse, zipf or dup
+ * 	           (default: uniform)
+ * 	-z s       exponent of the Zipf distribution (default: 1.0)
+ * 	-D k       number of distinct keys for the zipf and dup distributions
+ * 	           (default: 1000)
+ * 	-r f       fraction of reads in the mixed workload (default: 0.9)
+ * 	-l k       measure the latency of every k-th operation (default: 16)
+ * 	-b list    comma-separated list of backends to run: rb, treap, huge
+ * 	           (rb with the nodes on transparent huge pages), multiset,
+ * 	           pbds (default: all)
+ * 	-s seed    random seed
+ * 	-p par     parameter for DFInt64 (default: 1.0)
+ * 	-T         use rdtsc instead of clock_gettime() for the latencies
+ * 	           (x86 only, converted to nanoseconds after a calibration)
+ * 	-H         do not print the CSV header
+ * 	-C         add the cache misses, dTLB misses and branch mispredicts
+ * 	           per operation to the output (from the hardware counters,
+ * 	           see tree_perf.h; -1 if a counter is not available)
+ */
+
+#include "red_black_tree.h"
+#include "tree_perf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define RBBENCH_HAVE_RDTSC 1
+#endif
+
+
+/***********************************************************************
+ * timing
+ ***********************************************************************/
+static int gUseTsc = 0;
+static double gTscNs = 1.0; /* nanoseconds per TSC tick */
+static int gCounters = 0; /* -C: hardware counters for each workload */
+static rb_perf gPerf;
+
+static inline uint64_t NowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ((uint64_t)ts.tv_sec)*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t Ticks() {
+#ifdef RBBENCH_HAVE_RDTSC
+	if(gUseTsc) return __rdtsc();
+#endif
+	return NowNs();
+}
+
+static void CalibrateTsc() {
+#ifdef RBBENCH_HAVE_RDTSC
+	uint64_t t1 = NowNs();
+	uint64_t c1 = __rdtsc();
+	while(NowNs() - t1 < 50000000ULL) ; /* busy wait for 50 ms */
+	uint64_t t2 = NowNs();
+	uint64_t c2 = __rdtsc();
+	gTscNs = ((double)(t2-t1)) / ((double)(c2-c1));
+#else
+	fprintf(stderr,"rdtsc is not available on this platform, using clock_gettime()!\n");
+	gUseTsc = 0;
+#endif
+}
+
+
+/***********************************************************************
+ * random numbers (splitmix64, so that each backend sees the same keys)
+ ***********************************************************************/
+static inline uint64_t Rand64(uint64_t* s) {
+	uint64_t z = (*s += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static inline double RandUniform(uint64_t* s) {
+	return (Rand64(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/***********************************************************************
+ * key generation
+ * keys are positive so that DFInt64 is well defined for any parameter
+ ***********************************************************************/
+enum { DIST_UNIFORM, DIST_SORTED, DIST_REVERSE, DIST_ZIPF, DIST_DUP };
+
+static void GenerateKeys(std::vector<int64_t>& keys, size_t N, int dist,
+		double zipfs, size_t distinct, uint64_t seed) {
+	uint64_t s = seed;
+	size_t i;
+	keys.resize(N);
+	switch(dist) {
+		case DIST_SORTED:
+			for(i=0;i<N;i++) keys[i] = 1 + 16*(int64_t)i;
+			break;
+		case DIST_REVERSE:
+			for(i=0;i<N;i++) keys[i] = 1 + 16*(int64_t)(N-i);
+			break;
+		case DIST_ZIPF: {
+			/* draw ranks from a Zipf distribution, and map them to random keys */
+			std::vector<double> cdf(distinct);
+			std::vector<int64_t> values(distinct);
+			double sum = 0.0;
+			for(i=0;i<distinct;i++) {
+				sum += pow((double)(i+1),-zipfs);
+				cdf[i] = sum;
+				values[i] = 1 + (int64_t)(Rand64(&s) >> 24);
+			}
+			for(i=0;i<N;i++) {
+				double u = RandUniform(&s)*sum;
+				size_t j = std::lower_bound(cdf.begin(),cdf.end(),u) - cdf.begin();
+				if(j >= distinct) j = distinct - 1;
+				keys[i] = values[j];
+			}
+			break;
+		}
+		case DIST_DUP:
+			for(i=0;i<N;i++) keys[i] = 1 + (int64_t)(Rand64(&s) % distinct);
+			break;
+		default:
+			for(i=0;i<N;i++) keys[i] = 1 + (int64_t)(Rand64(&s) >> 24);
+			break;
+	}
+}
+
+
+/***********************************************************************
+ * backends
+ * each stores multiple copies of the same key; element i of the key
+ * array is identified by (keys[i],i) where the backend needs it
+ ***********************************************************************/
+struct RBBackend {
+	static const char* Name() { return "rb"; }
+	static bool HasRank() { return true; }
+	rb_red_blk_tree* tree;
+	std::vector<rb_red_blk_node*> nodes;
+	double par;
+	RBBackend(size_t N, double par_) : nodes(N), par(par_) {
+		tree = RBTreeCreate(CmpInt64,(void(*)(void*))NullFunction,(void(*)(void*))NullFunction,
+			NullFunction,(void(*)(void*))NullFunction,DFInt64,&par);
+	}
+	~RBBackend() { RBTreeDestroy(tree); }
+	inline void Insert(int64_t key, size_t i) { nodes[i] = RBTreeInsert(tree,(void*)key,0); }
+	inline bool Find(int64_t key, size_t i) { return RBExactQuery(tree,(void*)key) != 0; }
+	inline double Rank(int64_t key, size_t i) { return GetNodeRank(tree,nodes[i]); }
+	inline void Erase(int64_t key, size_t i) { RBDelete(tree,nodes[i]); }
+	/* batches of lookups: interleaved searches in the tree */
+	inline double BatchFind(const int64_t* keys, size_t n) {
+		std::vector<rb_red_blk_node*> res(n);
+		size_t j, cnt = 0;
+		RBBatchQuery(tree,(void* const*)keys,n,res.data());
+		for(j=0;j<n;j++) cnt += (res[j] != 0);
+		return (double)cnt;
+	}
+	inline double BatchRank(const int64_t* keys, size_t n) {
+		std::vector<double> res(n);
+		RBBatchRank(tree,(void* const*)keys,n,res.data());
+		return res[n-1];
+	}
+	template<class F> inline void Iterate(F f) {
+		rb_red_blk_node* nil = tree->nil;
+		for(rb_red_blk_node* x = TreeFirst(tree); x != nil; x = TreeSuccessor(tree,x)) f((int64_t)x->key);
+	}
+};
+
+/* the same tree with the treap engine (hot keys move towards the root) */
+struct TreapBackend : public RBBackend {
+	static const char* Name() { return "treap"; }
+	TreapBackend(size_t N, double par_) : RBBackend(N,par_) { RBTreeSetEngine(tree,RB_ENGINE_TREAP); }
+	inline bool Find(int64_t key, size_t i) { return RBTreeAccess(tree,(void*)key) != 0; }
+};
+
+/* the same tree with the nodes allocated on transparent huge pages */
+struct HugeBackend : public RBBackend {
+	static const char* Name() { return "huge"; }
+	HugeBackend(size_t N, double par_) : RBBackend(N,par_) { RBTreeSetNodeStorage(tree,RB_STORAGE_THP); }
+};
+
+struct MultisetBackend {
+	static const char* Name() { return "multiset"; }
+	static bool HasRank() { return false; }
+	std::multiset<int64_t> s;
+	std::vector<std::multiset<int64_t>::iterator> its;
+	MultisetBackend(size_t N, double) : its(N) { }
+	inline void Insert(int64_t key, size_t i) { its[i] = s.insert(key); }
+	inline bool Find(int64_t key, size_t i) { return s.find(key) != s.end(); }
+	inline double Rank(int64_t key, size_t i) { return 0.0; }
+	inline void Erase(int64_t key, size_t i) { s.erase(its[i]); }
+	inline double BatchFind(const int64_t* keys, size_t n) {
+		size_t j, cnt = 0;
+		for(j=0;j<n;j++) cnt += (s.find(keys[j]) != s.end());
+		return (double)cnt;
+	}
+	inline double BatchRank(const int64_t* keys, size_t n) { return 0.0; }
+	template<class F> inline void Iterate(F f) {
+		for(std::multiset<int64_t>::iterator it = s.begin(); it != s.end(); ++it) f(*it);
+	}
+};
+
+struct PBDSBackend {
+	typedef std::pair<int64_t,uint64_t> key_type;
+	typedef __gnu_pbds::tree<key_type,__gnu_pbds::null_type,std::less<key_type>,
+		__gnu_pbds::rb_tree_tag,__gnu_pbds::tree_order_statistics_node_update> tree_type;
+	static const char* Name() { return "pbds"; }
+	static bool HasRank() { return true; }
+	tree_type t;
+	PBDSBackend(size_t, double) { }
+	inline void Insert(int64_t key, size_t i) { t.insert(key_type(key,i)); }
+	inline bool Find(int64_t key, size_t i) {
+		tree_type::iterator it = t.lower_bound(key_type(key,0));
+		return it != t.end() && it->first == key;
+	}
+	inline double Rank(int64_t key, size_t i) { return (double)t.order_of_key(key_type(key,i)); }
+	inline void Erase(int64_t key, size_t i) { t.erase(key_type(key,i)); }
+	inline double BatchFind(const int64_t* keys, size_t n) {
+		size_t j, cnt = 0;
+		for(j=0;j<n;j++) cnt += Find(keys[j],0);
+		return (double)cnt;
+	}
+	inline double BatchRank(const int64_t* keys, size_t n) {
+		size_t j;
+		double sum = 0.0;
+		for(j=0;j<n;j++) sum += (double)t.order_of_key(key_type(keys[j],0));
+		return sum;
+	}
+	template<class F> inline void Iterate(F f) {
+		for(tree_type::iterator it = t.begin(); it != t.end(); ++it) f(it->first);
+	}
+};
+
+
+/***********************************************************************
+ * measurement of one workload
+ * throughput is computed from the total runtime, latencies are measured
+ * for every k-th operation only (so that the timer overhead does not
+ * dominate the throughput)
+ ***********************************************************************/
+struct Phase {
+	std::vector<uint64_t> lat;
+	uint64_t t0;
+	size_t ops;
+	unsigned int every;
+	explicit Phase(unsigned int every_) : t0(0), ops(0), every(every_) { }
+	void Start() {
+		lat.clear();
+		ops = 0;
+		if(gCounters) {
+			RBPerfReset(&gPerf);
+			RBPerfStart(&gPerf);
+		}
+		t0 = NowNs();
+	}
+	void Report(const char* backend, const char* dist, const char* workload, size_t N) {
+		uint64_t t1 = NowNs();
+		double sec = (t1-t0)*1e-9;
+		if(gCounters) RBPerfStop(&gPerf,ops);
+		double p[5] = {0.0,0.0,0.0,0.0,0.0};
+		if(lat.size()) {
+			const double q[4] = {0.5,0.9,0.99,0.999};
+			int j;
+			std::sort(lat.begin(),lat.end());
+			for(j=0;j<4;j++) {
+				size_t k = (size_t)(q[j]*(lat.size()-1));
+				p[j] = lat[k]*gTscNs;
+			}
+			p[4] = lat.back()*gTscNs;
+		}
+		printf("%s,%s,%s,%lu,%lu,%.6f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f",backend,dist,workload,
+			(unsigned long)N,(unsigned long)ops,sec,sec > 0.0 ? ops/sec : 0.0,p[0],p[1],p[2],p[3],p[4]);
+		if(gCounters) printf(",%.3f,%.3f,%.3f",RBPerfPerOp(&gPerf,RB_PERF_CACHE_MISSES),
+			RBPerfPerOp(&gPerf,RB_PERF_DTLB_MISSES),RBPerfPerOp(&gPerf,RB_PERF_BRANCH_MISSES));
+		printf("\n");
+		fflush(stdout);
+	}
+};
+
+/* run op(i) for i in [0,n), and measure the latency of every k-th call */
+template<class OP> static void Measure(Phase& ph, size_t n, OP op) {
+	size_t i;
+	unsigned int k = ph.every;
+	for(i=0;i<n;i++) {
+		if(k && i % k == 0) {
+			uint64_t c1 = Ticks();
+			op(i);
+			uint64_t c2 = Ticks();
+			ph.lat.push_back(c2-c1);
+		}
+		else op(i);
+	}
+	ph.ops += n;
+}
+
+static volatile double gSink; /* prevents the compiler from removing lookups */
+
+template<class B> static void RunBackend(const std::vector<int64_t>& keys, const char* dist,
+		double par, double readFrac, unsigned int every, uint64_t seed) {
+	size_t N = keys.size();
+	/* the mixed workload replaces deleted elements with new ones: reserve
+	 * space for the extra handles */
+	std::vector<int64_t> cur(keys);
+	std::vector<size_t> order(N);
+	std::vector<size_t> slot(N); /* handle index of each element in cur */
+	B* b = new B(2*N,par);
+	Phase ph(every);
+	uint64_t s = seed ^ 0x5bd1e995ULL;
+	size_t i;
+	double sink = 0.0;
+
+	for(i=0;i<N;i++) { order[i] = i; slot[i] = i; }
+	/* random order for lookups and deletions */
+	for(i=N;i>1;i--) std::swap(order[i-1],order[Rand64(&s) % i]);
+
+	ph.Start();
+	Measure(ph,N,[&](size_t j) { b->Insert(cur[j],j); });
+	ph.Report(B::Name(),dist,"insert",N);
+
+	ph.Start();
+	Measure(ph,N,[&](size_t j) { sink += b->Find(cur[order[j]],order[j]); });
+	ph.Report(B::Name(),dist,"query",N);
+
+	if(B::HasRank()) {
+		ph.Start();
+		Measure(ph,N,[&](size_t j) { size_t k = order[j]; sink += b->Rank(cur[k],slot[k]); });
+		ph.Report(B::Name(),dist,"rank",N);
+	}
+
+	/* the same lookups in batches (the latency is the average in a batch) */
+	{
+		const size_t batch = 4096;
+		std::vector<int64_t> q(N);
+		for(i=0;i<N;i++) q[i] = cur[order[i]];
+		ph.Start();
+		Measure(ph,(N+batch-1)/batch,[&](size_t j) {
+			size_t n1 = std::min(batch,N-j*batch);
+			sink += b->BatchFind(q.data()+j*batch,n1);
+		});
+		ph.ops = N;
+		for(i=0;i<ph.lat.size();i++) ph.lat[i] /= batch;
+		ph.Report(B::Name(),dist,"query_batch",N);
+		if(B::HasRank()) {
+			ph.Start();
+			Measure(ph,(N+batch-1)/batch,[&](size_t j) {
+				size_t n1 = std::min(batch,N-j*batch);
+				sink += b->BatchRank(q.data()+j*batch,n1);
+			});
+			ph.ops = N;
+			for(i=0;i<ph.lat.size();i++) ph.lat[i] /= batch;
+			ph.Report(B::Name(),dist,"rank_batch",N);
+		}
+	}
+
+	ph.Start();
+	{
+		size_t cnt = 0;
+		uint64_t c1 = Ticks();
+		b->Iterate([&](int64_t key) {
+			sink += (double)key;
+			cnt++;
+			if(every && cnt % every == 0) {
+				uint64_t c2 = Ticks();
+				ph.lat.push_back((c2-c1)/every);
+				c1 = c2;
+			}
+		});
+		ph.ops = cnt;
+	}
+	ph.Report(B::Name(),dist,"iterate",N);
+
+	/* mixed: reads with probability readFrac, otherwise delete a random
+	 * element and insert a new one with a key taken from the same
+	 * distribution (a random element of the original key array) */
+	ph.Start();
+	{
+		size_t next = N; /* next free handle */
+		Measure(ph,N,[&](size_t j) {
+			size_t k = Rand64(&s) % N;
+			if(RandUniform(&s) < readFrac) sink += b->Find(cur[k],slot[k]);
+			else if(next < 2*N) {
+				b->Erase(cur[k],slot[k]);
+				cur[k] = keys[Rand64(&s) % N];
+				slot[k] = next++;
+				b->Insert(cur[k],slot[k]);
+			}
+		});
+	}
+	ph.Report(B::Name(),dist,"mixed",N);
+
+	ph.Start();
+	Measure(ph,N,[&](size_t j) { size_t k = order[j]; b->Erase(cur[k],slot[k]); });
+	ph.Report(B::Name(),dist,"delete",N);
+
+	gSink = sink;
+	delete b;
+}
+
+
+int main(int argc, char** argv) {
+	size_t N = 1000000;
+	size_t distinct = 1000;
+	double zipfs = 1.0;
+	double readFrac = 0.9;
+	double par = 1.0;
+	unsigned int every = 16;
+	uint64_t seed = (uint64_t)time(0);
+	const char* distName = "uniform";
+	const char* backends = "rb,treap,huge,multiset,pbds";
+	int dist = DIST_UNIFORM;
+	int header = 1;
+	int i;
+
+	for(i=1;i<argc;i++) if(argv[i][0] == '-') {
+		if(argv[i][1] == 'T') { gUseTsc = 1; continue; }
+		if(argv[i][1] == 'H') { header = 0; continue; }
+		if(argv[i][1] == 'C') { gCounters = 1; continue; }
+		if(i+1 >= argc) {
+			fprintf(stderr,"missing value for parameter %s!\n",argv[i]);
+			return 1;
+		}
+		switch(argv[i][1]) {
+			case 'N':
+				N = strtoul(argv[i+1],0,10);
+				break;
+			case 'd':
+				distName = argv[i+1];
+				break;
+			case 'z':
+				zipfs = atof(argv[i+1]);
+				break;
+			case 'D':
+				distinct = strtoul(argv[i+1],0,10);
+				break;
+			case 'r':
+				readFrac = atof(argv[i+1]);
+				break;
+			case 'l':
+				every = strtoul(argv[i+1],0,10);
+				break;
+			case 'b':
+				backends = argv[i+1];
+				break;
+			case 's':
+				seed = strtoull(argv[i+1],0,10);
+				break;
+			case 'p':
+				par = atof(argv[i+1]);
+				break;
+			default:
+				fprintf(stderr,"unrecognized parameter: %s!\n",argv[i]);
+				break;
+		}
+		i++;
+	}
+
+	if(!strcmp(distName,"uniform")) dist = DIST_UNIFORM;
+	else if(!strcmp(distName,"sorted")) dist = DIST_SORTED;
+	else if(!strcmp(distName,"reverse")) dist = DIST_REVERSE;
+	else if(!strcmp(distName,"zipf")) dist = DIST_ZIPF;
+	else if(!strcmp(distName,"dup")) dist = DIST_DUP;
+	else {
+		fprintf(stderr,"unknown distribution: %s!\n",distName);
+		return 1;
+	}
+	if(N == 0 || distinct == 0) {
+		fprintf(stderr,"N and the number of distinct keys should be positive!\n");
+		return 1;
+	}
+	if(gUseTsc) CalibrateTsc();
+	if(gCounters && RBPerfOpen(&gPerf) < RB_PERF_NCOUNTERS)
+		fprintf(stderr,"some hardware counters are not available (see kernel.perf_event_paranoid)!\n");
+
+	std::vector<int64_t> keys;
+	GenerateKeys(keys,N,dist,zipfs,distinct,seed);
+
+	if(header) printf("backend,distribution,workload,n,ops,seconds,ops_per_sec,p50_ns,p90_ns,p99_ns,p999_ns,max_ns%s\n",
+		gCounters ? ",cache_misses_per_op,dtlb_misses_per_op,branch_misses_per_op" : "");
+	if(strstr(backends,"rb")) RunBackend<RBBackend>(keys,distName,par,readFrac,every,seed);
+	if(strstr(backends,"treap")) RunBackend<TreapBackend>(keys,distName,par,readFrac,every,seed);
+	if(strstr(backends,"huge")) RunBackend<HugeBackend>(keys,distName,par,readFrac,every,seed);
+	if(strstr(backends,"multiset")) RunBackend<MultisetBackend>(keys,distName,par,readFrac,every,seed);
+	if(strstr(backends,"pbds")) RunBackend<PBDSBackend>(keys,distName,par,readFrac,every,seed);
+	if(gCounters) RBPerfClose(&gPerf);
+
+	return 0;
+}
+
@@ -0,0 +1,729 @@
+/*  rbcdf: empirical CDF of large key files
+ *
+ * 	loads int64 or double keys from files (or stdin) into a tree, then
+ * 	answers the queries in a second file, writing one result for each
+ * 	query, in the same order:
+ * 	  cdf       sum of the weights of the keys smaller than the query,
+ * 	            divided by the total weight
+ * 	  rank      the same, not divided
+ * 	  quantile  the query is a fraction q (0 <= q <= 1, other values
+ * 	            are skipped as invalid), the result is the key where the
+ * 	            cumulative weight crosses q times the total (the weight
+ * 	            of the smaller keys is at most that, together with this
+ * 	            key it is more; see RBWeightSelect); for q = 1, it is the
+ * 	            largest key
+ * 	  range     the queries are pairs of keys (lo, hi), the result is
+ * 	            the sum of the weights of the keys lo <= x < hi
+ * 	            (one result for each pair)
+ * 	without a query file, the distinct keys are written, each with
+ * 	the fraction of the weight up to and including it (the whole CDF)
+ *
+ * 	the input is read in large blocks (mmap()-ed if it is a regular
+ * 	file), each block is split among threads which parse their part in
+ * 	parallel; the keys are sorted in parallel runs, merged and loaded
+ * 	into the tree with RBTreeBuildSorted; the queries are processed one
+ * 	block at a time with RBParallelRank (query_pool.h), so the query
+ * 	file can be larger than the memory
+ * 	text input can have any whitespace or commas between the numbers;
+ * 	binary input is raw 8-byte numbers in the native byte order
+ *
+ * 	compile e.g. with:
+ * 	gcc -O2 -o rbcdf rbcdf.c red_black_tree.c query_pool.c misc.c stack.c -lm -lpthread
+ *
+ * 	parameters:
+ * 	-k file    file with the keys to load ("-" for stdin, the default);
+ * 	           can be given more than once
+ * 	-q file    file with the queries ("-" for stdin)
+ * 	-m mode    cdf, rank, quantile or range (default: cdf)
+ * 	-d         keys (and queries other than quantiles) are doubles
+ * 	           (default: int64)
+ * 	-p par     the weight of key x is x^par (default: 0, i.e. all keys
+ * 	           have weight 1)
+ * 	-t n       number of threads (default: the number of online CPUs)
+ * 	-B         binary input (both the keys and the queries)
+ * 	-b         binary output: doubles (the keys as int64 or double for
+ * 	           quantiles and the CDF without queries)
+ * 	-P digits  precision of the text output (default: 10, at most 17 which
+ * 	           already identifies any double exactly)
+ * 	-s MB      size of the blocks read at once (default: 16)
+ */
+
+#include "red_black_tree.h"
+#include "query_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifndef RB_NO_THREADS
+#include <pthread.h>
+#endif
+
+#define MODE_CDF 0
+#define MODE_RANK 1
+#define MODE_QUANTILE 2
+#define MODE_RANGE 3
+#define MODE_DUMP 4 /* no query file */
+
+static int gDouble = 0; /* keys are doubles */
+static int gBinaryIn = 0;
+static int gBinaryOut = 0;
+static int gPrecision = 10;
+#define RB_MAX_PRECISION 17 /* keeps each number well within OutDouble's 64 bytes */
+static unsigned int gThreads = 1;
+
+
+/***********************************************************************
+ * keys: doubles are stored as int64 with the same order (the sign bit
+ * kept, the other bits inverted for negative numbers), so that the tree
+ * can compare them with CmpInt64 in both cases (-0.0 is smaller than
+ * 0.0 then, NaN is above infinity or below -infinity)
+ ***********************************************************************/
+static inline int64_t KeyFromDouble(double d) {
+	int64_t i;
+	memcpy(&i,&d,sizeof(int64_t));
+	return (i < 0) ? (i ^ INT64_MAX) : i;
+}
+
+static inline double DoubleFromKey(int64_t i) {
+	double d;
+	if(i < 0) i ^= INT64_MAX;
+	memcpy(&d,&i,sizeof(double));
+	return d;
+}
+
+static double DFOne(const void* a, const void* par) {
+	return 1.0;
+}
+
+static double DFDoubleKey(const void* a, const void* par) {
+	return pow(DoubleFromKey((int64_t)a),*(const double*)par);
+}
+
+
+/***********************************************************************
+ * growable array of keys (or query values as doubles, in the same
+ * 8 bytes)
+ ***********************************************************************/
+typedef struct key_vec {
+	int64_t* a;
+	size_t n;
+	size_t cap;
+} key_vec;
+
+static void VecReserve(key_vec* v, size_t n) {
+	if(v->n + n > v->cap) {
+		size_t cap = v->cap ? v->cap : 1024;
+		while(cap < v->n + n) cap *= 2;
+		v->a = (int64_t*)realloc(v->a,sizeof(int64_t)*cap);
+		if(!v->a) {
+			fprintf(stderr,"Error: out of memory!\n");
+			exit(1);
+		}
+		v->cap = cap;
+	}
+}
+
+
+/***********************************************************************
+ * input: InputBlock gives the next part of the file, ending at the end
+ * of a number (text) or at a multiple of 8 bytes (binary); regular files
+ * are mapped, anything else is read into a buffer, and the part of the
+ * last number which did not fit is kept for the next block
+ ***********************************************************************/
+typedef struct rb_input {
+	const char* name;
+	int fd;
+	char* map;
+	size_t mapLen;
+	size_t pos; /* in map, or the length of the data kept in buf */
+	char* buf;
+	size_t bufSize;
+	size_t keep; /* bytes at the start of buf from the last block */
+	int eof;
+} rb_input;
+
+static inline int IsSep(char c) {
+	return (c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == ',');
+}
+
+static int InputOpen(rb_input* in, const char* name, size_t blockSize) {
+	struct stat st;
+	memset(in,0,sizeof(rb_input));
+	in->name = name;
+	if(!strcmp(name,"-")) in->fd = 0;
+	else in->fd = open(name,O_RDONLY);
+	if(in->fd < 0) {
+		fprintf(stderr,"Error opening input file %s!\n",name);
+		return 1;
+	}
+	if(fstat(in->fd,&st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		void* m = mmap(0,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,in->fd,0);
+		if(m != MAP_FAILED) {
+			in->map = (char*)m;
+			in->mapLen = (size_t)st.st_size;
+			madvise(m,in->mapLen,MADV_SEQUENTIAL);
+			return 0;
+		}
+	}
+	in->bufSize = blockSize;
+	in->buf = (char*)SafeMalloc(in->bufSize);
+	return 0;
+}
+
+static void InputClose(rb_input* in) {
+	if(in->map) munmap(in->map,in->mapLen);
+	free(in->buf);
+	if(in->fd > 0) close(in->fd);
+}
+
+/* length of the part of p[0..len) which ends with complete numbers */
+static size_t InputCut(const char* p, size_t len) {
+	size_t end = len;
+	if(gBinaryIn) return len - len % sizeof(int64_t);
+	while(end > 0 && !IsSep(p[end-1])) end--;
+	return end;
+}
+
+static int InputBlock(rb_input* in, size_t blockSize, const char** p, size_t* len) {
+	if(in->map) {
+		size_t end;
+		if(in->pos >= in->mapLen) return 0;
+		end = in->pos + blockSize;
+		if(end >= in->mapLen) end = in->mapLen;
+		else {
+			size_t cut = InputCut(in->map + in->pos,end - in->pos);
+			if(cut > 0) end = in->pos + cut;
+			else while(end < in->mapLen && !IsSep(in->map[end])) end++; /* a very long token */
+		}
+		*p = in->map + in->pos;
+		*len = end - in->pos;
+		in->pos = end;
+		return 1;
+	}
+
+	/* move the rest of the last block to the start and fill the buffer */
+	if(in->keep < in->pos) memmove(in->buf,in->buf + in->keep,in->pos - in->keep);
+	in->pos -= in->keep;
+	in->keep = 0;
+	while(!in->eof) {
+		ssize_t r;
+		if(in->pos == in->bufSize) {
+			if(InputCut(in->buf,in->pos) > 0) break;
+			in->bufSize *= 2; /* no complete number in the whole buffer */
+			in->buf = (char*)realloc(in->buf,in->bufSize);
+			if(!in->buf) {
+				fprintf(stderr,"Error: out of memory!\n");
+				exit(1);
+			}
+		}
+		r = read(in->fd,in->buf + in->pos,in->bufSize - in->pos);
+		if(r < 0) {
+			fprintf(stderr,"Error reading input file %s!\n",in->name);
+			in->eof = 1;
+		}
+		else if(r == 0) in->eof = 1;
+		else in->pos += (size_t)r;
+	}
+	if(in->pos == 0) return 0;
+	in->keep = in->eof ? in->pos : InputCut(in->buf,in->pos);
+	*p = in->buf;
+	*len = in->keep;
+	if(in->eof && gBinaryIn && in->pos % sizeof(int64_t)) {
+		fprintf(stderr,"Warning: %s: the last %u bytes are not a complete number!\n",
+			in->name,(unsigned int)(in->pos % sizeof(int64_t)));
+		*len -= in->pos % sizeof(int64_t);
+	}
+	return 1;
+}
+
+
+/***********************************************************************
+ * parsing: each thread parses a part of the block (split at separators)
+ * into its own array, which are then appended in order; asDouble is set
+ * for the quantile queries, which are doubles even with int64 keys
+ ***********************************************************************/
+typedef struct parse_job {
+	const char* p;
+	size_t len;
+	int asDouble;
+	key_vec out;
+	size_t errors;
+} parse_job;
+
+static void ParsePart(parse_job* job) {
+	const char* p = job->p;
+	const char* e = p + job->len;
+	job->out.n = 0;
+	job->errors = 0;
+	if(gBinaryIn) {
+		size_t n = job->len / sizeof(int64_t);
+		size_t i;
+		VecReserve(&(job->out),n);
+		memcpy(job->out.a,p,n*sizeof(int64_t));
+		job->out.n = n;
+		if(gDouble && !job->asDouble) for(i=0;i<n;i++) {
+			double d;
+			memcpy(&d,job->out.a + i,sizeof(double));
+			job->out.a[i] = KeyFromDouble(d);
+		}
+		if(job->asDouble) { /* quantiles are in [0,1] */
+			size_t m = 0;
+			for(i=0;i<n;i++) {
+				double d;
+				memcpy(&d,job->out.a + i,sizeof(double));
+				if(d >= 0.0 && d <= 1.0) job->out.a[m++] = job->out.a[i];
+				else job->errors++;
+			}
+			job->out.n = m;
+		}
+		return;
+	}
+	VecReserve(&(job->out),job->len/2 + 1);
+	for(;;) {
+		const char* t;
+		while(p < e && IsSep(*p)) p++;
+		if(p == e) break;
+		t = p;
+		while(p < e && !IsSep(*p)) p++;
+		if(gDouble || job->asDouble) {
+			char tmp[64]; /* the input is not 0-terminated */
+			char* end;
+			double d;
+			size_t l = p - t;
+			if(l >= sizeof(tmp)) {
+				job->errors++;
+				continue;
+			}
+			memcpy(tmp,t,l);
+			tmp[l] = 0;
+			d = strtod(tmp,&end);
+			if(*end || (job->asDouble && !(d >= 0.0 && d <= 1.0))) { /* quantiles are in [0,1] */
+				job->errors++;
+				continue;
+			}
+			if(job->asDouble) memcpy(job->out.a + job->out.n,&d,sizeof(double));
+			else job->out.a[job->out.n] = KeyFromDouble(d);
+			job->out.n++;
+		}
+		else {
+			const char* s = t;
+			uint64_t v = 0;
+			int neg = 0;
+			if(*s == '-' || *s == '+') neg = (*(s++) == '-');
+			while(p - s > 1 && *s == '0') s++; /* leading zeros */
+			if(s == p || p - s > 19) { /* empty, or does not fit in 64 bits */
+				job->errors++;
+				continue;
+			}
+			for(;s<p;s++) {
+				if(*s < '0' || *s > '9') break;
+				v = v*10 + (uint64_t)(*s - '0');
+			}
+			/* at most 19 digits fit in a uint64_t; the magnitude of an */
+			/* int64_t is at most INT64_MAX, or INT64_MAX + 1 if negative */
+			if(s < p || v > (uint64_t)INT64_MAX + (uint64_t)neg) {
+				job->errors++;
+				continue;
+			}
+			if(neg) job->out.a[job->out.n++] = (v > (uint64_t)INT64_MAX) ? INT64_MIN : -(int64_t)v;
+			else job->out.a[job->out.n++] = (int64_t)v;
+		}
+	}
+}
+
+static void* ParseThread(void* arg) {
+	ParsePart((parse_job*)arg);
+	return 0;
+}
+
+/* run f on each of the n jobs (of size sz), in parallel; the first one */
+/* in the calling thread (and all of them if a thread cannot be started) */
+static void RunParallel(void* (*f)(void*), char* jobs, size_t sz, unsigned int n) {
+	unsigned int i;
+#ifndef RB_NO_THREADS
+	pthread_t* th = (pthread_t*)SafeMalloc(sizeof(pthread_t)*n);
+	int* started = (int*)SafeMalloc(sizeof(int)*n);
+	for(i=1;i<n;i++) started[i] = !pthread_create(th + i,0,f,jobs + i*sz);
+	f(jobs);
+	for(i=1;i<n;i++) {
+		if(started[i]) pthread_join(th[i],0);
+		else f(jobs + i*sz);
+	}
+	free(th);
+	free(started);
+#else
+	for(i=0;i<n;i++) f(jobs + i*sz);
+#endif
+}
+
+static void ParseBlock(parse_job* jobs, const char* p, size_t len, int asDouble, key_vec* out, size_t* errors) {
+	unsigned int n = gThreads;
+	unsigned int i;
+	size_t start = 0;
+	if(len < ((size_t)1 << 16)) n = 1; /* not worth starting threads */
+	for(i=0;i<n;i++) {
+		size_t end = (i+1 == n) ? len : len/n*(i+1);
+		if(end < start) end = start;
+		if(gBinaryIn) end -= end % sizeof(int64_t);
+		else while(end < len && !IsSep(p[end])) end++;
+		jobs[i].p = p + start;
+		jobs[i].len = end - start;
+		jobs[i].asDouble = asDouble;
+		start = end;
+	}
+	RunParallel(ParseThread,(char*)jobs,sizeof(parse_job),n);
+	for(i=0;i<n;i++) {
+		VecReserve(out,jobs[i].out.n);
+		memcpy(out->a + out->n,jobs[i].out.a,sizeof(int64_t)*jobs[i].out.n);
+		out->n += jobs[i].out.n;
+		*errors += jobs[i].errors;
+	}
+}
+
+
+/***********************************************************************
+ * sorting: the keys are split into one run for each thread, sorted by
+ * LSD radix sort (8 bits at a time, skipping the bytes which are the same
+ * in all keys), then the runs are merged
+ ***********************************************************************/
+typedef struct sort_job {
+	uint64_t* a;
+	uint64_t* tmp;
+	size_t n;
+} sort_job;
+
+static void SortRun(sort_job* job) {
+	uint64_t* a = job->a;
+	uint64_t* b = job->tmp;
+	size_t n = job->n;
+	size_t cnt[8][256];
+	size_t i;
+	unsigned int d;
+	memset(cnt,0,sizeof(cnt));
+	for(i=0;i<n;i++) {
+		uint64_t v = a[i] ^ 0x8000000000000000ULL; /* signed order */
+		a[i] = v;
+		for(d=0;d<8;d++) cnt[d][(v >> (8*d)) & 0xff]++;
+	}
+	for(d=0;d<8;d++) {
+		size_t sum = 0;
+		size_t* c = cnt[d];
+		unsigned int j;
+		if(n == 0 || c[(a[0] >> (8*d)) & 0xff] == n) continue; /* all the same */
+		for(j=0;j<256;j++) {
+			size_t t = c[j];
+			c[j] = sum;
+			sum += t;
+		}
+		for(i=0;i<n;i++) b[c[(a[i] >> (8*d)) & 0xff]++] = a[i];
+		{
+			uint64_t* t = a;
+			a = b;
+			b = t;
+		}
+	}
+	for(i=0;i<n;i++) job->a[i] = a[i] ^ 0x8000000000000000ULL;
+}
+
+static void* SortThread(void* arg) {
+	SortRun((sort_job*)arg);
+	return 0;
+}
+
+/* sort the keys, the result is in out (as void* keys for the tree) */
+static void SortKeys(key_vec* keys, void** out) {
+	unsigned int n = gThreads;
+	sort_job* jobs;
+	uint64_t* tmp = (uint64_t*)SafeMalloc(sizeof(uint64_t)*(keys->n + 1));
+	size_t* pos;
+	size_t i;
+	unsigned int j;
+	if(keys->n < ((size_t)1 << 16)) n = 1;
+	jobs = (sort_job*)SafeMalloc(sizeof(sort_job)*n);
+	pos = (size_t*)SafeMalloc(sizeof(size_t)*n);
+	for(j=0;j<n;j++) {
+		size_t s = keys->n/n*j;
+		size_t e = (j+1 == n) ? keys->n : keys->n/n*(j+1);
+		jobs[j].a = (uint64_t*)(keys->a + s);
+		jobs[j].tmp = tmp + s;
+		jobs[j].n = e - s;
+		pos[j] = 0;
+	}
+	RunParallel(SortThread,(char*)jobs,sizeof(sort_job),n);
+	for(i=0;i<keys->n;i++) { /* merge, the number of runs is small */
+		unsigned int best = n;
+		for(j=0;j<n;j++) if(pos[j] < jobs[j].n) {
+			if(best == n || (int64_t)(jobs[j].a[pos[j]]) < (int64_t)(jobs[best].a[pos[best]])) best = j;
+		}
+		out[i] = (void*)(int64_t)(jobs[best].a[pos[best]++]);
+	}
+	free(pos);
+	free(jobs);
+	free(tmp);
+}
+
+
+/***********************************************************************
+ * output: the results are formatted into a buffer, which is written
+ * when it is full
+ ***********************************************************************/
+typedef struct rb_output {
+	char* buf;
+	size_t len;
+	size_t size;
+} rb_output;
+
+static void OutFlush(rb_output* out) {
+	if(out->len && fwrite(out->buf,1,out->len,stdout) != out->len) {
+		fprintf(stderr,"Error writing the output!\n");
+		exit(1);
+	}
+	out->len = 0;
+}
+
+static inline void OutReserve(rb_output* out, size_t n) {
+	if(out->len + n > out->size) OutFlush(out);
+}
+
+static void OutBinary(rb_output* out, const void* x) {
+	OutReserve(out,sizeof(double));
+	memcpy(out->buf + out->len,x,sizeof(double));
+	out->len += sizeof(double);
+}
+
+static void OutDouble(rb_output* out, double x, char sep) {
+	int n;
+	OutReserve(out,64);
+	n = snprintf(out->buf + out->len,64,"%.*g%c",gPrecision,x,sep);
+	if(n > 0 && n < 64) out->len += n;
+}
+
+static void OutInt(rb_output* out, int64_t x, char sep) {
+	char tmp[24];
+	uint64_t v = (x < 0) ? -(uint64_t)x : (uint64_t)x;
+	unsigned int l = 0;
+	OutReserve(out,24);
+	do {
+		tmp[l++] = '0' + (char)(v % 10);
+		v /= 10;
+	} while(v);
+	if(x < 0) out->buf[out->len++] = '-';
+	while(l) out->buf[out->len++] = tmp[--l];
+	out->buf[out->len++] = sep;
+}
+
+/* a key as int64 or double */
+static void OutKey(rb_output* out, int64_t k, char sep) {
+	if(gBinaryOut) {
+		if(gDouble) {
+			double d = DoubleFromKey(k);
+			OutBinary(out,&d);
+		}
+		else OutBinary(out,&k);
+	}
+	else if(gDouble) OutDouble(out,DoubleFromKey(k),sep);
+	else OutInt(out,k,sep);
+}
+
+static void OutValue(rb_output* out, double x) {
+	if(gBinaryOut) OutBinary(out,&x);
+	else OutDouble(out,x,'\n');
+}
+
+
+/***********************************************************************
+ * answer one block of queries
+ ***********************************************************************/
+static void AnswerBlock(rb_query_pool* pool, rb_red_blk_tree* tree, int mode, double total,
+		key_vec* q, double* res, rb_output* out) {
+	size_t i;
+	if(mode == MODE_QUANTILE) {
+		for(i=0;i<q->n;i++) {
+			double f;
+			rb_red_blk_node* x;
+			memcpy(&f,q->a + i,sizeof(double));
+			/* the first key where the cumulative sum exceeds f*total; */
+			/* there is none for f = 1 (or f*total rounded up to the */
+			/* total), this is the last key then */
+			x = (f < 1.0) ? RBWeightSelect(tree,f*total,0) : tree->nil;
+			if(x == tree->nil) x = TreeLast(tree);
+			OutKey(out,(int64_t)(x->key),'\n');
+		}
+		return;
+	}
+	RBParallelRank(pool,tree,(void* const*)(q->a),q->n,res);
+	if(mode == MODE_RANGE) {
+		for(i=0;i+1<q->n;i+=2) OutValue(out,res[i+1] - res[i]);
+	}
+	else for(i=0;i<q->n;i++) OutValue(out,(mode == MODE_CDF) ? res[i] / total : res[i]);
+}
+
+
+int main(int argc, char** argv) {
+	const char** keyFiles = (const char**)SafeMalloc(sizeof(const char*)*(argc+1));
+	unsigned int nKeyFiles = 0;
+	const char* queryFile = 0;
+	const char* modeName = "cdf";
+	int mode = MODE_CDF;
+	double par = 0.0;
+	size_t blockSize = 16;
+	unsigned int threads = 0;
+	rb_red_blk_tree* tree;
+	rb_query_pool* pool;
+	parse_job* jobs;
+	key_vec keys = {0,0,0};
+	key_vec q = {0,0,0};
+	rb_output out;
+	rb_input in;
+	size_t errors = 0;
+	void** sorted;
+	double total;
+	unsigned int j;
+	int i;
+
+	for(i=1;i<argc;i++) if(argv[i][0] == '-') {
+		if(argv[i][1] == 'd') { gDouble = 1; continue; }
+		if(argv[i][1] == 'B') { gBinaryIn = 1; continue; }
+		if(argv[i][1] == 'b') { gBinaryOut = 1; continue; }
+		if(i+1 >= argc) {
+			fprintf(stderr,"missing value for parameter %s!\n",argv[i]);
+			return 1;
+		}
+		switch(argv[i][1]) {
+			case 'k':
+				keyFiles[nKeyFiles++] = argv[i+1];
+				break;
+			case 'q':
+				queryFile = argv[i+1];
+				break;
+			case 'm':
+				modeName = argv[i+1];
+				break;
+			case 'p':
+				par = atof(argv[i+1]);
+				break;
+			case 't':
+				threads = strtoul(argv[i+1],0,10);
+				break;
+			case 'P':
+				gPrecision = atoi(argv[i+1]);
+				if(gPrecision < 1) gPrecision = 1;
+				if(gPrecision > RB_MAX_PRECISION) gPrecision = RB_MAX_PRECISION;
+				break;
+			case 's':
+				blockSize = strtoul(argv[i+1],0,10);
+				break;
+			default:
+				fprintf(stderr,"unrecognized parameter: %s!\n",argv[i]);
+				break;
+		}
+		i++;
+	}
+
+	if(!strcmp(modeName,"cdf")) mode = MODE_CDF;
+	else if(!strcmp(modeName,"rank")) mode = MODE_RANK;
+	else if(!strcmp(modeName,"quantile")) mode = MODE_QUANTILE;
+	else if(!strcmp(modeName,"range")) mode = MODE_RANGE;
+	else {
+		fprintf(stderr,"unknown mode: %s!\n",modeName);
+		return 1;
+	}
+	if(!queryFile) mode = MODE_DUMP;
+	if(nKeyFiles == 0) keyFiles[nKeyFiles++] = "-";
+	if(queryFile && !strcmp(queryFile,"-")) for(j=0;j<nKeyFiles;j++) if(!strcmp(keyFiles[j],"-")) {
+		fprintf(stderr,"Error: the keys and the queries cannot be both read from stdin!\n");
+		return 1;
+	}
+	if(blockSize == 0) blockSize = 1;
+	blockSize <<= 20;
+
+	pool = RBQueryPoolCreate(threads);
+#ifndef RB_NO_THREADS
+	gThreads = pool->nthreads + 1;
+#endif
+	jobs = (parse_job*)SafeMalloc(sizeof(parse_job)*gThreads);
+	memset(jobs,0,sizeof(parse_job)*gThreads);
+
+	/* load the keys */
+	for(j=0;j<nKeyFiles;j++) {
+		const char* p;
+		size_t len;
+		if(InputOpen(&in,keyFiles[j],blockSize)) return 1;
+		while(InputBlock(&in,blockSize,&p,&len)) ParseBlock(jobs,p,len,0,&keys,&errors);
+		InputClose(&in);
+	}
+	if(errors) fprintf(stderr,"Warning: %lu invalid keys skipped!\n",(unsigned long)errors);
+
+	sorted = (void**)SafeMalloc(sizeof(void*)*(keys.n + 1));
+	SortKeys(&keys,sorted);
+	free(keys.a);
+	tree = RBTreeCreate(CmpInt64,(void (*)(void*))NullFunction,(void (*)(void*))NullFunction,
+		NullFunction,(void (*)(void*))NullFunction,
+		(par == 0.0) ? DFOne : (gDouble ? DFDoubleKey : DFInt64),&par);
+	RBTreeBuildSorted(tree,sorted,0,keys.n);
+	total = RBTreeTotal(tree);
+	if(mode == MODE_QUANTILE && keys.n == 0) {
+		fprintf(stderr,"Error: no keys, the quantiles are not defined!\n");
+		return 1;
+	}
+
+	out.size = 1 << 20;
+	out.len = 0;
+	out.buf = (char*)SafeMalloc(out.size);
+
+	if(mode == MODE_DUMP) {
+		/* the distinct keys, each with the CDF including it */
+		double sum = 0.0;
+		size_t k;
+		for(k=0;k<keys.n;k++) {
+			sum += tree->DistFunc(sorted[k],tree->dfparam);
+			if(k+1 < keys.n && sorted[k+1] == sorted[k]) continue;
+			OutKey(&out,(int64_t)(sorted[k]),'\t');
+			OutValue(&out,sum / total);
+		}
+	}
+	else {
+		const char* p;
+		size_t len;
+		double* res = 0;
+		size_t resSize = 0;
+		errors = 0;
+		if(InputOpen(&in,queryFile,blockSize)) return 1;
+		q.n = 0;
+		while(InputBlock(&in,blockSize,&p,&len)) {
+			int64_t last = 0;
+			int odd;
+			ParseBlock(jobs,p,len,(mode == MODE_QUANTILE),&q,&errors);
+			odd = (mode == MODE_RANGE && q.n % 2); /* a pair continues in the next block */
+			if(odd) last = q.a[--q.n];
+			if(q.n > resSize) {
+				free(res);
+				resSize = q.n;
+				res = (double*)SafeMalloc(sizeof(double)*resSize);
+			}
+			AnswerBlock(pool,tree,mode,total,&q,res,&out);
+			q.n = 0;
+			if(odd) q.a[q.n++] = last;
+		}
+		if(q.n) fprintf(stderr,"Warning: odd number of values for range queries, the last one is ignored!\n");
+		InputClose(&in);
+		if(errors) fprintf(stderr,"Warning: %lu invalid queries skipped!\n",(unsigned long)errors);
+		free(res);
+	}
+	OutFlush(&out);
+
+	for(j=0;j<gThreads;j++) free(jobs[j].out.a);
+	free(jobs);
+	free(q.a);
+	free(out.buf);
+	free(sorted);
+	free(keyFiles);
+	RBQueryPoolDestroy(pool);
+	RBTreeDestroy(tree);
+	return 0;
+}
@@ -1,4 +1,237 @@
 #include "red_black_tree.h"
+#include <string.h>
+#ifndef RB_NO_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+/***********************************************************************
+ * optional counters for the hot paths, see RB_STATS in red_black_tree.h
+ * (the cast is needed as the query functions get a const tree)
+ ***********************************************************************/
+#ifdef RB_STATS
+#define RB_STAT_ADD(tree,field,n) (((rb_red_blk_tree*)(tree))->stats.field += (n))
+#else
+#define RB_STAT_ADD(tree,field,n) ((void)0)
+#endif
+
+/***********************************************************************
+ * ranks stored by GetNodeRankCached (RB_RANK_CACHE) are valid while the
+ * epoch of the tree does not change: it is incremented by every change
+ * which can change a rank (insert, delete, and changes of the weights;
+ * not by the rotations); new nodes get epoch 0, the tree starts from 1
+ ***********************************************************************/
+#ifdef RB_RANK_CACHE
+#define RB_EPOCH_BUMP(tree) ((tree)->epoch++)
+#define RB_EPOCH_INIT(x) ((x)->rankEpoch = 0)
+#else
+#define RB_EPOCH_BUMP(tree) ((void)0)
+#define RB_EPOCH_INIT(x) ((void)0)
+#endif
+
+/***********************************************************************
+ * call the comparison and distribution functions of the tree
+ * (convenience functions, so that these can be counted)
+ ***********************************************************************/
+static inline int TreeCompare(const rb_red_blk_tree* tree, const void* a, const void* b) {
+     RB_STAT_ADD(tree,compare,1);
+     return tree->Compare(a,b);
+}
+
+static inline double TreeDist(const rb_red_blk_tree* tree, const void* key) {
+     RB_STAT_ADD(tree,distFunc,1);
+     return tree->DistFunc(key,tree->dfparam);
+}
+
+/* weight stored in a new node with the given key (relative to the scale) */
+static inline double TreeNewWeight(const rb_red_blk_tree* tree, const void* key) {
+     return TreeDist(tree,key) / tree->scale;
+}
+
+/***********************************************************************
+ * node memory: new nodes are allocated one by one; RBTreeCompact moves
+ * nodes into arenas (contiguous blocks, aligned to cache lines), and
+ * RBTreeBuildSorted creates all nodes in one arena; arenas are freed
+ * once all nodes in them are deleted or moved again; there are only a
+ * few arenas at a time (one for each compaction or bulk load whose nodes
+ * are still in use), so finding the arena of a node is a short search
+ * with huge page storage (RBTreeSetNodeStorage), the arenas are mapped
+ * on huge pages, and new nodes are taken from slabs (huge page mappings
+ * of growing size, kept until the tree is destroyed) or from the list of
+ * the nodes deleted before, instead of SafeMalloc
+ ***********************************************************************/
+#define RB_CACHE_LINE 64
+#define RB_HUGE_PAGE (((size_t)2) << 20)
+#define RB_SLAB_MAX (((size_t)1) << 30) /* largest slab, in bytes */
+
+typedef struct rb_node_arena {
+     rb_red_blk_node* nodes;
+     void* mem; /* as allocated, before the alignment */
+     size_t mapped; /* size of the mapping if mem is on huge pages, 0 otherwise */
+     size_t size; /* number of node slots */
+     size_t used; /* slots given out (from the start) */
+     size_t live; /* nodes currently in the arena */
+     struct rb_node_arena* next;
+} rb_node_arena;
+
+typedef struct rb_node_slab {
+     rb_red_blk_node* nodes;
+     size_t mapped; /* as in rb_node_arena */
+     size_t size;
+     size_t used;
+     struct rb_node_slab* next;
+} rb_node_slab;
+
+typedef struct rb_compact_state {
+     rb_node_arena* arena; /* the arena being filled */
+     rb_red_blk_node* cursor; /* the last node visited (in preorder) */
+} rb_compact_state;
+
+/***********************************************************************
+ * map at least *bytes bytes (the result is rounded up to huge pages and
+ * stored in *bytes) aligned to huge pages: with MAP_HUGETLB if requested
+ * and available (this needs huge pages reserved by the administrator),
+ * otherwise as an anonymous mapping with MADV_HUGEPAGE, so that
+ * transparent huge pages are used if enabled; 0 on failure (or if not
+ * supported on this system), then the caller should use SafeMalloc
+ ***********************************************************************/
+static void* TreePagesAlloc(int storage, size_t* bytes) {
+#ifdef __linux__
+     size_t size = (*bytes + RB_HUGE_PAGE - 1) & ~(RB_HUGE_PAGE - 1);
+     char* p;
+     char* q;
+#ifdef MAP_HUGETLB
+     if(storage == RB_STORAGE_HUGETLB) {
+          p = (char*)mmap(0,size,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,-1,0);
+          if(p != (char*)MAP_FAILED) {
+               *bytes = size;
+               return p;
+          }
+     }
+#endif
+     /* one more huge page, and unmap the parts before and after the aligned block */
+     p = (char*)mmap(0,size + RB_HUGE_PAGE,PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+     if(p == (char*)MAP_FAILED) return 0;
+     q = (char*)(((uintptr_t)p + RB_HUGE_PAGE - 1) & ~(uintptr_t)(RB_HUGE_PAGE - 1));
+     if(q > p) munmap(p,q - p);
+     if(q + size < p + size + RB_HUGE_PAGE) munmap(q + size,(p + size + RB_HUGE_PAGE) - (q + size));
+#ifdef MADV_HUGEPAGE
+     madvise(q,size,MADV_HUGEPAGE);
+#endif
+     *bytes = size;
+     return q;
+#else
+     return 0;
+#endif
+}
+
+static void TreePagesFree(void* p, size_t bytes) {
+#ifdef __linux__
+     munmap(p,bytes);
+#endif
+}
+
+static rb_node_arena* TreeArenaCreate(rb_red_blk_tree* tree, size_t size) {
+     rb_node_arena* a = (rb_node_arena*)SafeMalloc(sizeof(rb_node_arena));
+     a->mapped = 0;
+     a->mem = 0;
+     if(tree->storage != RB_STORAGE_HEAP) {
+          a->mapped = sizeof(rb_red_blk_node)*size;
+          a->mem = TreePagesAlloc(tree->storage,&(a->mapped));
+          if(!a->mem) a->mapped = 0;
+     }
+     if(!a->mem) a->mem = SafeMalloc(sizeof(rb_red_blk_node)*size + RB_CACHE_LINE);
+     a->nodes = (rb_red_blk_node*)(((uintptr_t)(a->mem) + RB_CACHE_LINE - 1) & ~(uintptr_t)(RB_CACHE_LINE - 1));
+     a->size = size;
+     a->used = 0;
+     a->live = 0;
+     a->next = tree->arenas;
+     tree->arenas = a;
+     return a;
+}
+
+static void TreeArenaFree(rb_red_blk_tree* tree, rb_node_arena* a) {
+     rb_node_arena** p = &(tree->arenas);
+     while(*p != a) p = &((*p)->next);
+     *p = a->next;
+     if(a->mapped) TreePagesFree(a->mem,a->mapped);
+     else free(a->mem);
+     free(a);
+}
+
+/* a node from the free list or the last slab (a new slab if it is full) */
+static rb_red_blk_node* TreeSlabNode(rb_red_blk_tree* tree) {
+     rb_node_slab* s = tree->slabs;
+     rb_red_blk_node* x = tree->freeNodes;
+     if(x) {
+          tree->freeNodes = x->parent;
+          return x;
+     }
+     if(s == 0 || s->used == s->size) {
+          size_t bytes = s ? 2*sizeof(rb_red_blk_node)*s->size : RB_HUGE_PAGE;
+          if(bytes > RB_SLAB_MAX) bytes = RB_SLAB_MAX;
+          s = (rb_node_slab*)SafeMalloc(sizeof(rb_node_slab));
+          s->mapped = bytes;
+          s->nodes = (rb_red_blk_node*)TreePagesAlloc(tree->storage,&(s->mapped));
+          if(!s->nodes) {
+               s->mapped = 0;
+               s->nodes = (rb_red_blk_node*)SafeMalloc(bytes);
+          }
+          else bytes = s->mapped;
+          s->size = bytes / sizeof(rb_red_blk_node);
+          s->used = 0;
+          s->next = tree->slabs;
+          tree->slabs = s;
+     }
+     return s->nodes + (s->used++);
+}
+
+static void TreeSlabsFree(rb_red_blk_tree* tree) {
+     while(tree->slabs) {
+          rb_node_slab* s = tree->slabs;
+          tree->slabs = s->next;
+          if(s->mapped) TreePagesFree(s->nodes,s->mapped);
+          else free(s->nodes);
+          free(s);
+     }
+     tree->freeNodes = 0;
+}
+
+static rb_red_blk_node* TreeAllocNode(rb_red_blk_tree* tree) {
+     RB_STAT_ADD(tree,nodesAlloc,1);
+     tree->nodes++;
+     if(tree->storage != RB_STORAGE_HEAP) return TreeSlabNode(tree);
+     return (rb_red_blk_node*)SafeMalloc(sizeof(rb_red_blk_node));
+}
+
+/* give back the memory of x (which is not in the tree any more) */
+static void TreeReleaseNode(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     rb_node_arena* a;
+     for(a = tree->arenas; a; a = a->next) {
+          if(x >= a->nodes && x < a->nodes + a->size) {
+               a->live--;
+               if(a->live == 0 && !(tree->compact && tree->compact->arena == a)) TreeArenaFree(tree,a);
+               return;
+          }
+     }
+     if(tree->storage != RB_STORAGE_HEAP) { /* from a slab, kept for reuse */
+          x->parent = tree->freeNodes;
+          tree->freeNodes = x;
+     }
+     else free(x);
+}
+
+static void TreeFreeNode(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     RB_EPOCH_BUMP(tree);
+     /* an incremental compaction continues from the parent */
+     if(tree->compact && tree->compact->cursor == x) tree->compact->cursor = x->parent;
+     TreeReleaseNode(tree,x);
+     RB_STAT_ADD(tree,nodesFree,1);
+     tree->nodes--;
+}
 
 /***********************************************************************/
 /*  FUNCTION:  RBTreeCreate */
@@ -38,6 +271,26 @@ rb_red_blk_tree* RBTreeCreate( int (*CompFunc) (const void*,const void*),
   newTree->DestroyInfo= InfoDestFunc;
   newTree->DistFunc = DistFunc;
   newTree->dfparam = dfparam;
+  newTree->engine = RB_ENGINE_RB;
+  newTree->rngState = (uint64_t)(uintptr_t)newTree;
+  newTree->scale = 1.0;
+  newTree->nodes = 0;
+  newTree->arenas = 0;
+  newTree->compact = 0;
+  newTree->storage = RB_STORAGE_HEAP;
+  newTree->slabs = 0;
+  newTree->freeNodes = 0;
+#ifdef RB_TRACK_CHANGES
+  newTree->dirtyAll = 0;
+#endif
+#ifdef RB_RANK_CACHE
+  newTree->epoch = 1;
+#endif
+  newTree->fingers = 0;
+  newTree->batch = 0;
+#ifdef RB_STATS
+  memset(&(newTree->stats),0,sizeof(rb_tree_stats));
+#endif
 
   /*  see the comment in the rb_red_blk_tree structure in red_black_tree.h */
   /*  for information on nil and root */
@@ -46,11 +299,23 @@ rb_red_blk_tree* RBTreeCreate( int (*CompFunc) (const void*,const void*),
   temp->red=0;
   temp->key=0;
   temp->children = 0.0;
+  temp->weight = 0.0;
+#ifdef RB_RANGE_UPDATE
+  temp->count = 0;
+  temp->tagMul = 1.0;
+  temp->tagAdd = 0.0;
+#endif
   temp=newTree->root= (rb_red_blk_node*) SafeMalloc(sizeof(rb_red_blk_node));
   temp->parent=temp->left=temp->right=newTree->nil;
   temp->key=0;
   temp->red=0;
   temp->children = 0.0;
+  temp->weight = 0.0;
+#ifdef RB_RANGE_UPDATE
+  temp->count = 0;
+  temp->tagMul = 1.0;
+  temp->tagAdd = 0.0;
+#endif
   return(newTree);
 }
 
@@ -58,7 +323,317 @@ rb_red_blk_tree* RBTreeCreate( int (*CompFunc) (const void*,const void*),
  * update the sum for a subtree (convenience function)
  ***********************************************************************/
 static inline void TreeUpdateSum(rb_red_blk_tree* tree, rb_red_blk_node* x) {
-     x->children = x->left->children + x->right->children + tree->DistFunc(x->key,tree->dfparam);
+     x->children = x->left->children + x->right->children + x->weight;
+#ifdef RB_RANGE_UPDATE
+     x->count = x->left->count + x->right->count + 1;
+#endif
+}
+
+/***********************************************************************
+ * pending range updates (RB_RANGE_UPDATE, see RBRangeMultiply)
+ * the weight and sum stored in a node are correct after applying the
+ * tags of all its ancestors; TreePush applies the tag of x to its
+ * children, this is done before a rotation involving x, and TreePushPath
+ * does it for x and all nodes above it, before the sums are changed
+ * upwards from x (e.g. when a node is linked below x)
+ * the queries do not modify the tree: they compose the tags of the
+ * nodes while descending (or ascending) and apply them to the values
+ * read; without RB_RANGE_UPDATE, all of these do nothing
+ ***********************************************************************/
+#ifdef RB_RANGE_UPDATE
+#define RB_COUNT_ADD(x,n) ((x)->count += (n))
+
+static inline void TreeTagApply(rb_red_blk_node* x, double mul, double add) {
+     x->weight = x->weight*mul + add;
+     x->children = x->children*mul + add*(double)(x->count);
+     x->tagMul *= mul;
+     x->tagAdd = x->tagAdd*mul + add;
+}
+#else
+#define RB_COUNT_ADD(x,n) ((void)0)
+#endif
+
+static inline void TreePush(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+#ifdef RB_RANGE_UPDATE
+     if(x->tagMul != 1.0 || x->tagAdd != 0.0) {
+          if(x->left != tree->nil) TreeTagApply(x->left,x->tagMul,x->tagAdd);
+          if(x->right != tree->nil) TreeTagApply(x->right,x->tagMul,x->tagAdd);
+          x->tagMul = 1.0;
+          x->tagAdd = 0.0;
+     }
+#endif
+}
+
+static void TreePushPath(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+#ifdef RB_RANGE_UPDATE
+     if(x == tree->root || x == tree->nil) return;
+     TreePushPath(tree,x->parent);
+     TreePush(tree,x);
+#endif
+}
+
+/***********************************************************************
+ * deferred sums (see RBTreeBeginBatch): instead of changing the sums of
+ * all nodes above a change, TreeSumsMark sets them to NaN, stopping at
+ * the first node which is already NaN (its ancestors are NaN as well);
+ * a rotation recomputes a node from its children, so a node below which
+ * there is a NaN becomes NaN again, and the ancestors of a NaN node stay
+ * NaN; TreeSumsFlush then recomputes the NaN nodes from the bottom up,
+ * descending from the root only into NaN children, so each node on the
+ * union of the changed paths is recomputed once
+ * (a NaN coming from DistFunc is propagated the same way, this only
+ * makes the flush visit its path as well)
+ ***********************************************************************/
+static inline void TreeSumsMark(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     for(; x != tree->root && !isnan(x->children); x = x->parent) {
+          x->children = NAN;
+          RB_STAT_ADD(tree,sumSteps,1);
+     }
+}
+
+static void TreeSumsRecompute(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     TreePush(tree,x);
+     if(isnan(x->left->children)) TreeSumsRecompute(tree,x->left);
+     if(isnan(x->right->children)) TreeSumsRecompute(tree,x->right);
+     TreeUpdateSum(tree,x);
+}
+
+static void TreeSumsFlush(rb_red_blk_tree* tree) {
+     if(isnan(tree->root->left->children)) TreeSumsRecompute(tree,tree->root->left);
+}
+
+/* sum of the subtree of x and weight of x, with mul and add composed */
+/* from the tags of the ancestors of x (by TreeTagDown) */
+static inline double TreeTagSum(const rb_red_blk_node* x, double mul, double add) {
+#ifdef RB_RANGE_UPDATE
+     return x->children*mul + add*(double)(x->count);
+#else
+     return x->children;
+#endif
+}
+
+static inline double TreeTagWeight(const rb_red_blk_node* x, double mul, double add) {
+#ifdef RB_RANGE_UPDATE
+     return x->weight*mul + add;
+#else
+     return x->weight;
+#endif
+}
+
+/* compose the tag of x to mul and add, when descending below x */
+static inline void TreeTagDown(const rb_red_blk_node* x, double* mul, double* add) {
+#ifdef RB_RANGE_UPDATE
+     *add += x->tagAdd * *mul;
+     *mul *= x->tagMul;
+#endif
+}
+
+/* apply the tag of x to sum, which is a sum over count nodes below x */
+/* (when ascending from below x) */
+static inline double TreeTagUp(const rb_red_blk_node* x, double sum, double count) {
+#ifdef RB_RANGE_UPDATE
+     return sum*x->tagMul + x->tagAdd*count;
+#else
+     return sum;
+#endif
+}
+
+static inline double TreeCount(const rb_red_blk_node* x) {
+#ifdef RB_RANGE_UPDATE
+     return (double)(x->count);
+#else
+     return 0.0;
+#endif
+}
+
+/***********************************************************************
+ * change tracking for RBTreeExportChanges (RB_TRACK_CHANGES)
+ * TreeDirtyPath marks x and the nodes above it (up to the first one
+ * already marked, since all nodes above that are marked as well); it is
+ * called for the nodes whose links changed, after the change
+ * TreeDirtyNode also records that the weight at the place of x changed
+ * by delta (stored units); TreeDirtyDelete is called before deleting z
+ * (while it is still linked): the weight of z, and the changes recorded
+ * in z, go to the node after it, or are dropped if there is none (the
+ * shifts are only needed for the nodes after a change)
+ * without RB_TRACK_CHANGES, all of these do nothing
+ ***********************************************************************/
+static inline void TreeDirtyPath(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+#ifdef RB_TRACK_CHANGES
+     rb_red_blk_node* root = tree->root;
+     if(x == root || x == tree->nil) return;
+     x->dirty |= RB_DIRTY_PATH;
+     for(x = x->parent; x != root && !(x->dirty & RB_DIRTY_PATH); x = x->parent)
+          x->dirty |= RB_DIRTY_PATH;
+#endif
+}
+
+static inline void TreeDirtyNode(rb_red_blk_tree* tree, rb_red_blk_node* x, double delta) {
+#ifdef RB_TRACK_CHANGES
+     x->dirty |= RB_DIRTY_NODE;
+     x->dirtyDelta += delta;
+     TreeDirtyPath(tree,x);
+#endif
+}
+
+static inline void TreeDirtyInit(rb_red_blk_node* x) {
+#ifdef RB_TRACK_CHANGES
+     x->dirty = 0;
+     x->dirtyDelta = 0.0;
+#endif
+}
+
+static inline void TreeDirtyDelete(rb_red_blk_tree* tree, rb_red_blk_node* z) {
+#ifdef RB_TRACK_CHANGES
+     rb_red_blk_node* s = TreeSuccessor(tree,z);
+     if(s != tree->nil) TreeDirtyNode(tree,s,z->dirtyDelta - z->weight);
+#endif
+}
+
+static inline void TreeDirtyAll(rb_red_blk_tree* tree) {
+#ifdef RB_TRACK_CHANGES
+     tree->dirtyAll = 1;
+#endif
+}
+
+/***********************************************************************
+ * quantile fingers (see RBQuantileTrack)
+ * each change of the tree first updates the sum before the node of each
+ * finger, depending on the side of the finger where the change is; then
+ * TreeFingerAdjust moves the finger to the next or previous nodes until
+ * it is at the node crossing the new target again (after a change of
+ * weight w, this is at most the number of nodes in a weight of w around
+ * the old place)
+ * with RB_RANGE_UPDATE, the weights of the neighboring nodes are only
+ * known after applying the pending updates above them, so the fingers
+ * are searched again from the root instead (O(log(n)) for each change)
+ ***********************************************************************/
+static void TreeFingerSelect(rb_red_blk_tree* tree, rb_quantile_finger* f) {
+     double before;
+     f->node = RBWeightSelect(tree,f->p * RBTreeTotal(tree),&before);
+     f->before = before / tree->scale;
+}
+
+static void TreeFingersSelect(rb_red_blk_tree* tree) {
+     rb_quantile_finger* f;
+     for(f = tree->fingers; f; f = f->next) TreeFingerSelect(tree,f);
+}
+
+#ifndef RB_RANGE_UPDATE
+/* -1 if a is before b in the order of the tree, 1 if after (a != b, */
+/* this is only needed for equal keys): compare the paths from the root */
+static int TreeNodeOrder(const rb_red_blk_tree* tree, const rb_red_blk_node* a, const rb_red_blk_node* b) {
+     const rb_red_blk_node* root = tree->root;
+     const rb_red_blk_node* x;
+     const rb_red_blk_node* ca = 0; /* child of the common ancestor towards a */
+     const rb_red_blk_node* cb = 0;
+     unsigned int da = 0, db = 0;
+     for(x = a; x != root; x = x->parent) da++;
+     for(x = b; x != root; x = x->parent) db++;
+     for(; da > db; da--) { ca = a; a = a->parent; }
+     for(; db > da; db--) { cb = b; b = b->parent; }
+     while(a != b) {
+          ca = a;
+          a = a->parent;
+          cb = b;
+          b = b->parent;
+     }
+     /* a is the lowest common ancestor, ca or cb is 0 if it is a or b */
+     if(ca == 0) return (cb == a->left) ? 1 : -1;
+     if(cb == 0) return (ca == a->left) ? -1 : 1;
+     return (ca == a->left) ? -1 : 1;
+}
+
+static inline int TreeNodeBefore(const rb_red_blk_tree* tree, const rb_red_blk_node* a, const rb_red_blk_node* b) {
+     int cmp = TreeCompare(tree,a->key,b->key);
+     if(cmp == 0) cmp = TreeNodeOrder(tree,a,b);
+     return (cmp == -1);
+}
+
+static void TreeFingerAdjust(rb_red_blk_tree* tree, rb_quantile_finger* f) {
+     rb_red_blk_node* nil = tree->nil;
+     rb_red_blk_node* x = f->node;
+     rb_red_blk_node* y;
+     double target = f->p * tree->root->left->children;
+     double before = f->before;
+     if(x == nil) return;
+     while(before + x->weight <= target && (y = TreeSuccessor(tree,x)) != nil) {
+          before += x->weight;
+          x = y;
+     }
+     while(before > target && (y = TreePredecessor(tree,x)) != nil) {
+          x = y;
+          before -= x->weight;
+     }
+     f->node = x;
+     f->before = before;
+}
+#endif
+
+/* after the insert of z (the sums are already updated) */
+static inline void TreeFingersInsert(rb_red_blk_tree* tree, rb_red_blk_node* z) {
+     rb_quantile_finger* f;
+     if(tree->batch) return; /* searched again by RBTreeEndBatch */
+     for(f = tree->fingers; f; f = f->next) {
+#ifdef RB_RANGE_UPDATE
+          TreeFingerSelect(tree,f);
+#else
+          if(f->node == tree->nil) { /* the tree was empty */
+               f->node = z;
+               f->before = 0.0;
+          }
+          /* equal keys are inserted after the existing ones */
+          else if(TreeCompare(tree,z->key,f->node->key) == -1) f->before += z->weight;
+          TreeFingerAdjust(tree,f);
+#endif
+     }
+}
+
+/* before deleting z (while it is still linked): no finger stays at z */
+static inline void TreeFingersDelete(rb_red_blk_tree* tree, rb_red_blk_node* z) {
+#ifndef RB_RANGE_UPDATE
+     rb_quantile_finger* f;
+     if(tree->batch) return;
+     for(f = tree->fingers; f; f = f->next) {
+          if(f->node == z) {
+               rb_red_blk_node* y = TreeSuccessor(tree,z);
+               if(y == tree->nil) {
+                    y = TreePredecessor(tree,z);
+                    f->before -= y->weight; /* not used if y is nil */
+               }
+               f->node = y;
+          }
+          else if(TreeNodeBefore(tree,z,f->node)) f->before -= z->weight;
+     }
+#endif
+}
+
+/* after a delete: move the fingers to the new targets */
+static inline void TreeFingersDone(rb_red_blk_tree* tree) {
+     rb_quantile_finger* f;
+     if(tree->batch) return;
+     for(f = tree->fingers; f; f = f->next) {
+#ifdef RB_RANGE_UPDATE
+          TreeFingerSelect(tree,f);
+#else
+          if(f->node == tree->nil) f->before = 0.0;
+          TreeFingerAdjust(tree,f);
+#endif
+     }
+}
+
+/* after the weight of x changed by diff (the sums are already updated) */
+static inline void TreeFingersWeight(rb_red_blk_tree* tree, rb_red_blk_node* x, double diff) {
+     rb_quantile_finger* f;
+     if(tree->batch) return;
+     for(f = tree->fingers; f; f = f->next) {
+#ifdef RB_RANGE_UPDATE
+          TreeFingerSelect(tree,f);
+#else
+          if(x != f->node && TreeNodeBefore(tree,x,f->node)) f->before += diff;
+          TreeFingerAdjust(tree,f);
+#endif
+     }
 }
 
 /***********************************************************************/
@@ -76,9 +651,13 @@ static inline void TreeUpdateSum(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 /*            makes the parent of x be to the left of x, x the parent of */
 /*            its parent before the rotation and fixes other pointers */
 /*            accordingly. */
+/*            TreeLeftRotate does the same with the parent of x given */
+/*            (xp), so that the top-down functions, which know it from */
+/*            the descent, do not read the parent pointers (these are */
+/*            still set, for TreeSuccessor, GetNodeRank etc.). */
 /***********************************************************************/
 
-void LeftRotate(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+static void TreeLeftRotate(rb_red_blk_tree* tree, rb_red_blk_node* xp, rb_red_blk_node* x) {
   rb_red_blk_node* y;
   rb_red_blk_node* nil=tree->nil;
 
@@ -92,20 +671,23 @@ void LeftRotate(rb_red_blk_tree* tree, rb_red_blk_node* x) {
   /*  calls LeftRotate it expects the parent pointer of nil to be */
   /*  unchanged. */
 
+  RB_STAT_ADD(tree,leftRotate,1);
   y=x->right;
+  TreePush(tree,x);
+  TreePush(tree,y);
   x->right=y->left;
 
   if (y->left != nil) y->left->parent=x; /* used to use sentinel here */
   /* and do an unconditional assignment instead of testing for nil */
   
-  y->parent=x->parent;   
+  y->parent=xp;   
 
   /* instead of checking if x->parent is the root as in the book, we */
   /* count on the root sentinel to implicitly take care of this case */
-  if( x == x->parent->left) {
-    x->parent->left=y;
+  if( x == xp->left) {
+    xp->left=y;
   } else {
-    x->parent->right=y;
+    xp->right=y;
   }
   y->left=x;
   x->parent=y;
@@ -120,6 +702,7 @@ void LeftRotate(rb_red_blk_tree* tree, rb_red_blk_node* x) {
  ************************************/
  TreeUpdateSum(tree,x); /* first we need to update x */
  TreeUpdateSum(tree,y); /* y->left == x, we use the result of the last calculation here */
+ TreeDirtyPath(tree,x); /* and y above it */
 
 #ifdef DEBUG_ASSERT
   Assert(!tree->nil->red,"nil not red in LeftRotate");
@@ -128,6 +711,10 @@ void LeftRotate(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 #endif
 }
 
+void LeftRotate(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+  TreeLeftRotate(tree,x->parent,x);
+}
+
 
 /***********************************************************************/
 /*  FUNCTION:  RighttRotate */
@@ -144,9 +731,11 @@ void LeftRotate(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 /*            makes the parent of x be to the left of x, x the parent of */
 /*            its parent before the rotation and fixes other pointers */
 /*            accordingly. */
+/*            TreeRightRotate does the same with the parent of y given */
+/*            (yp), see TreeLeftRotate. */
 /***********************************************************************/
 
-void RightRotate(rb_red_blk_tree* tree, rb_red_blk_node* y) {
+static void TreeRightRotate(rb_red_blk_tree* tree, rb_red_blk_node* yp, rb_red_blk_node* y) {
   rb_red_blk_node* x;
   rb_red_blk_node* nil=tree->nil;
 
@@ -160,7 +749,10 @@ void RightRotate(rb_red_blk_tree* tree, rb_red_blk_node* y) {
   /*  calls LeftRotate it expects the parent pointer of nil to be */
   /*  unchanged. */
 
+  RB_STAT_ADD(tree,rightRotate,1);
   x=y->left;
+  TreePush(tree,y);
+  TreePush(tree,x);
   y->left=x->right;
 
   if (nil != x->right)  x->right->parent=y; /*used to use sentinel here */
@@ -168,11 +760,11 @@ void RightRotate(rb_red_blk_tree* tree, rb_red_blk_node* y) {
 
   /* instead of checking if x->parent is the root as in the book, we */
   /* count on the root sentinel to implicitly take care of this case */
-  x->parent=y->parent;
-  if( y == y->parent->left) {
-    y->parent->left=x;
+  x->parent=yp;
+  if( y == yp->left) {
+    yp->left=x;
   } else {
-    y->parent->right=x;
+    yp->right=x;
   }
   x->right=y;
   y->parent=x;
@@ -184,6 +776,7 @@ void RightRotate(rb_red_blk_tree* tree, rb_red_blk_node* y) {
  ************************************/
  TreeUpdateSum(tree,y);
  TreeUpdateSum(tree,x);
+ TreeDirtyPath(tree,y);
 
 #ifdef DEBUG_ASSERT
   Assert(!tree->nil->red,"nil not red in RightRotate");
@@ -192,42 +785,139 @@ void RightRotate(rb_red_blk_tree* tree, rb_red_blk_node* y) {
 #endif
 }
 
+void RightRotate(rb_red_blk_tree* tree, rb_red_blk_node* y) {
+  TreeRightRotate(tree,y->parent,y);
+}
+
+/***********************************************************************
+ * treap engine: random priorities (splitmix64 on a per-tree state), and
+ * rotations that move a node up until its parent has higher priority;
+ * the children sums are kept by LeftRotate and RightRotate
+ ***********************************************************************/
+static inline unsigned int TreapRandom(rb_red_blk_tree* tree) {
+     uint64_t z = (tree->rngState += 0x9E3779B97F4A7C15ULL);
+     z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+     z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+     return (unsigned int)((z ^ (z >> 31)) >> 32);
+}
+
+static void TreapRotateUp(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     rb_red_blk_node* root = tree->root;
+     while(x->parent != root && x->priority > x->parent->priority) {
+          if(x == x->parent->left) RightRotate(tree,x->parent);
+          else LeftRotate(tree,x->parent);
+     }
+}
+
+/* an access to x: the new priority is the maximum of the old one and a
+ * new random number, so after k accesses it is distributed as the
+ * maximum of k+1 random numbers */
+static inline void TreapAccess(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     unsigned int r = TreapRandom(tree);
+     if(r > x->priority) {
+          x->priority = r;
+          TreapRotateUp(tree,x);
+     }
+}
+
+/* delete z from a treap: rotate it down until it has at most one child,
+ * then splice it out */
+static void TreapDelete(rb_red_blk_tree* tree, rb_red_blk_node* z) {
+     rb_red_blk_node* nil = tree->nil;
+     rb_red_blk_node* root = tree->root;
+     rb_red_blk_node* w;
+     rb_red_blk_node* c;
+     double zdval;
+     
+     TreePushPath(tree,z);
+     TreeDirtyDelete(tree,z);
+     TreeFingersDelete(tree,z);
+     while(z->left != nil && z->right != nil) {
+          if(z->left->priority > z->right->priority) RightRotate(tree,z);
+          else LeftRotate(tree,z);
+     }
+     zdval = z->weight;
+     if(tree->batch) TreeSumsMark(tree,z->parent);
+     else for(w = z->parent; w != root; w = w->parent) {
+          w->children -= zdval;
+          RB_COUNT_ADD(w,-1);
+          RB_STAT_ADD(tree,sumSteps,1);
+     }
+     c = (z->left == nil) ? z->right : z->left;
+     if(z == z->parent->left) z->parent->left = c;
+     else z->parent->right = c;
+     if(c != nil) c->parent = z->parent;
+     TreeDirtyPath(tree,z->parent);
+     tree->DestroyKey(z->key);
+     tree->DestroyInfo(z->info);
+     TreeFreeNode(tree,z);
+     TreeFingersDone(tree);
+}
+
 /***********************************************************************/
-/*  FUNCTION:  TreeInsertHelp  */
+/*  FUNCTION:  RBTreeSetEngine */
 /**/
-/*  INPUTS:  tree is the tree to insert into and z is the node to insert */
+/*    INPUTS:  tree is the tree in question, engine is RB_ENGINE_RB or */
+/*             RB_ENGINE_TREAP (see red_black_tree.h) */
 /**/
-/*  OUTPUT:  none */
+/*    OUTPUT:  1 on success, 0 if the tree is not empty or engine is */
+/*             not valid (the tree is not changed then) */
 /**/
-/*  Modifies Input:  tree, z */
+/*    EFFECT:  Selects the balancing algorithm used by the insert and */
+/*             delete functions and RBTreeAccess. With the treap, */
+/*             RBTreeAccess modifies the tree, so it should not be called */
+/*             concurrently with any other function (even queries); the */
+/*             other queries (RBExactQuery etc.) do not change it. */
 /**/
-/*  EFFECTS:  Inserts z into the tree as if it were a regular binary tree */
-/*            using the algorithm described in _Introduction_To_Algorithms_ */
-/*            by Cormen et al.  This funciton is only intended to be called */
-/*            by the RBTreeInsert function and not by the user */
+/*    Modifies Input: tree */
 /***********************************************************************/
 
-void TreeInsertHelp(rb_red_blk_tree* tree, rb_red_blk_node* z) {
-  /*  This function should only be called by InsertRBTree (see above) */
-  rb_red_blk_node* x;
-  rb_red_blk_node* y;
-  rb_red_blk_node* nil=tree->nil;
+int RBTreeSetEngine(rb_red_blk_tree* tree, int engine) {
+     if(tree->root->left != tree->nil) return 0;
+     if(engine != RB_ENGINE_RB && engine != RB_ENGINE_TREAP) return 0;
+     tree->engine = engine;
+     return 1;
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeSetNodeStorage */
+/**/
+/*    INPUTS:  tree is the tree in question, storage is RB_STORAGE_HEAP, */
+/*             RB_STORAGE_THP or RB_STORAGE_HUGETLB (see red_black_tree.h) */
+/**/
+/*    OUTPUT:  1 on success, 0 if the tree is not empty, storage is not */
+/*             valid or huge pages are not supported on this system */
+/**/
+/*    EFFECT:  Selects where the nodes inserted later are allocated. */
+/*             Blocks kept from a previous huge page storage are freed. */
+/*             Later compactions (RBTreeCompact) and bulk loads */
+/*             (RBTreeBuildSorted) also put their arenas on huge pages. */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+int RBTreeSetNodeStorage(rb_red_blk_tree* tree, int storage) {
+     if(tree->root->left != tree->nil) return 0;
+     if(storage != RB_STORAGE_HEAP && storage != RB_STORAGE_THP && storage != RB_STORAGE_HUGETLB) return 0;
+#ifndef __linux__
+     if(storage != RB_STORAGE_HEAP) return 0;
+#endif
+     TreeSlabsFree(tree);
+     tree->storage = storage;
+     return 1;
+}
+
+/***********************************************************************
+ * link z into the tree as the left (if left != 0) or right child of y
+ * (which should be nil), and add DistFunc(z) to the sums of all nodes
+ * above it (helper for TreeInsertHelp and RBTreeInsertHint)
+ ***********************************************************************/
+static void TreeLinkNode(rb_red_blk_tree* tree, rb_red_blk_node* z, rb_red_blk_node* y, int left) {
   rb_red_blk_node* root = tree->root;
   
-  z->left=z->right=nil;
-  y=tree->root;
-  x=tree->root->left;
-  while( x != nil) {
-    y=x;
-    if (1 == tree->Compare(x->key,z->key)) { /* x.key > z.key */
-      x=x->left;
-    } else { /* x,key <= z.key */
-      x=x->right;
-    }
-  }
+  TreePushPath(tree,y); /* z is not below the pending updates of its ancestors */
   z->parent=y;
-  if ( (y == tree->root) ||
-       (1 == tree->Compare(y->key,z->key))) { /* y.key > z.key */
+  if (left) {
     y->left=z;
   } else {
     y->right=z;
@@ -237,14 +927,27 @@ void TreeInsertHelp(rb_red_blk_tree* tree, rb_red_blk_node* z) {
  TODO: beillesztett node: z, z->children = DistFunc(z),
  * ezt felfele rekurzívan hozzá kell adni minden node-hoz
 *************************************/
-  z->children = tree->DistFunc(z->key,tree->dfparam);
-  {
+  z->children = z->weight = TreeNewWeight(tree,z->key);
+#ifdef RB_RANGE_UPDATE
+  z->count = 1;
+  z->tagMul = 1.0;
+  z->tagAdd = 0.0;
+#endif
+  TreeDirtyInit(z);
+  TreeDirtyNode(tree,z,z->weight);
+  RB_EPOCH_INIT(z);
+  RB_EPOCH_BUMP(tree);
+  if(tree->batch) TreeSumsMark(tree,z->parent);
+  else {
        rb_red_blk_node* w = z->parent;
        while(w != root) {
             w->children += z->children;
+            RB_COUNT_ADD(w,1);
             w = w->parent;
+            RB_STAT_ADD(tree,sumSteps,1);
        }
   }
+  TreeFingersInsert(tree,z);
 
 #ifdef DEBUG_ASSERT
   Assert(!tree->nil->red,"nil not red in TreeInsertHelp");
@@ -253,39 +956,58 @@ void TreeInsertHelp(rb_red_blk_tree* tree, rb_red_blk_node* z) {
 #endif
 }
 
-/*  Before calling Insert RBTree the node x should have its key set */
+/***********************************************************************
+ * find the place of z in the subtree of x (where y is the parent of x;
+ * x can be nil only if y is the root sentinel), and link it there
+ * nodes with keys equal to z are kept to the left of z
+ ***********************************************************************/
+static void TreeInsertFrom(rb_red_blk_tree* tree, rb_red_blk_node* z, rb_red_blk_node* y,
+          rb_red_blk_node* x) {
+  rb_red_blk_node* nil=tree->nil;
+  int left = 1; /* an empty tree: z becomes root->left */
+  
+  while( x != nil) {
+    y=x;
+    if (1 == TreeCompare(tree,x->key,z->key)) { /* x.key > z.key */
+      x=x->left;
+      left = 1;
+    } else { /* x,key <= z.key */
+      x=x->right;
+      left = 0;
+    }
+  }
+  TreeLinkNode(tree,z,y,left);
+}
 
 /***********************************************************************/
-/*  FUNCTION:  RBTreeInsert */
+/*  FUNCTION:  TreeInsertHelp  */
 /**/
-/*  INPUTS:  tree is the red-black tree to insert a node which has a key */
-/*           pointed to by key and info pointed to by info.  */
+/*  INPUTS:  tree is the tree to insert into and z is the node to insert */
 /**/
-/*  OUTPUT:  This function returns a pointer to the newly inserted node */
-/*           which is guarunteed to be valid until this node is deleted. */
-/*           What this means is if another data structure stores this */
-/*           pointer then the tree does not need to be searched when this */
-/*           is to be deleted. */
+/*  OUTPUT:  none */
 /**/
-/*  Modifies Input: tree */
+/*  Modifies Input:  tree, z */
 /**/
-/*  EFFECTS:  Creates a node node which contains the appropriate key and */
-/*            info pointers and inserts it into the tree. */
+/*  EFFECTS:  Inserts z into the tree as if it were a regular binary tree */
+/*            using the algorithm described in _Introduction_To_Algorithms_ */
+/*            by Cormen et al.  This funciton is only intended to be called */
+/*            by the RBTreeInsert function and not by the user */
 /***********************************************************************/
 
-rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, void* key, void* info) {
-  rb_red_blk_node * y;
-  rb_red_blk_node * x;
-  rb_red_blk_node * newNode;
-
-  x=(rb_red_blk_node*) SafeMalloc(sizeof(rb_red_blk_node));
-  x->key=key;
-  x->info=info;
+void TreeInsertHelp(rb_red_blk_tree* tree, rb_red_blk_node* z) {
+  /*  This function should only be called by InsertRBTree (see above) */
+  z->left=z->right=tree->nil;
+  TreeInsertFrom(tree,z,tree->root,tree->root->left);
+}
 
-  TreeInsertHelp(tree,x);
-  newNode=x;
-  x->red=1;
+/***********************************************************************
+ * restore the red-black properties after inserting x
+ * (helper for RBTreeInsert and RBTreeInsertHint)
+ ***********************************************************************/
+static void RBInsertFixUp(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+  rb_red_blk_node * y;
   
+  x->red=1;
   /******************************************************************
    * TODO: itt nem változnak a viszonyok (ha jól látom), minden
    * változtatás a *Rotate fv.-ekben történik, azokban a children
@@ -327,7 +1049,50 @@ rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, void* key, void* info) {
     }
   }
   tree->root->left->red=0;
-  return(newNode);
+}
+
+/***********************************************************************
+ * restore the balance after inserting x, depending on the engine
+ ***********************************************************************/
+static inline void TreeInsertFixUp(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+  if (tree->engine == RB_ENGINE_TREAP) {
+    x->red = 0;
+    x->priority = TreapRandom(tree);
+    TreapRotateUp(tree,x);
+  }
+  else RBInsertFixUp(tree,x);
+}
+
+/*  Before calling Insert RBTree the node x should have its key set */
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeInsert */
+/**/
+/*  INPUTS:  tree is the red-black tree to insert a node which has a key */
+/*           pointed to by key and info pointed to by info.  */
+/**/
+/*  OUTPUT:  This function returns a pointer to the newly inserted node */
+/*           which is guarunteed to be valid until this node is deleted. */
+/*           What this means is if another data structure stores this */
+/*           pointer then the tree does not need to be searched when this */
+/*           is to be deleted. */
+/**/
+/*  Modifies Input: tree */
+/**/
+/*  EFFECTS:  Creates a node node which contains the appropriate key and */
+/*            info pointers and inserts it into the tree. */
+/***********************************************************************/
+
+rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, void* key, void* info) {
+  rb_red_blk_node * x;
+
+  x=TreeAllocNode(tree);
+  x->key=key;
+  x->info=info;
+
+  TreeInsertHelp(tree,x);
+  TreeInsertFixUp(tree,x);
+  return(x);
 
 #ifdef DEBUG_ASSERT
   Assert(!tree->nil->red,"nil not red in RBTreeInsert");
@@ -336,6 +1101,173 @@ rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, void* key, void* info) {
 }
 
 
+/***********************************************************************/
+/*  FUNCTION:  RBTreeInsertHint */
+/**/
+/*  INPUTS:  tree is the red-black tree to insert a node with key and */
+/*           info; hint is a node already in the tree which is expected */
+/*           to be close to the place of the new node (e.g. the node */
+/*           inserted previously when the keys arrive almost sorted), */
+/*           or nil / NULL if there is no such node */
+/**/
+/*  OUTPUT:  This function returns a pointer to the newly inserted node */
+/*           (as RBTreeInsert). */
+/**/
+/*  Modifies Input: tree */
+/**/
+/*  EFFECTS:  First checks if the new node belongs right before or right */
+/*            after hint (with two comparisons); if not, climbs up from */
+/*            hint only until reaching a subtree which contains the place */
+/*            of the key (finger search), and descends from there. The */
+/*            result is the same as with RBTreeInsert; for sorted input */
+/*            with the previous node as hint, the number of comparisons */
+/*            is O(1) amortized (updating the sums upwards is still */
+/*            O(log(n)), but needs no comparisons). */
+/***********************************************************************/
+
+rb_red_blk_node * RBTreeInsertHint(rb_red_blk_tree* tree, rb_red_blk_node* hint, void* key, void* info) {
+  rb_red_blk_node * x;
+  rb_red_blk_node * y;
+  rb_red_blk_node * nil=tree->nil;
+  rb_red_blk_node * root=tree->root;
+  
+  if(hint == 0 || hint == nil || hint == root) return RBTreeInsert(tree,key,info);
+
+  x=TreeAllocNode(tree);
+  x->key=key;
+  x->info=info;
+  x->left=x->right=nil;
+  
+  if (1 == TreeCompare(tree,hint->key,key)) { /* key < hint.key */
+    y = TreePredecessor(tree,hint);
+    if (y == nil || 1 != TreeCompare(tree,y->key,key)) {
+      /* y.key <= key < hint.key, the new node goes between them */
+      if (hint->left == nil) TreeLinkNode(tree,x,hint,1);
+      else TreeLinkNode(tree,x,y,0); /* y is the maximum in the left subtree of hint */
+    } else {
+      /* climb up until a subtree containing key: the first ancestor */
+      /* which is a right child with parent.key <= key */
+      y = hint;
+      while (y->parent != root) {
+        if (y == y->parent->right && 1 != TreeCompare(tree,y->parent->key,key)) break;
+        y = y->parent;
+      }
+      TreeInsertFrom(tree,x,y->parent,y);
+    }
+  } else { /* hint.key <= key */
+    y = TreeSuccessor(tree,hint);
+    if (y == nil || 1 == TreeCompare(tree,y->key,key)) {
+      /* hint.key <= key < y.key, the new node goes between them */
+      if (hint->right == nil) TreeLinkNode(tree,x,hint,0);
+      else TreeLinkNode(tree,x,y,1); /* y is the minimum in the right subtree of hint */
+    } else {
+      /* climb up until a subtree containing key: the first ancestor */
+      /* which is a left child with parent.key > key */
+      y = hint;
+      while (y->parent != root) {
+        if (y == y->parent->left && 1 == TreeCompare(tree,y->parent->key,key)) break;
+        y = y->parent;
+      }
+      TreeInsertFrom(tree,x,y->parent,y);
+    }
+  }
+  
+  TreeInsertFixUp(tree,x);
+  return(x);
+}
+
+
+/***********************************************************************
+ * build a balanced subtree from keys[lo], ..., keys[hi-1] (sorted) in
+ * the next slots of the arena a (in preorder), and return its root; the
+ * nodes at depth red (below all complete levels) are red
+ ***********************************************************************/
+static rb_red_blk_node* TreeBuildRange(rb_red_blk_tree* tree, rb_node_arena* a, void* const* keys,
+          void* const* infos, size_t lo, size_t hi, unsigned int depth, unsigned int red) {
+     rb_red_blk_node* x;
+     size_t mid;
+     if(lo >= hi) return tree->nil;
+     mid = lo + (hi-lo)/2;
+     x = a->nodes + a->used;
+     a->used++;
+     x->key = keys[mid];
+     x->info = infos ? infos[mid] : 0;
+     x->red = (depth == red);
+     x->priority = 0;
+     x->left = TreeBuildRange(tree,a,keys,infos,lo,mid,depth+1,red);
+     x->right = TreeBuildRange(tree,a,keys,infos,mid+1,hi,depth+1,red);
+     if(x->left != tree->nil) x->left->parent = x;
+     if(x->right != tree->nil) x->right->parent = x;
+     x->weight = TreeNewWeight(tree,x->key);
+#ifdef RB_RANGE_UPDATE
+     x->tagMul = 1.0;
+     x->tagAdd = 0.0;
+#endif
+#ifdef RB_TRACK_CHANGES
+     x->dirty = RB_DIRTY_PATH | RB_DIRTY_NODE;
+     x->dirtyDelta = x->weight;
+#endif
+     RB_EPOCH_INIT(x);
+     TreeUpdateSum(tree,x);
+     return x;
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeBuildSorted */
+/**/
+/*  INPUTS:  tree is an empty tree, keys are n keys sorted in */
+/*           nondecreasing order, infos are the corresponding infos (or */
+/*           0 to set all infos to 0) */
+/**/
+/*  OUTPUT:  1 on success, 0 if the tree is not empty (it is not */
+/*           changed then) */
+/**/
+/*  Modifies Input: tree */
+/**/
+/*  EFFECTS:  Bulk load: builds a perfectly balanced tree from the keys */
+/*            directly, in O(n) (DistFunc is called once for each key, */
+/*            there are no comparisons and no rotations), with all nodes */
+/*            allocated in one contiguous block, in preorder (as after */
+/*            RBTreeCompact(tree,RB_LAYOUT_DFS)). The keys are in the */
+/*            same order, with the same weights and sums, as after */
+/*            inserting them one by one, but the shape and the colors */
+/*            of the tree are different. With the treap engine, */
+/*            the keys are inserted by RBTreeInsertHint instead, since */
+/*            the priorities have to be random. */
+/***********************************************************************/
+
+int RBTreeBuildSorted(rb_red_blk_tree* tree, void* const* keys, void* const* infos, size_t n) {
+  rb_node_arena* a;
+  rb_red_blk_node* x;
+  unsigned int full = 0; /* number of complete levels */
+  size_t i;
+  
+  if (tree->root->left != tree->nil) return 0;
+  if (n == 0) return 1;
+#ifdef DEBUG_ASSERT
+  for (i=1;i<n;i++) Assert(TreeCompare(tree,keys[i-1],keys[i]) != 1,"keys not sorted in RBTreeBuildSorted");
+#endif
+  if (tree->engine == RB_ENGINE_TREAP) {
+    x = 0;
+    for (i=0;i<n;i++) x = RBTreeInsertHint(tree,x,keys[i],infos ? infos[i] : 0);
+    return 1;
+  }
+  
+  while (full < 63 && (((size_t)1) << (full+1)) - 1 <= n) full++;
+  a = TreeArenaCreate(tree,n);
+  x = TreeBuildRange(tree,a,keys,infos,0,n,0,full);
+  a->live = n;
+  tree->nodes += n;
+  RB_STAT_ADD(tree,nodesAlloc,n);
+  x->parent = tree->root;
+  x->red = 0;
+  tree->root->left = x;
+  RB_EPOCH_BUMP(tree);
+  TreeFingersSelect(tree);
+  return 1;
+}
+
+
 /***********************************************************************/
 /*  FUNCTION:  GetNodeRank  */
 /**/
@@ -344,9 +1276,9 @@ rb_red_blk_node * RBTreeInsert(rb_red_blk_tree* tree, void* key, void* info) {
 /**/
 /*    OUTPUT:  This function returns the rank of x. */
 /**/
-/*    Modifies Input: none */
-/**/
-/*    Note:   */
+/*    Modifies Input: none (so it can be called from multiple threads, */
+/*                    e.g. by RBParallelNodeRank; see GetNodeRankCached */
+/*                    for storing the result) */
 /***********************************************************************/
   
 double GetNodeRank(rb_red_blk_tree* tree,rb_red_blk_node* x) {
@@ -359,14 +1291,437 @@ double GetNodeRank(rb_red_blk_tree* tree,rb_red_blk_node* x) {
      Assert((x!=root),"x == root in GetNodeRank!\n");
 #endif
      ret = x->left->children; //x is at least this
+     double count = TreeCount(x->left); /* nodes counted in ret (for the range updates) */
+     ret = TreeTagUp(x,ret,count);
      rb_red_blk_node* w = x;
      while(w->parent != root) {
-          if(w == w->parent->right) ret += w->parent->left->children + tree->DistFunc(w->parent->key,tree->dfparam);
-          w = w->parent;
+          rb_red_blk_node* p = w->parent;
+          if(w == p->right) {
+               ret += p->left->children;
+               count += TreeCount(p->left);
+          }
+          ret = TreeTagUp(p,ret,count);
+          if(w == p->right) {
+               ret += p->weight;
+               count += 1.0;
+          }
+          w = p;
      }
+     ret *= tree->scale;
      return ret;
 }
 
+/***********************************************************************/
+/*  FUNCTION:  GetNodeRankCached  */
+/**/
+/*    INPUTS:  tree is the tree in question, and x is the node we want the */
+/*             the rank of. */
+/**/
+/*    OUTPUT:  The rank of x, as GetNodeRank. */
+/**/
+/*    Modifies Input: x (with RB_RANK_CACHE) */
+/**/
+/*    Note:  With RB_RANK_CACHE, the result is stored in x with the */
+/*           epoch of the tree, and returned directly while the tree is */
+/*           not modified, so asking again for the same node is O(1). */
+/*           Since this writes the node, it should not be called while */
+/*           other threads query the same tree. Without RB_RANK_CACHE, */
+/*           this is the same as GetNodeRank. */
+/***********************************************************************/
+
+double GetNodeRankCached(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+#ifdef RB_RANK_CACHE
+     if(x->rankEpoch != tree->epoch) {
+          x->rankCache = GetNodeRank(tree,x);
+          x->rankEpoch = tree->epoch;
+     }
+     return x->rankCache;
+#else
+     return GetNodeRank(tree,x);
+#endif
+}
+
+
+/* recompute the weight of x and add the change to the sums upwards */
+/* (the pending range updates above x should be already pushed down) */
+static void TreeWeightChanged(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     rb_red_blk_node* root = tree->root;
+     rb_red_blk_node* w;
+     double diff = x->children;
+     if(tree->batch) {
+          diff = x->weight;
+          x->weight = TreeNewWeight(tree,x->key);
+          TreeDirtyNode(tree,x,x->weight - diff);
+          RB_EPOCH_BUMP(tree);
+          TreeSumsMark(tree,x);
+          return;
+     }
+     x->weight = TreeNewWeight(tree,x->key);
+     TreeUpdateSum(tree,x);
+     diff = x->children - diff;
+     TreeDirtyNode(tree,x,diff);
+     RB_EPOCH_BUMP(tree);
+     for(w = x->parent; w != root; w = w->parent) {
+          w->children += diff;
+          RB_STAT_ADD(tree,sumSteps,1);
+     }
+     TreeFingersWeight(tree,x,diff);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBUpdateWeight  */
+/**/
+/*    INPUTS:  tree is the tree in question, and x is a node for which */
+/*             DistFunc(x->key) has changed (e.g. the key points to a */
+/*             structure which stores the weight) */
+/**/
+/*    OUTPUT:  none */
+/**/
+/*    EFFECT:  Recomputes the sum of x and adds the difference to the */
+/*             sums of all nodes above it (complexity: O(log(n))). The */
+/*             change must not affect the order of x among the keys. */
+/**/
+/*    Modifies Input: tree, x */
+/***********************************************************************/
+
+void RBUpdateWeight(rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     TreePushPath(tree,x);
+     TreeWeightChanged(tree,x);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeBeginBatch */
+/**/
+/*    INPUTS:  tree is the tree in question */
+/**/
+/*    EFFECT:  Starts a batch of changes: until RBTreeEndBatch, the */
+/*             insert, delete and update functions (RBTreeInsert, */
+/*             RBTreeInsertHint, RBTreeInsertTopDown, RBDelete, */
+/*             RBDeleteKey, RBDeleteTopDown, RBUpsert, RBUpdateWeight) */
+/*             do not add the change to the sums above the node, only */
+/*             mark these sums as out of date (NaN), stopping at the */
+/*             first node marked already. Nodes on the paths of several */
+/*             changes are thus marked once, and recomputed once by */
+/*             RBTreeEndBatch. Within a batch, the sums are not valid, so */
+/*             no function using them (ranks, selection, RBTreeTotal, */
+/*             RBTreeDecay, the range updates, RBTreeCompact) may be */
+/*             called; the quantile fingers are searched again at the */
+/*             end. Batches cannot be nested. */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+void RBTreeBeginBatch(rb_red_blk_tree* tree) {
+     tree->batch = 1;
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeEndBatch */
+/**/
+/*    INPUTS:  tree is the tree in question */
+/**/
+/*    EFFECT:  Recomputes the sums marked since RBTreeBeginBatch from the */
+/*             bottom up, in one pass over the union of the paths of the */
+/*             changes (O(k log(n / k)) steps for k changes, instead of */
+/*             O(k log(n)) for updating the sums after each change). */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+void RBTreeEndBatch(rb_red_blk_tree* tree) {
+     TreeSumsFlush(tree);
+     tree->batch = 0;
+     TreeFingersSelect(tree);
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBWeightSelect  */
+/**/
+/*    INPUTS:  tree is the tree in question, target is a value between */
+/*             0 and the total sum (RBTreeTotal(tree)), before */
+/*             is where the sum before the result is stored (can be 0) */
+/**/
+/*    OUTPUT:  The node x for which GetNodeRank(x) <= target and */
+/*             GetNodeRank(x) + DistFunc(x) > target, i.e. the node where */
+/*             the cumulative sum crosses target; if target is larger */
+/*             than the total, the last node. nil for an empty tree. */
+/**/
+/*    Modifies Input: before */
+/**/
+/*    Note:  this is the inverse of GetNodeRank and can be used for */
+/*           quantiles or weighted sampling (complexity: O(log(n))) */
+/***********************************************************************/
+
+rb_red_blk_node* RBWeightSelect(const rb_red_blk_tree* tree, double target, double* before) {
+     rb_red_blk_node* nil = tree->nil;
+     rb_red_blk_node* x = tree->root->left;
+     double sum = 0.0;
+     double mul = 1.0, add = 0.0; /* pending range updates above x */
+     
+     target /= tree->scale; /* the stored weights are relative to the scale */
+     while(x != nil) {
+          double own = TreeTagWeight(x,mul,add);
+          double l;
+          TreeTagDown(x,&mul,&add);
+          l = TreeTagSum(x->left,mul,add);
+          if(target < l && x->left != nil) {
+               x = x->left;
+               continue;
+          }
+          target -= l;
+          sum += l;
+          if(target < own || x->right == nil) break;
+          target -= own;
+          sum += own;
+          x = x->right;
+     }
+     if(before) *before = sum * tree->scale;
+     return x;
+}
+
+
+/***********************************************************************
+ * recursive helper for RBWeightSelectSorted: the targets lo, ..., hi-1
+ * all fall into the subtree of x, offset is the sum before the subtree
+ * (mul and add are the pending range updates above x); the targets are
+ * split into the ones before x, at x and after x by binary searches
+ ***********************************************************************/
+static void TreeSelectSorted(const rb_red_blk_tree* tree, rb_red_blk_node* x,
+          const double* targets, size_t lo, size_t hi, double offset, double mul, double add,
+          rb_red_blk_node** out) {
+     rb_red_blk_node* nil = tree->nil;
+     while(lo < hi) {
+          size_t a = lo;
+          size_t b = hi;
+          size_t c;
+          double own = TreeTagWeight(x,mul,add);
+          double left;
+          TreeTagDown(x,&mul,&add);
+          left = offset + TreeTagSum(x->left,mul,add);
+          if(x->left != nil) {
+               while(a < b) { /* first target >= left */
+                    size_t mid = a + (b-a)/2;
+                    if(targets[mid] < left) a = mid + 1;
+                    else b = mid;
+               }
+               if(a > lo) TreeSelectSorted(tree,x->left,targets,lo,a,offset,mul,add,out);
+          }
+          offset = left + own;
+          b = hi;
+          if(x->right != nil) {
+               c = a;
+               while(c < b) { /* first target >= offset */
+                    size_t mid = c + (b-c)/2;
+                    if(targets[mid] < offset) c = mid + 1;
+                    else b = mid;
+               }
+          }
+          for(c=a;c<b;c++) out[c] = x;
+          lo = b;
+          x = x->right;
+     }
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBWeightSelectSorted */
+/**/
+/*    INPUTS:  tree is the tree in question, targets is an array of m */
+/*             values in nondecreasing order (between 0 and the total), */
+/*             nodes is an array of size m for the results */
+/**/
+/*    OUTPUT:  none */
+/**/
+/*    EFFECT:  nodes[i] is set to RBWeightSelect(tree,targets[i],0) */
+/*             (the results can differ only by rounding, for targets */
+/*             very close to the sum before a node); as in RBSortedRank, */
+/*             the upper levels of the tree are visited only once, */
+/*             O(m log(n/m + 1)) nodes in total; with sorted uniform */
+/*             random numbers times the total, this is a weighted sample */
+/*             of m nodes, in key order. For an empty tree, all results */
+/*             are nil. */
+/**/
+/*    Modifies Input: nodes */
+/***********************************************************************/
+
+void RBWeightSelectSorted(const rb_red_blk_tree* tree, const double* targets, size_t m, rb_red_blk_node** nodes) {
+     size_t i;
+     if(tree->root->left == tree->nil) {
+          for(i=0;i<m;i++) nodes[i] = tree->nil;
+          return;
+     }
+     if(tree->scale != 1.0) {
+          /* the stored weights are relative to the scale */
+          double* t = (double*)SafeMalloc(sizeof(double)*(m+1));
+          for(i=0;i<m;i++) t[i] = targets[i] / tree->scale;
+          TreeSelectSorted(tree,tree->root->left,t,0,m,0.0,1.0,0.0,nodes);
+          free(t);
+     }
+     else TreeSelectSorted(tree,tree->root->left,targets,0,m,0.0,1.0,0.0,nodes);
+}
+
+
+/***********************************************************************
+ * helpers for RBWeightDrawDistinct: find the node where the stored sums
+ * cross target, pushing the pending range updates down on the way (so
+ * the path can be changed afterwards); if target is beyond the sum of
+ * a subtree because of rounding, the last node with positive weight in
+ * it is taken; the result has zero weight only if all weights are zero
+ ***********************************************************************/
+static rb_red_blk_node* TreeSelectPush(rb_red_blk_tree* tree, double target) {
+     rb_red_blk_node* nil = tree->nil;
+     rb_red_blk_node* x = tree->root->left;
+     for(;;) {
+          double l, r;
+          TreePush(tree,x);
+          l = x->left->children;
+          r = x->right->children;
+          if(target < l) {
+               x = x->left;
+               continue;
+          }
+          target -= l;
+          if(target < x->weight) break;
+          target -= x->weight;
+          if(r > 0.0 && x->right != nil) x = x->right;
+          else if(x->weight > 0.0) break;
+          else if(l > 0.0 && x->left != nil) {
+               x = x->left;
+               target = l; /* beyond its sum as well */
+          }
+          else break;
+     }
+     return x;
+}
+
+/* set the weight of x (whose ancestors have no pending updates) and */
+/* recompute the sums above it from their children */
+static void TreeSetWeight(rb_red_blk_tree* tree, rb_red_blk_node* x, double w) {
+     rb_red_blk_node* root = tree->root;
+     x->weight = w;
+     RB_EPOCH_BUMP(tree);
+     for(; x != root; x = x->parent) {
+          TreeUpdateSum(tree,x);
+          RB_STAT_ADD(tree,sumSteps,1);
+     }
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBWeightDrawDistinct */
+/**/
+/*    INPUTS:  tree is the tree in question, Uniform(state) returns */
+/*             uniform random numbers in [0,1), m is the number of nodes */
+/*             to draw, nodes is an array of size m for the results */
+/**/
+/*    OUTPUT:  the number of nodes drawn: m, or less if there are less */
+/*             than m nodes with positive weight */
+/**/
+/*    EFFECT:  Weighted sampling without replacement (successive */
+/*             sampling): each node is drawn with probability */
+/*             proportional to its weight among the nodes not drawn yet. */
+/*             After each draw, the weight of the node is set to zero */
+/*             temporarily (the sums on its path are recomputed, */
+/*             O(log(n))); all weights are restored at the end with one */
+/*             pass over the union of the paths of the nodes drawn, so */
+/*             the tree is not changed (except that the sums on these */
+/*             paths are recomputed exactly, and the pending range */
+/*             updates on them are pushed down). */
+/**/
+/*    Modifies Input: tree (temporarily), nodes */
+/***********************************************************************/
+
+size_t RBWeightDrawDistinct(rb_red_blk_tree* tree, double (*Uniform)(void* state), void* state,
+          size_t m, rb_red_blk_node** nodes) {
+     double* saved;
+     size_t i, k;
+     if(tree->root->left == tree->nil || m == 0) return 0;
+     saved = (double*)SafeMalloc(sizeof(double)*m);
+     for(k=0;k<m;k++) {
+          double total = tree->root->left->children;
+          rb_red_blk_node* x;
+          if(!(total > 0.0)) break;
+          x = TreeSelectPush(tree,Uniform(state)*total);
+          if(!(x->weight > 0.0)) break;
+          nodes[k] = x;
+          saved[k] = x->weight;
+          TreeSetWeight(tree,x,0.0);
+     }
+     /* all ancestors of the nodes drawn were pushed already; the paths */
+     /* are marked and recomputed together (as in RBTreeEndBatch) */
+     for(i=0;i<k;i++) {
+          nodes[i]->weight = saved[i];
+          TreeSumsMark(tree,nodes[i]);
+     }
+     if(k) RB_EPOCH_BUMP(tree);
+     TreeSumsFlush(tree);
+     free(saved);
+     return k;
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBQuantileTrack */
+/**/
+/*    INPUTS:  tree is the tree in question, p is the quantile (it is */
+/*             clamped to [0,1], e.g. 0.5 for the weighted median) */
+/**/
+/*    OUTPUT:  a new finger, which stays valid until RBQuantileUntrack */
+/*             or RBTreeDestroy */
+/**/
+/*    EFFECT:  Finds the node where the cumulative sum crosses p times */
+/*             the total (as RBWeightSelect), and registers the finger in */
+/*             the tree: after each insert, delete or weight update, the */
+/*             sum before the node is corrected by the weight of the node */
+/*             changed (if it is before the finger), and the finger is */
+/*             moved by TreeSuccessor / TreePredecessor steps to the node */
+/*             crossing the new target. RBQuantileGet then reads it in */
+/*             O(1). A change of weight w moves the finger by at most the */
+/*             nodes within a weight of about w from it, so a few steps */
+/*             if the weights are similar; each update costs one */
+/*             comparison per finger more (and finding the relative */
+/*             order of the nodes, O(log(n)), for equal keys). After */
+/*             RBTreeSetDistFunc, RBTreeBuildSorted and the range updates */
+/*             (and after every change with RB_RANGE_UPDATE), the fingers */
+/*             are searched again from the root. The sums of the fingers */
+/*             are updated incrementally, so they may differ from the */
+/*             ones computed by GetNodeRank by rounding errors; if the */
+/*             crossing falls on zero weight nodes (or exactly on the */
+/*             total), the finger can be on a different one of these */
+/*             nodes than the one RBWeightSelect returns. */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+rb_quantile_finger* RBQuantileTrack(rb_red_blk_tree* tree, double p) {
+     rb_quantile_finger* f = (rb_quantile_finger*)SafeMalloc(sizeof(rb_quantile_finger));
+     if(!(p >= 0.0)) p = 0.0; /* also for NaN */
+     if(p > 1.0) p = 1.0;
+     f->p = p;
+     TreeFingerSelect(tree,f);
+     f->next = tree->fingers;
+     tree->fingers = f;
+     return f;
+}
+
+void RBQuantileUntrack(rb_red_blk_tree* tree, rb_quantile_finger* f) {
+     rb_quantile_finger** q;
+     for(q = &(tree->fingers); *q; q = &((*q)->next)) if(*q == f) {
+          *q = f->next;
+          free(f);
+          return;
+     }
+}
+
+/***********************************************************************
+ * the node of the finger (nil for an empty tree) and the sum of the
+ * weights before it (if before is not 0), the same as RBWeightSelect
+ * with p times the total (up to rounding), in O(1)
+ ***********************************************************************/
+rb_red_blk_node* RBQuantileGet(const rb_red_blk_tree* tree, const rb_quantile_finger* f, double* before) {
+     if(before) *before = f->before * tree->scale;
+     return f->node;
+}
+
 
 /***********************************************************************/
 /*  FUNCTION:  TreeSuccessor  */
@@ -544,7 +1899,7 @@ void TreeDestHelper(rb_red_blk_tree* tree, rb_red_blk_node* x) {
     TreeDestHelper(tree,x->right);
     tree->DestroyKey(x->key);
     tree->DestroyInfo(x->info);
-    free(x);
+    TreeFreeNode(tree,x);
   }
 }
 
@@ -563,7 +1918,14 @@ void TreeDestHelper(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 /***********************************************************************/
 
 void RBTreeDestroy(rb_red_blk_tree* tree) {
+  if(tree->compact) {
+    free(tree->compact);
+    tree->compact = 0;
+  }
+  while(tree->fingers) RBQuantileUntrack(tree,tree->fingers);
   TreeDestHelper(tree,tree->root->left);
+  while(tree->arenas) TreeArenaFree(tree,tree->arenas); /* only empty ones are left */
+  TreeSlabsFree(tree);
   free(tree->root);
   free(tree->nil);
   free(tree);
@@ -589,53 +1951,971 @@ void RBTreePrint(rb_red_blk_tree* tree) {
 }
 
 
+/***********************************************************************
+ * recursive helper for RBTreeShape: adds the size and the sum of the
+ * depths of the nodes in the subtree of x to shape, and returns the
+ * height of the subtree
+ ***********************************************************************/
+static unsigned int TreeShapeHelper(const rb_red_blk_tree* tree, const rb_red_blk_node* x,
+          unsigned int depth, rb_tree_shape* shape) {
+     unsigned int hl,hr;
+     if(x == tree->nil) return 0;
+     shape->nodes++;
+     shape->avgDepth += (double)depth;
+     hl = TreeShapeHelper(tree,x->left,depth+1,shape);
+     hr = TreeShapeHelper(tree,x->right,depth+1,shape);
+     return 1 + (hl > hr ? hl : hr);
+}
+
 /***********************************************************************/
-/*  FUNCTION:  RBExactQuery */
+/*  FUNCTION:  RBTreeShape */
 /**/
-/*    INPUTS:  tree is the tree to print and q is a pointer to the key */
-/*             we are searching for */
+/*    INPUTS:  tree is the tree in question, shape is where the result */
+/*             is stored */
 /**/
-/*    OUTPUT:  returns the a node with key equal to q.  If there are */
-/*             multiple nodes with key equal to q this function returns */
-/*             the one highest in the tree */
+/*    OUTPUT:  none */
 /**/
-/*    Modifies Input: none */
+/*    EFFECT:  Computes the number of nodes, the height, the black height */
+/*             and the average node depth of the tree by visiting every */
+/*             node (complexity: O(n)). */
 /**/
+/*    Modifies Input: shape */
 /***********************************************************************/
-  
-rb_red_blk_node* RBExactQuery(const rb_red_blk_tree* tree, const void* q) {
-  rb_red_blk_node* x=tree->root->left;
-  rb_red_blk_node* nil=tree->nil;
-  int compVal;
-  if (x == nil) return(0);
-  compVal=tree->Compare(x->key,/*(int*)*/ q);
-  while(0 != compVal) {/*assignemnt*/
-    if (1 == compVal) { /* x->key > q */
-      x=x->left;
-    } else {
-      x=x->right;
-    }
-    if ( x == nil) return(0);
-    compVal=tree->Compare(x->key,/*(int*)*/ q);
-  }
-  return(x);
+
+void RBTreeShape(const rb_red_blk_tree* tree, rb_tree_shape* shape) {
+     const rb_red_blk_node* x;
+     shape->nodes = 0;
+     shape->blackHeight = 0;
+     shape->avgDepth = 0.0;
+     shape->height = TreeShapeHelper(tree,tree->root->left,0,shape);
+     if(shape->nodes) shape->avgDepth /= (double)(shape->nodes);
+     /* all paths have the same number of black nodes, use the leftmost one */
+     for(x = tree->root->left; x != tree->nil; x = x->left)
+          if(!x->red) shape->blackHeight++;
+}
+
+
+/***********************************************************************
+ * recompute the children sums in the subtree of x after the distribution
+ * function was changed (post-order); bh is the black height of x (number
+ * of black nodes from x to the leaves, including x), and threads is the
+ * number of threads that can be used for this subtree: the left subtree
+ * is given to a new thread if there is more than one thread available
+ * and the subtree is large enough
+ * returns the number of nodes in the subtree
+ ***********************************************************************/
+#define RB_PARALLEL_MIN_BH 12 /* subtrees with at least 2^12-1 nodes */
+
+typedef struct rb_sum_job {
+     const rb_red_blk_tree* tree;
+     rb_red_blk_node* x;
+     unsigned int bh;
+     unsigned int threads;
+     size_t count;
+} rb_sum_job;
+
+static size_t TreeRecomputeSums(const rb_red_blk_tree* tree, rb_red_blk_node* x,
+          unsigned int bh, unsigned int threads);
+
+/* new weight and sum of x, after its children were done; pending range */
+/* updates are dropped, since all weights are recomputed */
+static inline void TreeRecomputeNode(const rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     x->weight = tree->DistFunc(x->key,tree->dfparam);
+     x->children = x->left->children + x->right->children + x->weight;
+#ifdef RB_RANGE_UPDATE
+     x->tagMul = 1.0;
+     x->tagAdd = 0.0;
+#endif
+}
+
+#ifndef RB_NO_THREADS
+static void* TreeRecomputeThread(void* arg) {
+     rb_sum_job* job = (rb_sum_job*)arg;
+     job->count = TreeRecomputeSums(job->tree,job->x,job->bh,job->threads);
+     return 0;
 }
+#endif
 
+static size_t TreeRecomputeSums(const rb_red_blk_tree* tree, rb_red_blk_node* x,
+          unsigned int bh, unsigned int threads) {
+     size_t count = 1;
+     unsigned int cbh;
+     if(x == tree->nil) return 0;
+     cbh = (x->red || bh == 0) ? bh : bh - 1; /* black height of the children */
+#ifndef RB_NO_THREADS
+     if(threads > 1 && bh >= RB_PARALLEL_MIN_BH) {
+          pthread_t thread;
+          rb_sum_job job;
+          job.tree = tree;
+          job.x = x->left;
+          job.bh = cbh;
+          job.threads = threads/2;
+          job.count = 0;
+          if(pthread_create(&thread,0,TreeRecomputeThread,&job) == 0) {
+               count += TreeRecomputeSums(tree,x->right,cbh,threads - threads/2);
+               pthread_join(thread,0);
+               count += job.count;
+               TreeRecomputeNode(tree,x);
+               return count;
+          }
+          /* could not create a thread, continue in this one */
+     }
+#endif
+     count += TreeRecomputeSums(tree,x->left,cbh,threads);
+     count += TreeRecomputeSums(tree,x->right,cbh,threads);
+     TreeRecomputeNode(tree,x);
+     return count;
+}
 
 /***********************************************************************/
-/*  FUNCTION:  RBDeleteFixUp */
+/*  FUNCTION:  RBTreeSetDistFunc */
 /**/
-/*    INPUTS:  tree is the tree to fix and x is the child of the spliced */
-/*             out node in RBTreeDelete. */
+/*    INPUTS:  tree is the tree in question, DistFunc and dfparam are the */
+/*             new distribution function and its parameter (as in */
+/*             RBTreeCreate) */
 /**/
 /*    OUTPUT:  none */
 /**/
-/*    EFFECT:  Performs rotations and changes colors to restore red-black */
-/*             properties after a node is deleted */
-/**/
-/*    Modifies Input: tree, x */
+/*    EFFECT:  Replaces the distribution function of the tree, and */
+/*             recomputes the children sums of all nodes in one post-order */
+/*             pass (complexity: O(n)). Large subtrees are processed in */
+/*             parallel, using at most as many threads as there are */
+/*             processors online (unless compiled with RB_NO_THREADS). */
+/*             DistFunc has to be safe to call from multiple threads. */
+/*             The weights of all nodes are set to the new DistFunc */
+/*             values, so a decay done before by RBTreeDecay (and the */
+/*             changes by RBRangeMultiply and RBRangeAdd) are lost. */
 /**/
-/*    The algorithm from this function is from _Introduction_To_Algorithms_ */
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+void RBTreeSetDistFunc(rb_red_blk_tree* tree, double (*DistFunc)(const void*, const void*),
+          void* dfparam) {
+     rb_red_blk_node* x;
+     unsigned int bh = 0;
+     unsigned int threads = 1;
+     size_t count;
+     
+     tree->DistFunc = DistFunc;
+     tree->dfparam = dfparam;
+     tree->scale = 1.0;
+     TreeDirtyAll(tree);
+     RB_EPOCH_BUMP(tree);
+     for(x = tree->root->left; x != tree->nil; x = x->left) if(!x->red) bh++;
+#ifndef RB_NO_THREADS
+     {
+          long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+          if(ncpu > 1) threads = (unsigned int)ncpu;
+     }
+#endif
+     count = TreeRecomputeSums(tree,tree->root->left,bh,threads);
+     RB_STAT_ADD(tree,distFunc,count);
+     (void)count;
+     TreeFingersSelect(tree);
+}
+
+
+/***********************************************************************
+ * the weights are renormalized by RBTreeDecay if the scale gets outside
+ * of this range, so that the stored values can neither overflow nor
+ * underflow (a new node has weight DistFunc(key) / scale)
+ ***********************************************************************/
+#define RB_SCALE_MIN 1e-60
+#define RB_SCALE_MAX 1e60
+
+static void TreeRescale(rb_red_blk_node* x, const rb_red_blk_node* nil, double s) {
+     while(x != nil) {
+          x->weight *= s;
+          x->children *= s;
+#ifdef RB_RANGE_UPDATE
+          x->tagAdd *= s;
+#endif
+          TreeRescale(x->left,nil,s);
+          x = x->right;
+     }
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeDecay */
+/**/
+/*    INPUTS:  tree is the tree in question, factor > 0 is the multiplier */
+/*             (e.g. exp(-lambda*dt) for an exponential decay over dt) */
+/**/
+/*    OUTPUT:  none */
+/**/
+/*    EFFECT:  Multiplies the weight of all nodes by factor in O(1): the */
+/*             weights and sums are stored relative to tree->scale, so */
+/*             only the scale changes. Nodes inserted later get the */
+/*             weight DistFunc(key) / scale, i.e. they are not decayed. */
+/*             The rank functions and RBTreeTotal multiply the sums by */
+/*             the scale. If the scale gets too small or too large, all */
+/*             weights and sums are multiplied by it, and it is reset to */
+/*             1 (O(n), but this happens only after the weights changed */
+/*             by a factor of RB_SCALE_MAX). */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+void RBTreeDecay(rb_red_blk_tree* tree, double factor) {
+     tree->scale *= factor;
+     if(factor != 1.0) {
+          TreeDirtyAll(tree);
+          RB_EPOCH_BUMP(tree);
+     }
+     if(!(tree->scale >= RB_SCALE_MIN && tree->scale <= RB_SCALE_MAX)) {
+          rb_quantile_finger* f;
+          TreeRescale(tree->root->left,tree->nil,tree->scale);
+          for(f = tree->fingers; f; f = f->next) f->before *= tree->scale;
+          tree->scale = 1.0;
+     }
+}
+
+/***********************************************************************
+ * sum of the weights of all nodes
+ ***********************************************************************/
+double RBTreeTotal(const rb_red_blk_tree* tree) {
+     return tree->root->left->children * tree->scale;
+}
+
+
+#ifdef RB_TRACK_CHANGES
+/***********************************************************************
+ * state of RBTreeExportChanges: the unchanged nodes are collected in
+ * runs, a run is reported when a changed node (or the end) is reached;
+ * the last node of a run is found only then, if the run ends with an
+ * unchanged subtree (its maximum)
+ ***********************************************************************/
+typedef struct rb_export_state {
+     rb_red_blk_tree* tree;
+     void (*Changed)(const rb_red_blk_node* x, double before, double weight, void* arg);
+     void (*Unchanged)(const rb_red_blk_node* first, const rb_red_blk_node* last,
+          double before, double shift, void* arg);
+     void* arg;
+     int all; /* report all nodes as changed */
+     double before; /* sum of the weights before the current node */
+     double shift; /* sum of the changes before the current node */
+     const rb_red_blk_node* first; /* first node of the current run, or 0 */
+     const rb_red_blk_node* last; /* the last node or subtree added to the run */
+     int lastSubtree; /* if last is the root of a subtree */
+     double runBefore; /* the sum of the weights before first */
+     size_t visited;
+} rb_export_state;
+
+static void TreeExportRunEnd(rb_export_state* st) {
+     const rb_red_blk_node* last = st->last;
+     if(st->first == 0) return;
+     if(st->lastSubtree) while(last->right != st->tree->nil) last = last->right;
+     st->Unchanged(st->first,last,st->runBefore,st->shift,st->arg);
+     st->first = 0;
+}
+
+static void TreeExportRunAdd(rb_export_state* st, const rb_red_blk_node* x, int subtree) {
+     if(st->first == 0) {
+          const rb_red_blk_node* first = x;
+          if(subtree) while(first->left != st->tree->nil) first = first->left;
+          st->first = first;
+          st->runBefore = st->before;
+     }
+     st->last = x;
+     st->lastSubtree = subtree;
+}
+
+static void TreeExportWalk(rb_export_state* st, rb_red_blk_node* x, double mul, double add) {
+     double scale = st->tree->scale;
+     double w;
+     if(x == st->tree->nil) return;
+     if(!st->all && !(x->dirty & RB_DIRTY_PATH)) {
+          TreeExportRunAdd(st,x,1);
+          st->before += TreeTagSum(x,mul,add) * scale;
+          return;
+     }
+     w = TreeTagWeight(x,mul,add) * scale;
+     TreeTagDown(x,&mul,&add);
+     TreeExportWalk(st,x->left,mul,add);
+     if(st->all || (x->dirty & RB_DIRTY_NODE)) {
+          TreeExportRunEnd(st);
+          st->Changed(x,st->before,w,st->arg);
+          st->shift += x->dirtyDelta * scale;
+     }
+     else TreeExportRunAdd(st,x,0);
+     st->before += w;
+     x->dirty = 0;
+     x->dirtyDelta = 0.0;
+     st->visited++;
+     TreeExportWalk(st,x->right,mul,add);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeExportChanges */
+/**/
+/*    INPUTS:  tree is the tree in question, Changed and Unchanged are */
+/*             called with arg as their last argument (see below) */
+/**/
+/*    OUTPUT:  the number of nodes visited */
+/**/
+/*    EFFECT:  Reports the difference from the state of the tree at the */
+/*             previous call (or from an empty tree at the first call), */
+/*             in key order: Changed(x,before,weight) for each node which */
+/*             was inserted, or whose weight changed (by RBUpdateWeight */
+/*             or RBUpsert), or which follows a deleted node, with the */
+/*             sum of the weights before it (as GetNodeRank) and its */
+/*             weight; Unchanged(first,last,before,shift) for each run of */
+/*             other nodes between them, from first to last (inclusive), */
+/*             where before is the sum of the weights before first, and */
+/*             shift is the change of this sum since the previous call */
+/*             (the same for all nodes in the run). Nodes which were in */
+/*             the tree at the previous call, but are not in a run or */
+/*             reported by Changed now, were deleted. */
+/*             Only the subtrees which contain changes are visited: */
+/*             after k changes, the complexity is O(k log(n)) instead of */
+/*             O(n). After RBTreeDecay, RBTreeSetDistFunc, RBRangeMultiply */
+/*             or RBRangeAdd, all nodes are reported by Changed. */
+/*             The nodes are marked as unchanged afterwards. */
+/*             Only with RB_TRACK_CHANGES. */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+size_t RBTreeExportChanges(rb_red_blk_tree* tree,
+          void (*Changed)(const rb_red_blk_node* x, double before, double weight, void* arg),
+          void (*Unchanged)(const rb_red_blk_node* first, const rb_red_blk_node* last,
+               double before, double shift, void* arg),
+          void* arg) {
+     rb_export_state st;
+     st.tree = tree;
+     st.Changed = Changed;
+     st.Unchanged = Unchanged;
+     st.arg = arg;
+     st.all = tree->dirtyAll;
+     st.before = 0.0;
+     st.shift = 0.0;
+     st.first = 0;
+     st.last = 0;
+     st.lastSubtree = 0;
+     st.runBefore = 0.0;
+     st.visited = 0;
+     TreeExportWalk(&st,tree->root->left,1.0,0.0);
+     TreeExportRunEnd(&st);
+     tree->dirtyAll = 0;
+     return st.visited;
+}
+#endif
+
+
+#ifdef RB_RANGE_UPDATE
+/***********************************************************************
+ * apply weight*mul + add to the nodes of the subtree of x with keys in
+ * [low,high]; lowIn / highIn are nonzero if all keys in the subtree are
+ * known to be >= low / <= high; the subtrees which are entirely in the
+ * range only get a tag, so that only the nodes on the search paths of
+ * low and high are visited (O(log(n)))
+ ***********************************************************************/
+static void TreeRangeUpdate(rb_red_blk_tree* tree, rb_red_blk_node* x, const void* low,
+          const void* high, int lowIn, int highIn, double mul, double add) {
+     if(x == tree->nil) return;
+     RB_STAT_ADD(tree,sumSteps,1);
+     if(lowIn && highIn) {
+          TreeTagApply(x,mul,add);
+          return;
+     }
+     TreePush(tree,x);
+     if(!lowIn && -1 == TreeCompare(tree,x->key,low)) {
+          /* x and its left subtree are below the range */
+          TreeRangeUpdate(tree,x->right,low,high,0,highIn,mul,add);
+     }
+     else if(!highIn && 1 == TreeCompare(tree,x->key,high)) {
+          /* x and its right subtree are above the range */
+          TreeRangeUpdate(tree,x->left,low,high,lowIn,0,mul,add);
+     }
+     else {
+          x->weight = x->weight*mul + add;
+          TreeRangeUpdate(tree,x->left,low,high,lowIn,1,mul,add);
+          TreeRangeUpdate(tree,x->right,low,high,1,highIn,mul,add);
+     }
+     TreeUpdateSum(tree,x);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBRangeMultiply */
+/**/
+/*    INPUTS:  tree is the tree in question, low <= high are keys (they */
+/*             do not have to be in the tree), factor >= 0 */
+/**/
+/*    OUTPUT:  none */
+/**/
+/*    EFFECT:  Multiplies the weight of all nodes with low <= key <= high */
+/*             by factor, in O(log(n)): the nodes on the paths to low and */
+/*             high are updated, the subtrees between them only store */
+/*             the update (it is pushed down to their children by the */
+/*             rotations and by the insert and delete functions, the */
+/*             rank functions apply it when reading the sums). */
+/*             The weight of a node is then no longer DistFunc(key); */
+/*             RBUpdateWeight and RBTreeSetDistFunc set it back to */
+/*             DistFunc(key). Only with RB_RANGE_UPDATE. */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+void RBRangeMultiply(rb_red_blk_tree* tree, const void* low, const void* high, double factor) {
+     TreeDirtyAll(tree);
+     RB_EPOCH_BUMP(tree);
+     TreeRangeUpdate(tree,tree->root->left,low,high,0,0,factor,0.0);
+     TreeFingersSelect(tree);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBRangeAdd */
+/**/
+/*    INPUTS:  tree is the tree in question, low <= high are keys, delta */
+/*             is the value to add (it should not make any weight */
+/*             negative, otherwise RBWeightSelect gives wrong results) */
+/**/
+/*    OUTPUT:  none */
+/**/
+/*    EFFECT:  Adds delta to the weight of all nodes with low <= key <= */
+/*             high, in O(log(n)), in the same way as RBRangeMultiply */
+/*             (the sum of a subtree changes by delta times the number */
+/*             of nodes in it, which is stored as well). Only with */
+/*             RB_RANGE_UPDATE. */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+void RBRangeAdd(rb_red_blk_tree* tree, const void* low, const void* high, double delta) {
+     TreeDirtyAll(tree);
+     RB_EPOCH_BUMP(tree);
+     /* the stored weights are relative to the scale */
+     TreeRangeUpdate(tree,tree->root->left,low,high,0,0,1.0,delta / tree->scale);
+     TreeFingersSelect(tree);
+}
+#endif
+
+
+#ifdef RB_STATS
+/***********************************************************************
+ * get a snapshot of the counters of a tree and reset them
+ * (RBTreeGetStats followed by RBTreeResetStats gives the counts for
+ * an interval)
+ ***********************************************************************/
+void RBTreeGetStats(const rb_red_blk_tree* tree, rb_tree_stats* stats) {
+     memcpy(stats,&(tree->stats),sizeof(rb_tree_stats));
+}
+
+void RBTreeResetStats(rb_red_blk_tree* tree) {
+     memset(&(tree->stats),0,sizeof(rb_tree_stats));
+}
+#endif
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBExactQuery */
+/**/
+/*    INPUTS:  tree is the tree to print and q is a pointer to the key */
+/*             we are searching for */
+/**/
+/*    OUTPUT:  returns the a node with key equal to q.  If there are */
+/*             multiple nodes with key equal to q this function returns */
+/*             the one highest in the tree */
+/**/
+/*    Modifies Input: none (also with the treap engine, see */
+/*             RBTreeAccess), so it can run concurrently with other */
+/*             queries */
+/**/
+/***********************************************************************/
+  
+rb_red_blk_node* RBExactQuery(const rb_red_blk_tree* tree, const void* q) {
+  rb_red_blk_node* x=tree->root->left;
+  rb_red_blk_node* nil=tree->nil;
+  int compVal;
+  if (x == nil) return(0);
+  compVal=TreeCompare(tree,x->key,/*(int*)*/ q);
+  while(0 != compVal) {/*assignemnt*/
+    if (1 == compVal) { /* x->key > q */
+      x=x->left;
+    } else {
+      x=x->right;
+    }
+    if ( x == nil) return(0);
+    compVal=TreeCompare(tree,x->key,/*(int*)*/ q);
+  }
+  return(x);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeAccess */
+/**/
+/*    INPUTS:  tree is the tree to search and q is a pointer to the key */
+/*             we are searching for */
+/**/
+/*    OUTPUT:  the same node as RBExactQuery, or 0 */
+/**/
+/*    EFFECT:  With the treap engine, the access can increase the */
+/*             priority of the node found, which is then rotated up, so */
+/*             that frequently accessed keys move close to the root. */
+/*             With the red-black tree, this is the same as */
+/*             RBExactQuery. */
+/**/
+/*    Modifies Input: tree (with the treap engine), so it should not be */
+/*             called concurrently with any other function */
+/***********************************************************************/
+
+rb_red_blk_node* RBTreeAccess(rb_red_blk_tree* tree, const void* q) {
+  rb_red_blk_node* x = RBExactQuery(tree,q);
+  if (x && tree->engine == RB_ENGINE_TREAP) TreapAccess(tree,x);
+  return(x);
+}
+
+
+/***********************************************************************
+ * recursive helper for RBSortedRank: the queries lo, ..., hi-1 all fall
+ * into the subtree of x, and offset is the sum for the nodes before this
+ * subtree (mul and add are the pending range updates above x); the
+ * queries are split by the key of x with a binary search, the left part
+ * is handled recursively, the right part in the loop
+ ***********************************************************************/
+static void TreeSortedRank(const rb_red_blk_tree* tree, const rb_red_blk_node* x,
+          void* const* keys, size_t lo, size_t hi, double offset, double mul, double add,
+          double* out) {
+     const rb_red_blk_node* nil = tree->nil;
+     while(lo < hi) {
+          size_t a = lo;
+          size_t b = hi;
+          double own;
+          if(x == nil) {
+               for(;lo<hi;lo++) out[lo] = offset;
+               return;
+          }
+          while(a < b) { /* first query with key > x.key */
+               size_t mid = a + (b-a)/2;
+               if(-1 == TreeCompare(tree,x->key,keys[mid])) b = mid;
+               else a = mid + 1;
+          }
+          own = TreeTagWeight(x,mul,add);
+          TreeTagDown(x,&mul,&add);
+          if(a > lo) TreeSortedRank(tree,x->left,keys,lo,a,offset,mul,add,out);
+          if(a < hi) offset += TreeTagSum(x->left,mul,add) + own;
+          lo = a;
+          x = x->right;
+     }
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBSortedRank */
+/**/
+/*    INPUTS:  tree is the tree in question, keys is an array of m query */
+/*             keys sorted in increasing order (according to Compare), */
+/*             out is an array of size m for the results */
+/**/
+/*    OUTPUT:  none */
+/**/
+/*    EFFECT:  For each query key, computes the sum of DistFunc over the */
+/*             nodes with key strictly smaller than it (this is the same */
+/*             as GetNodeRank for the first node with an equal key). */
+/*             The queries are processed together, by recursively */
+/*             splitting the query array at the keys of the nodes, so */
+/*             the upper levels of the tree are visited only once; the */
+/*             number of nodes visited is O(m log(n/m + 1)). */
+/**/
+/*    Modifies Input: out */
+/***********************************************************************/
+
+void RBSortedRank(const rb_red_blk_tree* tree, void* const* keys, size_t m, double* out) {
+     size_t i;
+     TreeSortedRank(tree,tree->root->left,keys,0,m,0.0,1.0,0.0,out);
+     if(tree->scale != 1.0) for(i=0;i<m;i++) out[i] *= tree->scale;
+}
+
+
+/***********************************************************************
+ * interleaved searches for RBBatchQuery and RBBatchRank: RB_BATCH_GROUP
+ * searches advance together, one level at a time in round-robin order,
+ * and the node needed by each search in its next step is prefetched, so
+ * that the cache misses of the independent searches overlap; when a
+ * search finishes, its slot continues with the next query
+ * for the ranks, the left child of a node where a search turns right is
+ * also prefetched, and its sum is only read in the next round
+ ***********************************************************************/
+#define RB_BATCH_GROUP 16
+#if defined(__GNUC__)
+#define RB_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define RB_PREFETCH(p) ((void)0)
+#endif
+
+typedef struct rb_batch_search {
+     const rb_red_blk_node* x; /* next node to visit, 0 if the slot is idle */
+     const rb_red_blk_node* pending; /* node whose sum should be added to acc */
+     double acc;
+     double mul, add; /* pending range updates above x */
+     size_t i; /* index of the query */
+} rb_batch_search;
+
+static void TreeBatchSearch(const rb_red_blk_tree* tree, void* const* keys, size_t m,
+          rb_red_blk_node** nodes, double* ranks) {
+     const rb_red_blk_node* nil = tree->nil;
+     const rb_red_blk_node* start = tree->root->left;
+     rb_batch_search st[RB_BATCH_GROUP];
+     size_t next = 0;
+     unsigned int active = 0;
+     unsigned int j;
+     
+     RB_PREFETCH(start);
+     for(j=0;j<RB_BATCH_GROUP;j++) {
+          st[j].pending = nil;
+          st[j].acc = 0.0;
+          st[j].mul = 1.0;
+          st[j].add = 0.0;
+          if(next < m) {
+               st[j].x = start;
+               st[j].i = next++;
+               active++;
+          }
+          else st[j].x = 0;
+     }
+     
+     while(active) for(j=0;j<RB_BATCH_GROUP;j++) {
+          rb_batch_search* b = st + j;
+          const rb_red_blk_node* x = b->x;
+          int done = 0;
+          if(!x) continue;
+          if(ranks) {
+               b->acc += TreeTagSum(b->pending,b->mul,b->add);
+               b->pending = nil;
+          }
+          if(x == nil) {
+               done = 1;
+               if(nodes) nodes[b->i] = 0;
+          }
+          else {
+               int cmp = TreeCompare(tree,x->key,keys[b->i]);
+               if(nodes) {
+                    if(cmp == 0) {
+                         nodes[b->i] = (rb_red_blk_node*)x;
+                         done = 1;
+                    }
+                    else x = (cmp == 1) ? x->left : x->right;
+               }
+               else {
+                    double own = TreeTagWeight(x,b->mul,b->add);
+                    TreeTagDown(x,&(b->mul),&(b->add));
+                    if(cmp == -1) { /* x.key < key, x and its left subtree are counted */
+                         b->pending = x->left;
+                         RB_PREFETCH(b->pending);
+                         b->acc += own;
+                         x = x->right;
+                    }
+                    else x = x->left;
+               }
+               RB_PREFETCH(x);
+          }
+          if(done) {
+               if(ranks) ranks[b->i] = b->acc;
+               if(next < m) { /* start the next query in this slot */
+                    x = start;
+                    b->i = next++;
+                    b->acc = 0.0;
+                    b->mul = 1.0;
+                    b->add = 0.0;
+               }
+               else {
+                    x = 0;
+                    active--;
+               }
+          }
+          b->x = x;
+     }
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBBatchQuery */
+/**/
+/*    INPUTS:  tree is the tree in question, keys is an array of m query */
+/*             keys (in any order), nodes is an array of size m for the */
+/*             results */
+/**/
+/*    OUTPUT:  none */
+/**/
+/*    EFFECT:  Stores in nodes[i] the same node as RBExactQuery(keys[i]) */
+/*             (or 0 if there is no such node), but runs several searches */
+/*             interleaved with prefetching, which is faster for trees */
+/*             much larger than the cache. The tree is not modified (with */
+/*             the treap engine, the priorities are not changed). */
+/**/
+/*    Modifies Input: nodes */
+/***********************************************************************/
+
+void RBBatchQuery(const rb_red_blk_tree* tree, void* const* keys, size_t m, rb_red_blk_node** nodes) {
+     TreeBatchSearch(tree,keys,m,nodes,0);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBBatchRank */
+/**/
+/*    INPUTS:  tree is the tree in question, keys is an array of m query */
+/*             keys (in any order), out is an array of size m for the */
+/*             results */
+/**/
+/*    OUTPUT:  none */
+/**/
+/*    EFFECT:  For each query key, computes the sum of DistFunc over the */
+/*             nodes with key strictly smaller than it (as RBSortedRank), */
+/*             running several searches interleaved with prefetching. */
+/**/
+/*    Modifies Input: out */
+/***********************************************************************/
+
+void RBBatchRank(const rb_red_blk_tree* tree, void* const* keys, size_t m, double* out) {
+     size_t i;
+     TreeBatchSearch(tree,keys,m,0,out);
+     if(tree->scale != 1.0) for(i=0;i<m;i++) out[i] *= tree->scale;
+}
+
+
+/***********************************************************************
+ * in-order iteration with an explicit stack, which also keeps the
+ * composed range updates above each node (so that the weights are
+ * correct with RB_RANGE_UPDATE as well); TreeIterNext returns the next
+ * node and its weight (multiplied by the scale), or 0 at the end
+ ***********************************************************************/
+typedef struct rb_iter_entry {
+     const rb_red_blk_node* x;
+     double mul, add; /* pending range updates above x */
+} rb_iter_entry;
+
+typedef struct rb_tree_iter {
+     const rb_red_blk_tree* tree;
+     rb_iter_entry* stack;
+     size_t n;
+     size_t size;
+} rb_tree_iter;
+
+static void TreeIterPushLeft(rb_tree_iter* it, const rb_red_blk_node* x, double mul, double add) {
+     while(x != it->tree->nil) {
+          if(it->n == it->size) {
+               rb_iter_entry* s = (rb_iter_entry*)SafeMalloc(sizeof(rb_iter_entry)*2*it->size);
+               memcpy(s,it->stack,sizeof(rb_iter_entry)*it->n);
+               free(it->stack);
+               it->stack = s;
+               it->size *= 2;
+          }
+          it->stack[it->n].x = x;
+          it->stack[it->n].mul = mul;
+          it->stack[it->n].add = add;
+          it->n++;
+          TreeTagDown(x,&mul,&add);
+          x = x->left;
+     }
+}
+
+static void TreeIterInit(rb_tree_iter* it, const rb_red_blk_tree* tree) {
+     it->tree = tree;
+     it->size = 64;
+     it->n = 0;
+     it->stack = (rb_iter_entry*)SafeMalloc(sizeof(rb_iter_entry)*it->size);
+     TreeIterPushLeft(it,tree->root->left,1.0,0.0);
+}
+
+static const rb_red_blk_node* TreeIterNext(rb_tree_iter* it, double* weight) {
+     const rb_red_blk_node* x;
+     double mul, add;
+     if(it->n == 0) return 0;
+     it->n--;
+     x = it->stack[it->n].x;
+     mul = it->stack[it->n].mul;
+     add = it->stack[it->n].add;
+     *weight = TreeTagWeight(x,mul,add) * it->tree->scale;
+     TreeTagDown(x,&mul,&add);
+     TreeIterPushLeft(it,x->right,mul,add);
+     return x;
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeKSDistance */
+/**/
+/*    INPUTS:  a and b are two trees with keys that can be compared with */
+/*             each other (by the Compare function of a) */
+/**/
+/*    OUTPUT:  the two-sample Kolmogorov-Smirnov statistic: the maximum */
+/*             of |CDF_a(t) - CDF_b(t)| over all t, where CDF_a(t) is the */
+/*             sum of the weights of the nodes of a with key <= t, divided */
+/*             by the total weight of a; 0 if one of the totals is 0 */
+/**/
+/*    EFFECT:  Walks the nodes of both trees in order together, as in a */
+/*             merge, checking the difference after each group of equal */
+/*             keys (complexity: O(n_a + n_b)). */
+/**/
+/*    Modifies Input: none */
+/***********************************************************************/
+
+double RBTreeKSDistance(const rb_red_blk_tree* a, const rb_red_blk_tree* b) {
+     double totalA = RBTreeTotal(a);
+     double totalB = RBTreeTotal(b);
+     double sumA = 0.0, sumB = 0.0, wa = 0.0, wb = 0.0;
+     double res = 0.0;
+     rb_tree_iter ia, ib;
+     const rb_red_blk_node* xa;
+     const rb_red_blk_node* xb;
+     
+     if(totalA <= 0.0 || totalB <= 0.0) return 0.0;
+     TreeIterInit(&ia,a);
+     TreeIterInit(&ib,b);
+     xa = TreeIterNext(&ia,&wa);
+     xb = TreeIterNext(&ib,&wb);
+     while(xa || xb) {
+          const void* key; /* the next key in either tree */
+          double d;
+          if(xa == 0) key = xb->key;
+          else if(xb == 0) key = xa->key;
+          else key = (1 == TreeCompare(a,xa->key,xb->key)) ? xb->key : xa->key;
+          while(xa && 0 == TreeCompare(a,xa->key,key)) {
+               sumA += wa;
+               xa = TreeIterNext(&ia,&wa);
+          }
+          while(xb && 0 == TreeCompare(a,xb->key,key)) {
+               sumB += wb;
+               xb = TreeIterNext(&ib,&wb);
+          }
+          d = fabs(sumA/totalA - sumB/totalB);
+          if(d > res) res = d;
+     }
+     free(ia.stack);
+     free(ib.stack);
+     return res;
+}
+
+
+/***********************************************************************
+ * sum of the weights of the nodes with key < q (le == 0) or key <= q
+ * (le != 0), multiplied by the scale; keys equal to q can be on both
+ * sides of a node, so the equal ones are not followed
+ ***********************************************************************/
+static double TreeRankBound(const rb_red_blk_tree* tree, const void* q, int le) {
+     const rb_red_blk_node* nil = tree->nil;
+     const rb_red_blk_node* x = tree->root->left;
+     double mul = 1.0, add = 0.0;
+     double sum = 0.0;
+     while(x != nil) {
+          int cmp = TreeCompare(tree,x->key,q);
+          double own = TreeTagWeight(x,mul,add);
+          TreeTagDown(x,&mul,&add);
+          if(cmp == -1 || (le && cmp == 0)) {
+               sum += TreeTagSum(x->left,mul,add) + own;
+               x = x->right;
+          }
+          else x = x->left;
+     }
+     return sum * tree->scale;
+}
+
+/***********************************************************************
+ * helper for RBTreeKSDistanceApprox: the nodes of the subtree of x in a
+ * have keys between two keys lo and hi (the bounds given by the
+ * ancestors), before is the weight in a before the subtree, and bLo and
+ * bHi are the weights in b with key < lo and key <= hi (or 0 and the
+ * total without a bound); all CDFs within the subtree are between
+ * these, which bounds the difference there
+ ***********************************************************************/
+typedef struct rb_ks_state {
+     const rb_red_blk_tree* a;
+     const rb_red_blk_tree* b;
+     double totalA, totalB;
+     double eps;
+     double res; /* largest difference found */
+} rb_ks_state;
+
+/* the largest possible difference for a subtree with the given sums */
+static inline double TreeKSBound(const rb_ks_state* st, double before, double after,
+          double bLo, double bHi) {
+     double b1 = after/st->totalA - bLo/st->totalB;
+     double b2 = bHi/st->totalB - before/st->totalA;
+     return (b1 > b2) ? b1 : b2;
+}
+
+static void TreeKSDescend(rb_ks_state* st, const rb_red_blk_node* x, double mul, double add,
+          double before, double bLo, double bHi) {
+     const rb_red_blk_tree* a = st->a;
+     double scale = a->scale;
+     double bLt, bLe, d, own, mid, after;
+     
+     if(x == a->nil) return;
+     after = before + TreeTagSum(x,mul,add)*scale;
+     if(TreeKSBound(st,before,after,bLo,bHi) <= st->res + st->eps) return;
+     
+     /* the exact difference right before and at the key of x; keys */
+     /* strictly between the bounds have CDFs within the bounds above, */
+     /* keys equal to a bound were already checked at an ancestor */
+     bLt = TreeRankBound(st->b,x->key,0);
+     bLe = TreeRankBound(st->b,x->key,1);
+     d = fabs(TreeRankBound(a,x->key,0)/st->totalA - bLt/st->totalB);
+     if(d > st->res) st->res = d;
+     d = fabs(TreeRankBound(a,x->key,1)/st->totalA - bLe/st->totalB);
+     if(d > st->res) st->res = d;
+     
+     own = TreeTagWeight(x,mul,add)*scale;
+     TreeTagDown(x,&mul,&add);
+     mid = before + TreeTagSum(x->left,mul,add)*scale; /* before x in the order of the nodes */
+     /* visit the child with the larger bound first */
+     if(TreeKSBound(st,before,mid,bLo,bLe) >= TreeKSBound(st,mid + own,after,bLt,bHi)) {
+          TreeKSDescend(st,x->left,mul,add,before,bLo,bLe);
+          TreeKSDescend(st,x->right,mul,add,mid + own,bLt,bHi);
+     }
+     else {
+          TreeKSDescend(st,x->right,mul,add,mid + own,bLt,bHi);
+          TreeKSDescend(st,x->left,mul,add,before,bLo,bLe);
+     }
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeKSDistanceApprox */
+/**/
+/*    INPUTS:  a and b are two trees (as for RBTreeKSDistance), eps >= 0 */
+/*             is the allowed error */
+/**/
+/*    OUTPUT:  a value d with D - eps <= d <= D, where D is the result */
+/*             of RBTreeKSDistance(a,b) */
+/**/
+/*    EFFECT:  Descends the tree a from the root; for each subtree, the */
+/*             CDF of a is bounded by the sums before and after it, and */
+/*             the CDF of b by rank queries at the keys of the ancestors, */
+/*             and the subtree is skipped if the difference cannot be */
+/*             more than eps above the largest one found so far. At each */
+/*             node visited, the difference is computed exactly right */
+/*             before and at its key (O(log(n_a) + log(n_b))). If the */
+/*             trees are close, or one difference is large, only a small */
+/*             part of a is visited; with eps = 0, the result is exact, */
+/*             but possibly all nodes are visited. */
+/**/
+/*    Modifies Input: none */
+/***********************************************************************/
+
+double RBTreeKSDistanceApprox(const rb_red_blk_tree* a, const rb_red_blk_tree* b, double eps) {
+     rb_ks_state st;
+     st.a = a;
+     st.b = b;
+     st.totalA = RBTreeTotal(a);
+     st.totalB = RBTreeTotal(b);
+     st.eps = eps;
+     st.res = 0.0;
+     if(st.totalA <= 0.0 || st.totalB <= 0.0) return 0.0;
+     TreeKSDescend(&st,a->root->left,1.0,0.0,0.0,0.0,st.totalB);
+     return st.res;
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBDeleteFixUp */
+/**/
+/*    INPUTS:  tree is the tree to fix and x is the child of the spliced */
+/*             out node in RBTreeDelete. */
+/**/
+/*    OUTPUT:  none */
+/**/
+/*    EFFECT:  Performs rotations and changes colors to restore red-black */
+/*             properties after a node is deleted */
+/**/
+/*    Modifies Input: tree, x */
+/**/
+/*    The algorithm from this function is from _Introduction_To_Algorithms_ */
 /***********************************************************************/
 
 void RBDeleteFixUp(rb_red_blk_tree* tree, rb_red_blk_node* x) {
@@ -643,6 +2923,7 @@ void RBDeleteFixUp(rb_red_blk_tree* tree, rb_red_blk_node* x) {
   rb_red_blk_node* w;
 
   while( (!x->red) && (root != x)) {
+    RB_STAT_ADD(tree,deleteFixUp,1);
     if (x == x->parent->left) {
       w=x->parent->right;
       if (w->red) {
@@ -707,6 +2988,69 @@ void RBDeleteFixUp(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 }
 
 
+/***********************************************************************
+ * remove z from the tree, where y is the node to splice out: z itself if
+ * it has at most one child, its successor otherwise (y is then moved
+ * into the place of z, so that pointers to other nodes stay valid);
+ * x, the only child of y, takes the place of y
+ * the sums are updated in one pass upwards from the parent of x: the
+ * nodes below the new place of y lose the weight of y, y is recomputed
+ * from its children, the nodes above it lose the weight of z; then the
+ * red-black properties are restored (the pending range updates on the
+ * path to y should be already pushed down)
+ ***********************************************************************/
+static void TreeSpliceNode(rb_red_blk_tree* tree, rb_red_blk_node* z, rb_red_blk_node* y) {
+  rb_red_blk_node* nil=tree->nil;
+  rb_red_blk_node* root=tree->root;
+  rb_red_blk_node* x = (y->left == nil) ? y->right : y->left;
+  rb_red_blk_node* w;
+  double d = y->weight;
+  int yred = y->red;
+  
+  TreeDirtyDelete(tree,z);
+  TreeFingersDelete(tree,z);
+  x->parent=y->parent; /* also if x is nil, RBDeleteFixUp needs it */
+  if (y == y->parent->left) y->parent->left=x;
+  else y->parent->right=x;
+  w=x->parent;
+  if (y != z) { /* y->left == nil, z has two children */
+    y->left=z->left;
+    y->right=z->right;
+    y->parent=z->parent;
+    y->red=z->red;
+    y->left->parent=y;
+    y->right->parent=y; /* this is x (possibly nil) if y was the child of z */
+    if (z == z->parent->left) z->parent->left=y;
+    else z->parent->right=y;
+    if (w == z) w=y;
+  }
+  TreeDirtyPath(tree,w);
+  if (y != z) TreeDirtyPath(tree,y);
+  if (tree->batch) {
+    /* y has the sum of its old subtree */
+    TreeSumsMark(tree,w);
+    if (y != z) TreeSumsMark(tree,y);
+    w = root;
+  }
+  for(; w != root; w = w->parent) {
+    if (w == y) { /* only if y != z */
+      TreeUpdateSum(tree,y);
+      d = z->weight;
+    } else {
+      w->children -= d;
+      RB_COUNT_ADD(w,-1);
+    }
+    RB_STAT_ADD(tree,sumSteps,1);
+  }
+  if (!yred) RBDeleteFixUp(tree,x);
+  
+  tree->DestroyKey(z->key);
+  tree->DestroyInfo(z->info);
+  TreeFreeNode(tree,z);
+  TreeFingersDone(tree);
+}
+
+
 /***********************************************************************/
 /*  FUNCTION:  RBDelete */
 /**/
@@ -725,131 +3069,637 @@ void RBDeleteFixUp(rb_red_blk_tree* tree, rb_red_blk_node* x) {
 
 void RBDelete(rb_red_blk_tree* tree, rb_red_blk_node* z){
   rb_red_blk_node* y;
-  rb_red_blk_node* x;
   rb_red_blk_node* nil=tree->nil;
-  rb_red_blk_node* root=tree->root;
-  double ydval = 0.0; /* DistFunc(y) */
-  double zdval = 0.0; /* DistFunc(x) */
 
-  /*y= ((z->left == nil) || (z->right == nil)) ? z : TreeSuccessor(tree,z);*/
-  if((z->left == nil) || (z->right == nil)) y = z; /** így átláthatóbb **/
-  else y =  TreeSuccessor(tree,z);
-  /*x= (y->left == nil) ? y->right : y->left;*/
+  if (tree->engine == RB_ENGINE_TREAP) {
+    TreapDelete(tree,z);
+    return;
+  }
+
+  if((z->left == nil) || (z->right == nil)) y = z;
+  else y = TreeSuccessor(tree,z);
+  TreePushPath(tree,y); /* z is on this path as well */
+  TreeSpliceNode(tree,z,y);
   
-  /*********************************
-   * y-t töröljük, x-et betesszük y helyére
-   * y-nak maximum egy gyereke lehet, ez x (lehet x == nil is)
-   * két lehetőség: y == z, ekkor x bármelyik gyerek lehet
-   * y != z, ekkor viszont x == y->right (y->left == nil, ha nem így lenne,
-   *      akkor a Successor keresésnél arra mentünk volna tovább)
-   *********************************/
-  if(y->left == nil) x = y->right; /** így átláthatóbb **/
-  else x = y->left;
+#ifdef DEBUG_ASSERT
+  Assert(!tree->nil->red,"nil not black in RBDelete");
+#endif
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBUpsert */
+/**/
+/*  INPUTS:  tree is the tree in question, key and info are the new */
+/*           data, Merge is the function to call if a node with an equal */
+/*           key is already present (can be 0) */
+/**/
+/*  OUTPUT:  The node found or inserted. */
+/**/
+/*  Modifies Input: tree */
+/**/
+/*  EFFECTS:  Searches for a node with key equal to key; if there is one */
+/*            (x), Merge(x,key,info) is called, which should update x */
+/*            (e.g. the info, or a count stored in the structure pointed */
+/*            to by x->key, without changing its order), and take care */
+/*            of key and info (free them if they are not kept); then the */
+/*            weight of x is recomputed and the change added to the sums */
+/*            above it, as RBUpdateWeight. If Merge is 0, the info of x */
+/*            is replaced (the old info and the new key are destroyed by */
+/*            DestroyInfo and DestroyKey). If there is no such node, a */
+/*            new one is inserted, as RBTreeInsert. Both cases use the */
+/*            place found by the same descent, so this replaces an */
+/*            RBExactQuery followed by RBTreeInsert or RBUpdateWeight. */
+/***********************************************************************/
+
+rb_red_blk_node* RBUpsert(rb_red_blk_tree* tree, void* key, void* info,
+          void (*Merge)(rb_red_blk_node* x, void* key, void* info)) {
+  rb_red_blk_node* nil=tree->nil;
+  rb_red_blk_node* y=tree->root;
+  rb_red_blk_node* x=y->left;
+  rb_red_blk_node* z;
+  int left = 1;
+  int cmp;
   
-  /*
-   * In this case, updating the sums is a bit more complicated
-   * 
-   * First we delete the node y, and recursively
-   * substract its value from the nodes above it
-   * Next we replace y with x. The stored value of
-   * x does not change, its the only child of y.
-   */
+  while (x != nil) {
+    TreePush(tree,x);
+    cmp = TreeCompare(tree,x->key,key);
+    if (cmp == 0) break;
+    y = x;
+    left = (cmp == 1);
+    x = left ? x->left : x->right;
+  }
   
-  /** decrease the computed values of children for each node going upwards from y **/
-  ydval = tree->DistFunc(y->key,tree->dfparam);
-  {
-       rb_red_blk_node* w = y->parent;
-       
-       while(w != root) {
-            w->children -= ydval;
-            w = w->parent;
-       }
+  if (x != nil) {
+    if (Merge) Merge(x,key,info);
+    else {
+      tree->DestroyKey(key);
+      tree->DestroyInfo(x->info);
+      x->info = info;
+    }
+    TreeWeightChanged(tree,x);
+    if (tree->engine == RB_ENGINE_TREAP) TreapAccess(tree,x);
+    return x;
   }
   
-  if (root == (x->parent = y->parent)) { /* assignment of y->p to x->p is intentional */
-    root->left=x;
-    /*
-     * megjegyzés: root nem az "igazi" root node, hanem egy "null" node, aminek a bal gyereke az igazi root,
-     * tehát ebben az esetben y az "igazi" root node
-     */
-  } else {
-    if (y == y->parent->left) {
-      y->parent->left=x;
-    } else {
-      y->parent->right=x;
+  z=TreeAllocNode(tree);
+  z->key=key;
+  z->info=info;
+  z->left=z->right=nil;
+  TreeLinkNode(tree,z,y,left);
+  TreeInsertFixUp(tree,z);
+  return z;
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBDeleteKey */
+/**/
+/*    INPUTS:  tree is the tree to delete from, key is the key to delete */
+/**/
+/*    OUTPUT:  1 if a node with key equal to key was found and deleted, */
+/*             0 otherwise */
+/**/
+/*    EFFECT:  Deletes one node with the given key, as RBExactQuery */
+/*             followed by RBDelete, but in one descent: if the node */
+/*             found has two children, the descent continues to its */
+/*             successor, which is moved into its place. The sums are */
+/*             then updated in one pass upwards (see also */
+/*             RBDeleteTopDown, which does the rebalancing while */
+/*             descending as well). With the treap, the node found is */
+/*             rotated down and removed, as in RBDelete. */
+/*             The key and info of the deleted node are destroyed using */
+/*             DestroyKey and DestroyInfo. */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+int RBDeleteKey(rb_red_blk_tree* tree, const void* key) {
+  rb_red_blk_node* nil=tree->nil;
+  rb_red_blk_node* z=tree->root->left;
+  rb_red_blk_node* y;
+  int cmp;
+  
+  for (;;) {
+    if (z == nil) return 0;
+    TreePush(tree,z);
+    cmp = TreeCompare(tree,z->key,key);
+    if (cmp == 0) break;
+    z = (cmp == 1) ? z->left : z->right;
+  }
+  
+  if (tree->engine == RB_ENGINE_TREAP) {
+    TreapDelete(tree,z);
+    return 1;
+  }
+  y = z;
+  if (z->left != nil && z->right != nil) {
+    for (y = z->right; ; y = y->left) {
+      TreePush(tree,y);
+      if (y->left == nil) break;
     }
   }
-  /*********************************
-   * TODO: 
-   *      x-et betettük y helyére, x->children-t kell frissíteni
-   * két lépésben lehet: először az eredeti x-ből indulva, felfelé haladva minden node
-   * children értékét egyel csökkentjük (ebben benne lesz y is), majd x->children = y->children
-   *********************************/
- /*  if(x != nil) x->children = y->children; //!! we put x in the place of y */
-   
-  if (y != z) { /* y should not be nil in this case */
-     /********************************************
-      * TODO:
-      * ebben az esetben y-t tesszük be z helyére
-      * a children értékeket már csökkentettük (x-ből indulva, z-t is beleértve),
-      * y->children = z->children
-      ********************************************/
-      zdval = tree->DistFunc(z->key,tree->dfparam);
+  TreeSpliceNode(tree,z,y);
+  
 #ifdef DEBUG_ASSERT
-    Assert( (y!=tree->nil),"y is nil in RBDelete\n");
+  Assert(!tree->nil->red,"nil not black in RBDeleteKey");
 #endif
-    /* y is the node to splice out and x is its child */
+  return 1;
+}
+
+/***********************************************************************
+ * single and double rotations for the top-down algorithms below
+ * (in the form used by Julienne Walker's top-down red-black tree
+ * tutorial): x, a child of xp, moves down in the direction dir (0: left,
+ * 1: right), and the new top of the subtree is returned; x becomes red,
+ * the new top becomes black; xp is known from the descent, so the
+ * parent pointers are only written here, not read
+ ***********************************************************************/
+static rb_red_blk_node* TreeSingleRotate(rb_red_blk_tree* tree, rb_red_blk_node* xp, rb_red_blk_node* x, int dir) {
+     rb_red_blk_node* top = dir ? x->left : x->right;
+     if(dir) TreeRightRotate(tree,xp,x);
+     else TreeLeftRotate(tree,xp,x);
+     x->red = 1;
+     top->red = 0;
+     return top;
+}
+
+static rb_red_blk_node* TreeDoubleRotate(rb_red_blk_tree* tree, rb_red_blk_node* xp, rb_red_blk_node* x, int dir) {
+     TreeSingleRotate(tree,x,dir ? x->left : x->right,!dir);
+     return TreeSingleRotate(tree,xp,x,dir);
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBTreeInsertTopDown */
+/**/
+/*  INPUTS:  tree is the red-black tree to insert a node which has a key */
+/*           pointed to by key and info pointed to by info.  */
+/**/
+/*  OUTPUT:  This function returns a pointer to the newly inserted node */
+/*           (as RBTreeInsert). */
+/**/
+/*  Modifies Input: tree */
+/**/
+/*  EFFECTS:  Inserts a new node with the top-down algorithm: color flips */
+/*            and rotations are done while descending from the root, and */
+/*            DistFunc(key) is added to the sum of each node when the */
+/*            descent reaches it, so there is no second pass upwards */
+/*            (neither for the sums, nor for the rebalancing). */
+/*            The sums are kept consistent by the following rule: the */
+/*            nodes already visited on the search path include the new */
+/*            weight, the rest of the nodes do not; rotations recompute */
+/*            the sums from the children, so only the current node has */
+/*            to be corrected after a double rotation which moves it up. */
+/*            The grandparent and its parent, needed by the rotations, */
+/*            are carried along the descent, so the parent pointers are */
+/*            only written (they are kept for TreeSuccessor, GetNodeRank */
+/*            and the node handles), not read. */
+/***********************************************************************/
 
-     /***************
-      * probléma (?): itt egy "félkész" fára futtatjuk a FixUp-ot
-      * mégsem probléma: y-t már teljesen kivágtuk, x van a helyén, és a children értékek is stimmelnek
-      ***************/
-    if (!(y->red)) RBDeleteFixUp(tree,x);
+rb_red_blk_node * RBTreeInsertTopDown(rb_red_blk_tree* tree, void* key, void* info) {
+  rb_red_blk_node* nil=tree->nil;
+  rb_red_blk_node* root=tree->root;
+  rb_red_blk_node* z;
+  rb_red_blk_node* t = nil; /* parent of g */
+  rb_red_blk_node* g = nil; /* parent of p */
+  rb_red_blk_node* p = root; /* parent of q */
+  rb_red_blk_node* q = root->left; /* current node */
+  int dir = 0; /* direction taken from p to reach q */
+  int last = 0; /* direction taken one level above */
+  double w;
+
+  /* the top-down algorithm is specific to red-black trees */
+  if(tree->engine != RB_ENGINE_RB) return RBTreeInsert(tree,key,info);
+
+  z=TreeAllocNode(tree);
+  z->key=key;
+  z->info=info;
+  z->left=z->right=nil;
+  z->children = z->weight = w = TreeNewWeight(tree,key);
+#ifdef RB_RANGE_UPDATE
+  z->count = 1;
+  z->tagMul = 1.0;
+  z->tagAdd = 0.0;
+#endif
+  TreeDirtyInit(z);
+  RB_EPOCH_INIT(z);
+  RB_EPOCH_BUMP(tree);
   
-    tree->DestroyKey(z->key);
-    tree->DestroyInfo(z->info);
-    y->left=z->left;
-    y->right=z->right;
-    y->parent=z->parent;
-    y->red=z->red;
-    y->children = y->left->children + y->right->children + ydval;
-    z->left->parent=z->right->parent=y;
-    if (z == z->parent->left) {
-      z->parent->left=y; 
-    } else {
-      z->parent->right=y;
+  if(q != nil) {
+       TreePush(tree,q);
+       q->children += w;
+       RB_COUNT_ADD(q,1);
+       RB_STAT_ADD(tree,sumSteps,1);
+  }
+  for(;;) {
+    if (q == nil) { /* insert the new node at the bottom */
+      q = z;
+      z->parent = p;
+      if(dir) p->right = z;
+      else p->left = z;
+      z->red = 1;
+    } else if (q->left->red && q->right->red) { /* color flip */
+      q->red = 1;
+      q->left->red = 0;
+      q->right->red = 0;
     }
-    free(z);
     
-    /** update the children values going upwards from y **/
-    {
-         rb_red_blk_node* w = y->parent;
-         double diff = ydval - zdval;
-         while(w != root) {
-            w->children += diff;
-            w = w->parent;
-       }
+    if (q->red && p->red) { /* fix red violation at the grandparent */
+      if (q == (last ? p->right : p->left)) {
+        TreeSingleRotate(tree,t,g,!last);
+        g = t; /* p took the place of g */
+      } else {
+        /* q is moved up, its sum was recomputed from children not */
+        /* visited yet (unless it is the new node) */
+        TreeDoubleRotate(tree,t,g,!last);
+        if(q != z) {
+          q->children += w;
+          RB_COUNT_ADD(q,1);
+        }
+        /* q took the place of g; the parent of t is not known, but q */
+        /* is the black top of the subtree, so there is no red */
+        /* violation in the next step, and t is set again before it is */
+        /* needed */
+        p = t;
+        g = nil;
+      }
+    }
+    
+    if (q == z) break;
+    last = dir;
+    dir = (1 == TreeCompare(tree,q->key,key)) ? 0 : 1; /* equal keys go to the right */
+    t = g;
+    g = p;
+    p = q;
+    q = dir ? q->right : q->left;
+    if(q != nil) {
+         TreePush(tree,q);
+         q->children += w;
+         RB_COUNT_ADD(q,1);
+         RB_STAT_ADD(tree,sumSteps,1);
     }
-  } else {
-       /***************************************
-        * TODO
-        * itt már semmit sem kell csinálni, 
-        ***************************************/
-    tree->DestroyKey(y->key);
-    tree->DestroyInfo(y->info);
-    if (!(y->red)) RBDeleteFixUp(tree,x);
-    free(y);
   }
-  
+  root->left->red = 0;
+  TreeDirtyNode(tree,z,w);
+  TreeFingersInsert(tree,z);
+
 #ifdef DEBUG_ASSERT
-  Assert(!tree->nil->red,"nil not black in RBDelete");
+  Assert(!tree->nil->red,"nil not black in RBTreeInsertTopDown");
+  Assert((tree->nil->children == 0.0),"nil->children != 0 in RBTreeInsertTopDown!\n");
+  Assert((tree->root->children == 0.0),"root->children != 0 in RBTreeInsertTopDown!\n");
 #endif
+  return z;
 }
 
 
+/***********************************************************************/
+/*  FUNCTION:  RBDeleteTopDown */
+/**/
+/*    INPUTS:  tree is the tree to delete from, key is the key to delete */
+/**/
+/*    OUTPUT:  1 if a node with key equal to key was found and deleted, */
+/*             0 otherwise */
+/**/
+/*    EFFECT:  Deletes one node with the given key with the top-down */
+/*             algorithm: a red node is pushed down while descending, so */
+/*             the node spliced out at the bottom is red and no fix-up is */
+/*             needed afterwards. DistFunc(key) is subtracted from the */
+/*             sums while descending to the node to delete (this assumes */
+/*             that keys comparing equal have the same DistFunc value; */
+/*             if the weight of the node found is different, e.g. after */
+/*             RBTreeDecay, the difference is corrected in an upward */
+/*             pass at the end). */
+/*             Below that node, the descent continues to its predecessor */
+/*             (which is moved into its place, so that pointers to other */
+/*             nodes stay valid); only the sums on this short path are */
+/*             updated afterwards. If the key is not found, the sums on */
+/*             the path (which ends at the last node visited) are */
+/*             recomputed from their children on the way back; the */
+/*             rotations and color changes done by the descent are kept, */
+/*             the tree stays balanced. */
+/*             The rotations use the parent and grandparent of the */
+/*             current node carried along the descent, so the parent */
+/*             pointers are only written, not read, while descending. */
+/*             The key and info of the deleted node are destroyed using */
+/*             DestroyKey and DestroyInfo. */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+int RBDeleteTopDown(rb_red_blk_tree* tree, const void* key) {
+  rb_red_blk_node* nil=tree->nil;
+  rb_red_blk_node* root=tree->root;
+  rb_red_blk_node* q = root; /* current node */
+  rb_red_blk_node* p = nil; /* parent of q */
+  rb_red_blk_node* g = nil; /* parent of p */
+  rb_red_blk_node* f = 0; /* node to delete, once found */
+  rb_red_blk_node* fp = nil; /* parent of f */
+  rb_red_blk_node* x;
+  rb_red_blk_node* c;
+  int dir = 0; /* direction to continue from q */
+  int last;
+  double w;
+  double fw = 0.0; /* weight of f */
+
+  if(tree->engine != RB_ENGINE_RB) { /* the top-down algorithm is specific to red-black trees */
+    x = RBExactQuery(tree,key);
+    if(x) RBDelete(tree,x);
+    return (x != 0);
+  }
+  w = TreeNewWeight(tree,key);
+
+  while ( (dir ? q->right : q->left) != nil ) {
+    last = dir;
+    g = p;
+    p = q;
+    q = dir ? q->right : q->left;
+    TreePush(tree,q);
+    if (f == 0) {
+      int cmp;
+      q->children -= w; /* q is above (or is) the node to delete */
+      RB_COUNT_ADD(q,-1);
+      RB_STAT_ADD(tree,sumSteps,1);
+      cmp = TreeCompare(tree,q->key,key);
+      if (cmp == 0) {
+        f = q;
+        fp = p;
+        dir = 0; /* continue to the predecessor */
+      } else dir = (cmp == 1) ? 0 : 1;
+    } else dir = 1;
     
+    /* push the red node down */
+    if (!q->red && !(dir ? q->right : q->left)->red) {
+      if ((dir ? q->left : q->right)->red) {
+        rb_red_blk_node* top = TreeSingleRotate(tree,p,q,dir);
+        /* q moved down, its sum was recomputed from children not visited */
+        /* yet; the same holds for its new parent */
+        if (f == 0 || q == f) {
+          q->children -= w;
+          top->children -= w;
+          RB_COUNT_ADD(q,-1);
+          RB_COUNT_ADD(top,-1);
+        }
+        if (q == f) fp = top;
+        g = p;
+        p = top;
+      } else {
+        rb_red_blk_node* s = last ? p->left : p->right; /* sibling of q */
+        if (s != nil) {
+          if (!s->left->red && !s->right->red) { /* color flip */
+            p->red = 0;
+            s->red = 1;
+            q->red = 1;
+          } else {
+            rb_red_blk_node* top;
+            if ((last ? s->right : s->left)->red) top = TreeDoubleRotate(tree,g,p,last);
+            else top = TreeSingleRotate(tree,g,p,last);
+            /* if p is the node to delete, q is not visited yet */
+            if (p == f) {
+              p->children -= w;
+              top->children -= w;
+              RB_COUNT_ADD(p,-1);
+              RB_COUNT_ADD(top,-1);
+              fp = top;
+            }
+            g = top;
+            q->red = top->red = 1;
+            top->left->red = 0;
+            top->right->red = 0;
+          }
+        }
+      }
+    }
+  }
   
-  
+  if (f == 0) {
+    /* not found: the nodes from q up to the root had w subtracted, the */
+    /* rest of the tree is unchanged */
+    for (x = q; x != root; x = x->parent) TreeUpdateSum(tree,x);
+    root->left->red = 0;
+    return 0;
+  }
+  {
+    rb_red_blk_node* qp = p; /* parent of q */
+    TreeDirtyDelete(tree,f);
+    TreeFingersDelete(tree,f);
+    /* q is the node to splice out, it has at most one child */
+    if (q != f) {
+      double qdval = q->weight;
+      for (x = q->parent; x != f; x = x->parent) {
+        x->children -= qdval;
+        RB_COUNT_ADD(x,-1);
+        RB_STAT_ADD(tree,sumSteps,1);
+      }
+    }
+    c = (q->left == nil) ? q->right : q->left;
+    x = qp;
+    if (q == x->left) x->left = c;
+    else x->right = c;
+    if (c != nil) c->parent = x;
+    if (q != f) { /* move q into the place of f */
+      q->left = f->left;
+      q->right = f->right;
+      q->parent = fp;
+      q->red = f->red;
+      q->children = f->children;
+#ifdef RB_RANGE_UPDATE
+      q->count = f->count;
+#endif
+      if (q->left != nil) q->left->parent = q;
+      if (q->right != nil) q->right->parent = q;
+      if (f == fp->left) fp->left = q;
+      else fp->right = q;
+      x = q;
+      if (qp != f) TreeDirtyPath(tree,qp);
+      TreeDirtyPath(tree,q);
+    }
+    else TreeDirtyPath(tree,qp);
+    /* x is the lowest node which had w subtracted instead of the weight of f */
+    fw = f->weight;
+    if (fw != w) for (; x != root; x = x->parent) x->children += w - fw;
+    tree->DestroyKey(f->key);
+    tree->DestroyInfo(f->info);
+    TreeFreeNode(tree,f);
+    TreeFingersDone(tree);
+  }
+  root->left->red = 0;
+  nil->red = 0;
+
+#ifdef DEBUG_ASSERT
+  Assert((tree->nil->children == 0.0),"nil->children != 0 in RBDeleteTopDown!\n");
+  Assert((tree->root->children == 0.0),"root->children != 0 in RBDeleteTopDown!\n");
+#endif
+  return 1;
+}
+
+
+/***********************************************************************
+ * move x to the free slot s of an arena: copy it and redirect the links
+ * of its parent and children to the new place (root and nil stay where
+ * they are); returns s
+ ***********************************************************************/
+static rb_red_blk_node* TreeMoveNode(rb_red_blk_tree* tree, rb_red_blk_node* x, rb_node_arena* a) {
+     rb_red_blk_node* nil = tree->nil;
+     rb_quantile_finger* f;
+     rb_red_blk_node* s = a->nodes + a->used;
+     a->used++;
+     a->live++;
+     *s = *x;
+     if(x == x->parent->left) x->parent->left = s;
+     else x->parent->right = s;
+     if(s->left != nil) s->left->parent = s;
+     if(s->right != nil) s->right->parent = s;
+     for(f = tree->fingers; f; f = f->next) if(f->node == x) f->node = s;
+     TreeReleaseNode(tree,x);
+     return s;
+}
+
+static inline int TreeInArena(const rb_node_arena* a, const rb_red_blk_node* x) {
+     return (x >= a->nodes && x < a->nodes + a->used);
+}
+
+/* next node after x in preorder (x can be the root sentinel), or 0 */
+static rb_red_blk_node* TreePreorderNext(const rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     rb_red_blk_node* nil = tree->nil;
+     rb_red_blk_node* root = tree->root;
+     if(x == root) return (root->left == nil) ? 0 : root->left;
+     if(x->left != nil) return x->left;
+     if(x->right != nil) return x->right;
+     while(x->parent != root) {
+          if(x == x->parent->left && x->parent->right != nil) return x->parent->right;
+          x = x->parent;
+     }
+     return 0;
+}
+
+/***********************************************************************
+ * van Emde Boas order of the subtree of x cut at the given number of
+ * levels: the top half of the levels first, then the subtrees below it
+ * from left to right; the nodes deeper than levels are left out
+ * (TreeVEBBottom visits the roots of the bottom subtrees, at depth d)
+ ***********************************************************************/
+static void TreeVEBOrder(const rb_red_blk_tree* tree, rb_red_blk_node* x, unsigned int levels,
+          rb_red_blk_node** order, size_t* n);
+
+static void TreeVEBBottom(const rb_red_blk_tree* tree, rb_red_blk_node* x, unsigned int d,
+          unsigned int levels, rb_red_blk_node** order, size_t* n) {
+     if(x == tree->nil) return;
+     if(d == 0) {
+          TreeVEBOrder(tree,x,levels,order,n);
+          return;
+     }
+     TreeVEBBottom(tree,x->left,d-1,levels,order,n);
+     TreeVEBBottom(tree,x->right,d-1,levels,order,n);
+}
+
+static void TreeVEBOrder(const rb_red_blk_tree* tree, rb_red_blk_node* x, unsigned int levels,
+          rb_red_blk_node** order, size_t* n) {
+     unsigned int top;
+     if(x == tree->nil || levels == 0) return;
+     if(levels == 1) {
+          order[(*n)++] = x;
+          return;
+     }
+     top = levels/2;
+     TreeVEBOrder(tree,x,top,order,n);
+     TreeVEBBottom(tree,x,top,levels - top,order,n);
+}
+
+/* stop an incremental compaction (the nodes moved so far stay in place) */
+static void TreeCompactEnd(rb_red_blk_tree* tree) {
+     rb_node_arena* a = tree->compact->arena;
+     free(tree->compact);
+     tree->compact = 0;
+     if(a->live == 0) TreeArenaFree(tree,a);
+}
 
+/***********************************************************************/
+/*  FUNCTION:  RBTreeCompactStep */
+/**/
+/*    INPUTS:  tree is the tree in question, maxNodes is the number of */
+/*             nodes to visit in this step */
+/**/
+/*    OUTPUT:  1 if the compaction is finished, 0 if more steps are */
+/*             needed */
+/**/
+/*    EFFECT:  Incremental compaction in preorder (RB_LAYOUT_DFS): the */
+/*             first call allocates a contiguous block for the current */
+/*             number of nodes; each call moves the next (at most) */
+/*             maxNodes nodes in preorder into the block. The tree can */
+/*             be used between the steps: the queries are not affected, */
+/*             and the tree can be modified as well (the compaction */
+/*             continues from where it was, so after rotations, some */
+/*             nodes might be left out, and new nodes are only moved */
+/*             while there is room in the block). */
+/*             The nodes moved get a new address, so pointers to them */
+/*             (e.g. the results of RBTreeInsert) are not valid after a */
+/*             step; the root and nil sentinels do not move. */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
+
+int RBTreeCompactStep(rb_red_blk_tree* tree, size_t maxNodes) {
+     rb_compact_state* st = tree->compact;
+     size_t i;
+     if(st == 0) {
+          if(tree->nodes == 0) return 1;
+          st = (rb_compact_state*)SafeMalloc(sizeof(rb_compact_state));
+          st->arena = TreeArenaCreate(tree,tree->nodes);
+          st->cursor = tree->root;
+          tree->compact = st;
+     }
+     for(i=0;i<maxNodes;i++) {
+          rb_red_blk_node* x = TreePreorderNext(tree,st->cursor);
+          if(x == 0 || st->arena->used == st->arena->size) {
+               TreeCompactEnd(tree);
+               return 1;
+          }
+          if(!TreeInArena(st->arena,x)) x = TreeMoveNode(tree,x,st->arena);
+          st->cursor = x;
+     }
+     return 0;
+}
 
+/***********************************************************************/
+/*  FUNCTION:  RBTreeCompact */
+/**/
+/*    INPUTS:  tree is the tree in question, layout is RB_LAYOUT_DFS or */
+/*             RB_LAYOUT_VEB (see red_black_tree.h) */
+/**/
+/*    OUTPUT:  none */
+/**/
+/*    EFFECT:  Moves all nodes into one new contiguous block (aligned to */
+/*             cache lines), in the given order, so that the nodes on */
+/*             the paths from the root share cache lines and pages, */
+/*             instead of being scattered on the heap after many inserts */
+/*             and deletes. The old blocks are freed (O(n log log n) for */
+/*             RB_LAYOUT_VEB, O(n) for RB_LAYOUT_DFS). An incremental */
+/*             compaction in progress is abandoned, not finished, since */
+/*             all nodes are moved again anyway (its block is freed with */
+/*             the other old blocks). As with RBTreeCompactStep, */
+/*             pointers to the nodes become invalid. */
+/**/
+/*    Modifies Input: tree */
+/***********************************************************************/
 
+void RBTreeCompact(rb_red_blk_tree* tree, int layout) {
+     rb_tree_shape shape;
+     rb_red_blk_node** order;
+     rb_node_arena* a;
+     size_t n = 0;
+     size_t i;
+     
+     if(tree->compact) TreeCompactEnd(tree);
+     if(layout != RB_LAYOUT_VEB) {
+          while(!RBTreeCompactStep(tree,(size_t)-1)) ;
+          return;
+     }
+     if(tree->nodes == 0) return;
+     RBTreeShape(tree,&shape);
+     order = (rb_red_blk_node**)SafeMalloc(sizeof(rb_red_blk_node*)*tree->nodes);
+     TreeVEBOrder(tree,tree->root->left,shape.height,order,&n);
+     a = TreeArenaCreate(tree,n);
+     for(i=0;i<n;i++) TreeMoveNode(tree,order[i],a);
+     free(order);
+}
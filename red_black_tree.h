@@ -40,6 +40,35 @@
 /* checks from the compiled code.  */
 /* #define DEBUG_ASSERT 1 */
 
+/* uncomment the line below (or compile with -DRB_STATS) to count the */
+/* operations done by the tree (comparisons, rotations, etc.), see */
+/* rb_tree_stats below; the counters are compiled out by default */
+/* #define RB_STATS 1 */
+
+/* uncomment the line below (or compile with -DRB_RANGE_UPDATE) to be */
+/* able to change the weights of all nodes in a key range at once (see */
+/* RBRangeMultiply and RBRangeAdd); this needs a node count and a */
+/* pending update in each node, so it is not included by default */
+/* #define RB_RANGE_UPDATE 1 */
+
+/* uncomment the line below (or compile with -DRB_TRACK_CHANGES) to mark */
+/* the nodes changed since the last export, so that RBTreeExportChanges */
+/* only visits those (see there); this needs a flag and a weight change */
+/* in each node, so it is not included by default */
+/* #define RB_TRACK_CHANGES 1 */
+
+/* uncomment the line below (or compile with -DRB_RANK_CACHE) to store */
+/* the result of GetNodeRankCached in the node, so that asking for the */
+/* rank of the same node again is O(1) until the tree is modified (the */
+/* tree has a modification counter, the epoch, and each node the epoch */
+/* of its stored rank); this needs two more fields in each node */
+/* #define RB_RANK_CACHE 1 */
+
+/* RBTreeSetDistFunc uses POSIX threads for large trees; define */
+/* RB_NO_THREADS to do all the work in the calling thread instead */
+/* (in this case, there is no need to link with -lpthread) */
+/* #define RB_NO_THREADS 1 */
+
 /********************************
  * functions for int64_t keys
  * works only on 64-bit machines, where sizeof(int64_t) == sizeof(void*)
@@ -62,6 +91,10 @@ static double DFInt64(const void* a, const void* b) {
 }
 
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*******************
  * node definition *
  *******************/
@@ -69,13 +102,129 @@ typedef struct rb_red_blk_node {
   void* key;
   void* info;
   int red; /* if red=0 then the node is black */
+  unsigned int priority; /* heap priority, only used by the treap engine */
   struct rb_red_blk_node* left;
   struct rb_red_blk_node* right;
   struct rb_red_blk_node* parent;
   double children; /** sum of DistFunc(key) from this subtree, including this node -- 0.0 for nil and root **/
+  double weight; /* DistFunc(key) of this node, stored so that it is not recomputed */
+                 /* for each rotation; weight and children are relative to tree->scale */
+#ifdef RB_RANGE_UPDATE
+  size_t count; /* number of nodes in this subtree -- 0 for nil and root */
+  double tagMul; /* update not applied yet to the nodes below this one: */
+  double tagAdd; /* their weights should be multiplied by tagMul, then tagAdd added */
+#endif
+#ifdef RB_TRACK_CHANGES
+  int dirty; /* RB_DIRTY_* flags, since the last RBTreeExportChanges */
+  double dirtyDelta; /* change of the weight at this place in the key order (see there) */
+#endif
+#ifdef RB_RANK_CACHE
+  uint64_t rankEpoch; /* tree->epoch when rankCache was computed */
+  double rankCache; /* the result of GetNodeRankCached at that time */
+#endif
 } rb_red_blk_node;
 
 
+/**********************************************
+ * balancing algorithms (see RBTreeSetEngine)
+ * RB_ENGINE_RB: red-black tree (default)
+ * RB_ENGINE_TREAP: treap where each access by RBTreeAccess can increase
+ *   the priority of the node found (Seidel and Aragon, 1996), so that
+ *   frequently queried keys move close to the root; the children sums
+ *   are maintained in the same way as for the red-black tree
+ **********************************************/
+#define RB_ENGINE_RB 0
+#define RB_ENGINE_TREAP 1
+
+/**********************************************
+ * node layouts for RBTreeCompact
+ * RB_LAYOUT_DFS: preorder (a node, then its left subtree, then its right
+ *   subtree), so the left child of a node is next to it in memory
+ * RB_LAYOUT_VEB: van Emde Boas order (the top half of the levels is
+ *   stored first, then each subtree below it, recursively), so that any
+ *   root-to-leaf path touches O(log_B(n)) blocks of size B, for any B
+ *   (cache lines and pages as well)
+ **********************************************/
+#define RB_LAYOUT_DFS 0
+#define RB_LAYOUT_VEB 1
+
+/**********************************************
+ * node storage (see RBTreeSetNodeStorage)
+ * RB_STORAGE_HEAP: each node is allocated by SafeMalloc (default)
+ * RB_STORAGE_THP: nodes are allocated from large blocks mapped with
+ *   mmap, aligned to 2 MB and marked with MADV_HUGEPAGE, so that they
+ *   are backed by transparent huge pages if these are enabled in the
+ *   system ("madvise" or "always" in
+ *   /sys/kernel/mm/transparent_hugepage/enabled); a tree of n nodes then
+ *   needs about n/40000 TLB entries instead of n/80
+ * RB_STORAGE_HUGETLB: the same with MAP_HUGETLB, i.e. pages from the
+ *   reserved huge page pool (vm.nr_hugepages); if the pool is empty, this
+ *   falls back to RB_STORAGE_THP
+ * the blocks are only freed when the tree is destroyed, deleted nodes are
+ * reused for new ones; if mmap fails, the blocks are allocated by
+ * SafeMalloc; the huge page modes are only supported on Linux
+ **********************************************/
+#define RB_STORAGE_HEAP 0
+#define RB_STORAGE_THP 1
+#define RB_STORAGE_HUGETLB 2
+
+/**********************************************
+ * flags of the nodes changed since the last export (RB_TRACK_CHANGES)
+ * RB_DIRTY_PATH: something in the subtree of the node changed (a node
+ *   was inserted, deleted or updated, or the node was rotated or moved);
+ *   all ancestors of such a node have this flag as well
+ * RB_DIRTY_NODE: the node was inserted or its weight changed, or a node
+ *   right before it was deleted
+ **********************************************/
+#define RB_DIRTY_PATH 1
+#define RB_DIRTY_NODE 2
+
+struct rb_node_arena;
+struct rb_node_slab;
+struct rb_compact_state;
+
+/**********************************************
+ * quantile finger (see RBQuantileTrack): a node kept at the place where
+ * the cumulative sum crosses p times the total, as RBWeightSelect(tree,
+ * p*total) would return it (up to ties on zero weight nodes); the
+ * insert, delete and update functions move it by a few steps to the
+ * neighboring nodes, so reading it is O(1)
+ **********************************************/
+typedef struct rb_quantile_finger {
+  double p; /* the quantile, in [0,1] */
+  rb_red_blk_node* node; /* nil for an empty tree */
+  double before; /* sum of the weights before node (relative to tree->scale) */
+  struct rb_quantile_finger* next;
+} rb_quantile_finger;
+
+/**********************************************
+ * counters of the operations done on a tree
+ * (only present if RB_STATS is defined)
+ **********************************************/
+#ifdef RB_STATS
+typedef struct rb_tree_stats {
+  uint64_t compare; /* calls to Compare */
+  uint64_t distFunc; /* calls to DistFunc */
+  uint64_t leftRotate; /* calls to LeftRotate */
+  uint64_t rightRotate; /* calls to RightRotate */
+  uint64_t deleteFixUp; /* iterations of the loop in RBDeleteFixUp */
+  uint64_t sumSteps; /* steps made upwards when updating children */
+  uint64_t nodesAlloc; /* nodes allocated */
+  uint64_t nodesFree; /* nodes freed */
+} rb_tree_stats;
+#endif
+
+/**********************************************
+ * shape of a tree, computed by RBTreeShape (O(n))
+ **********************************************/
+typedef struct rb_tree_shape {
+  size_t nodes; /* number of nodes */
+  unsigned int height; /* length of the longest root-to-leaf path (number of nodes) */
+  unsigned int blackHeight; /* number of black nodes on any root-to-leaf path */
+  double avgDepth; /* average depth of the nodes (the root has depth 0) */
+} rb_tree_shape;
+
+
 /* Compare(a,b) should return 1 if *a > *b, -1 if *a < *b, and 0 otherwise */
 /* Destroy(a) takes a pointer to whatever key might be and frees it accordingly */
 typedef struct rb_red_blk_tree {
@@ -94,6 +243,26 @@ typedef struct rb_red_blk_tree {
   /*  that the root and nil nodes do not require special cases in the code */
   rb_red_blk_node* root;             
   rb_red_blk_node* nil; 
+  int engine; /* balancing algorithm, RB_ENGINE_RB or RB_ENGINE_TREAP */
+  uint64_t rngState; /* random state for the treap priorities */
+  double scale; /* the real weights are the stored ones times scale (see RBTreeDecay) */
+  size_t nodes; /* number of nodes */
+  struct rb_node_arena* arenas; /* contiguous blocks of nodes made by RBTreeCompact */
+  struct rb_compact_state* compact; /* compaction in progress (RBTreeCompactStep), or 0 */
+  int storage; /* where new nodes are allocated, RB_STORAGE_* */
+  struct rb_node_slab* slabs; /* blocks of nodes for the huge page storage */
+  rb_red_blk_node* freeNodes; /* deleted nodes from the slabs, linked by parent */
+#ifdef RB_TRACK_CHANGES
+  int dirtyAll; /* all weights changed (e.g. RBTreeDecay), the next export is full */
+#endif
+#ifdef RB_RANK_CACHE
+  uint64_t epoch; /* incremented by each change of the weights or of the set of nodes */
+#endif
+  rb_quantile_finger* fingers; /* quantiles kept up to date (RBQuantileTrack) */
+  int batch; /* between RBTreeBeginBatch and RBTreeEndBatch: the sums are not up to date */
+#ifdef RB_STATS
+  rb_tree_stats stats;
+#endif
 } rb_red_blk_tree;
 
 rb_red_blk_tree* RBTreeCreate(int  (*CompFunc)(const void*, const void*),
@@ -104,17 +273,67 @@ rb_red_blk_tree* RBTreeCreate(int  (*CompFunc)(const void*, const void*),
 			     double (*DistFunc)(const void*, const void*),
 			     void* dfparam);
 rb_red_blk_node * RBTreeInsert(rb_red_blk_tree*, void* key, void* info);
+rb_red_blk_node * RBTreeInsertHint(rb_red_blk_tree*, rb_red_blk_node* hint, void* key, void* info); //!! insert starting the search from a nearby node
+rb_red_blk_node * RBTreeInsertTopDown(rb_red_blk_tree*, void* key, void* info); //!! insert in a single top-down pass
+int RBTreeBuildSorted(rb_red_blk_tree*, void* const* keys, void* const* infos, size_t n); //!! bulk load sorted keys into an empty tree in O(n)
 void RBTreePrint(rb_red_blk_tree*);
 void RBDelete(rb_red_blk_tree* , rb_red_blk_node* );
+int RBDeleteTopDown(rb_red_blk_tree*, const void* key); //!! delete a node with the given key in a single top-down pass
+int RBDeleteKey(rb_red_blk_tree*, const void* key); //!! delete a node with the given key, searching only once
+rb_red_blk_node* RBUpsert(rb_red_blk_tree*, void* key, void* info,
+			  void (*Merge)(rb_red_blk_node* x, void* key, void* info)); //!! update the node with an equal key (by Merge) or insert a new one
 void RBTreeDestroy(rb_red_blk_tree*);
 rb_red_blk_node* TreePredecessor(rb_red_blk_tree*,rb_red_blk_node*);
 rb_red_blk_node* TreeSuccessor(rb_red_blk_tree*,rb_red_blk_node*);
 rb_red_blk_node* TreeFirst(rb_red_blk_tree*); //!! get the first node (can be used to start an iteration over the tree nodes)
 rb_red_blk_node* TreeLast(rb_red_blk_tree*); //!! get the last node
 rb_red_blk_node* RBExactQuery(const rb_red_blk_tree*, const void*);
+rb_red_blk_node* RBTreeAccess(rb_red_blk_tree*, const void*); //!! RBExactQuery, counted as an access by the treap engine (can rotate the tree)
+void RBSortedRank(const rb_red_blk_tree*, void* const* keys, size_t m, double* out); //!! rank of many sorted query keys at once
+void RBBatchQuery(const rb_red_blk_tree*, void* const* keys, size_t m, rb_red_blk_node** nodes); //!! RBExactQuery for many keys, interleaved
+void RBBatchRank(const rb_red_blk_tree*, void* const* keys, size_t m, double* out); //!! rank of many unsorted keys, interleaved
+double RBTreeKSDistance(const rb_red_blk_tree* a, const rb_red_blk_tree* b); //!! max |CDF_a - CDF_b| in one merged pass
+double RBTreeKSDistanceApprox(const rb_red_blk_tree* a, const rb_red_blk_tree* b, double eps); //!! the same, within eps, visiting only part of a
 stk_stack * RBEnumerate(rb_red_blk_tree* tree,void* low, void* high);
 void NullFunction(const void*);
 double GetNodeRank(rb_red_blk_tree*,rb_red_blk_node*); //!! get the rank of the node
+double GetNodeRankCached(rb_red_blk_tree*,rb_red_blk_node*); //!! the same, stored in the node until the tree changes (RB_RANK_CACHE)
+rb_red_blk_node* RBWeightSelect(const rb_red_blk_tree*, double target, double* before); //!! find the node where the rank crosses target
+void RBWeightSelectSorted(const rb_red_blk_tree*, const double* targets, size_t m, rb_red_blk_node** nodes); //!! RBWeightSelect for many sorted targets at once
+size_t RBWeightDrawDistinct(rb_red_blk_tree*, double (*Uniform)(void*), void* state, size_t m, rb_red_blk_node** nodes); //!! weighted sample of m distinct nodes
+rb_quantile_finger* RBQuantileTrack(rb_red_blk_tree*, double p); //!! keep the node at the p quantile up to date while the tree changes
+void RBQuantileUntrack(rb_red_blk_tree*, rb_quantile_finger*); //!! stop updating (and free) a finger
+rb_red_blk_node* RBQuantileGet(const rb_red_blk_tree*, const rb_quantile_finger*, double* before); //!! the node of a finger in O(1), as RBWeightSelect
+void RBUpdateWeight(rb_red_blk_tree*, rb_red_blk_node*); //!! update the sums after DistFunc(key) of a node changed
+void RBTreeBeginBatch(rb_red_blk_tree*); //!! defer the sums of the following inserts, deletes and weight updates
+void RBTreeEndBatch(rb_red_blk_tree*); //!! recompute the deferred sums in one pass over the changed paths
+int RBTreeSetEngine(rb_red_blk_tree*, int engine); //!! select the balancing algorithm (only for an empty tree)
+int RBTreeSetNodeStorage(rb_red_blk_tree*, int storage); //!! allocate the nodes on huge pages or on the heap (only for an empty tree)
+void RBTreeDecay(rb_red_blk_tree*, double factor); //!! multiply all weights by factor, O(1) amortized
+double RBTreeTotal(const rb_red_blk_tree*); //!! sum of the weights of all nodes
+#ifdef RB_RANGE_UPDATE
+void RBRangeMultiply(rb_red_blk_tree*, const void* low, const void* high, double factor); //!! multiply the weights of the keys in [low,high]
+void RBRangeAdd(rb_red_blk_tree*, const void* low, const void* high, double delta); //!! add delta to the weights of the keys in [low,high]
+#endif
+#ifdef RB_TRACK_CHANGES
+size_t RBTreeExportChanges(rb_red_blk_tree*,
+			   void (*Changed)(const rb_red_blk_node* x, double before, double weight, void* arg),
+			   void (*Unchanged)(const rb_red_blk_node* first, const rb_red_blk_node* last,
+					     double before, double shift, void* arg),
+			   void* arg); //!! report the nodes changed since the last call, and the shifts of the rest
+#endif
+void RBTreeSetDistFunc(rb_red_blk_tree*, double (*DistFunc)(const void*, const void*), void* dfparam); //!! change DistFunc and recompute all sums
+void RBTreeShape(const rb_red_blk_tree*, rb_tree_shape*); //!! compute the height, black height and average depth
+void RBTreeCompact(rb_red_blk_tree*, int layout); //!! move all nodes to a contiguous block in the given order (RB_LAYOUT_*)
+int RBTreeCompactStep(rb_red_blk_tree*, size_t maxNodes); //!! move at most maxNodes nodes in preorder, returns 1 when done
+#ifdef RB_STATS
+void RBTreeGetStats(const rb_red_blk_tree*, rb_tree_stats*); //!! copy the counters
+void RBTreeResetStats(rb_red_blk_tree*); //!! set all counters to zero
+#endif
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
 
@@ -0,0 +1,132 @@
+#include "sampler.h"
+
+/*  weighted sampling, see sampler.h */
+
+
+/***********************************************************************
+ * built-in generator: xoshiro256** (Blackman and Vigna), seeded with
+ * splitmix64; the top 53 bits give the double in [0,1)
+ ***********************************************************************/
+static inline uint64_t RngRotl(uint64_t x, int k) {
+     return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t RngNext(rb_rng* rng) {
+     uint64_t* s = rng->s;
+     uint64_t res = RngRotl(s[1]*5,7)*9;
+     uint64_t t = s[1] << 17;
+     s[2] ^= s[0];
+     s[3] ^= s[1];
+     s[1] ^= s[2];
+     s[0] ^= s[3];
+     s[2] ^= t;
+     s[3] = RngRotl(s[3],45);
+     return res;
+}
+
+void RBRngSeed(rb_rng* rng, uint64_t seed) {
+     unsigned int i;
+     for(i=0;i<4;i++) {
+          uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+          z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+          z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+          rng->s[i] = z ^ (z >> 31);
+     }
+     rng->Uniform = 0;
+     rng->state = 0;
+}
+
+void RBRngSetFunc(rb_rng* rng, double (*Uniform)(void*), void* state) {
+     rng->Uniform = Uniform;
+     rng->state = state;
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBRngSplit */
+/**/
+/*    EFFECT:  child is set to the current state of rng, and rng jumps */
+/*             2^128 steps ahead, so that the two sequences do not */
+/*             overlap (e.g. to give one generator to each thread); with */
+/*             a user generator, child gets the same function and state */
+/***********************************************************************/
+
+void RBRngSplit(rb_rng* rng, rb_rng* child) {
+     static const uint64_t jump[4] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+          0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+     uint64_t s[4] = {0, 0, 0, 0};
+     unsigned int i, b, j;
+     *child = *rng;
+     if(rng->Uniform) return;
+     for(i=0;i<4;i++) for(b=0;b<64;b++) {
+          if(jump[i] & (((uint64_t)1) << b)) for(j=0;j<4;j++) s[j] ^= rng->s[j];
+          RngNext(rng);
+     }
+     for(j=0;j<4;j++) rng->s[j] = s[j];
+}
+
+double RBRngUniform(rb_rng* rng) {
+     if(rng->Uniform) return rng->Uniform(rng->state);
+     return (double)(RngNext(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double SamplerUniform(void* rng) {
+     return RBRngUniform((rb_rng*)rng);
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBSample */
+/**/
+/*    INPUTS:  tree is the tree to sample from, rng is the generator to */
+/*             use, nodes is an array of size m for the results */
+/**/
+/*    EFFECT:  m independent draws with replacement, each node with */
+/*             probability proportional to its weight, O(m log(n)) */
+/***********************************************************************/
+
+void RBSample(const rb_red_blk_tree* tree, rb_rng* rng, size_t m, rb_red_blk_node** nodes) {
+     double total = RBTreeTotal(tree);
+     size_t i;
+     for(i=0;i<m;i++) nodes[i] = RBWeightSelect(tree,RBRngUniform(rng)*total,0);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBSampleSorted */
+/**/
+/*    EFFECT:  m draws with replacement, as RBSample, but the result is */
+/*             sorted by key: the sorted uniform numbers are generated */
+/*             directly, as the partial sums of m+1 exponential random */
+/*             numbers divided by their total (O(m)), and the nodes are */
+/*             found together by RBWeightSelectSorted, O(m log(n/m + 1)) */
+/***********************************************************************/
+
+void RBSampleSorted(const rb_red_blk_tree* tree, rb_rng* rng, size_t m, rb_red_blk_node** nodes) {
+     double* t = (double*)SafeMalloc(sizeof(double)*(m+1));
+     double total = RBTreeTotal(tree);
+     double sum = 0.0;
+     size_t i;
+     for(i=0;i<m;i++) {
+          sum -= log(1.0 - RBRngUniform(rng));
+          t[i] = sum;
+     }
+     sum -= log(1.0 - RBRngUniform(rng));
+     for(i=0;i<m;i++) t[i] *= total / sum;
+     RBWeightSelectSorted(tree,t,m,nodes);
+     free(t);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  RBSampleDistinct */
+/**/
+/*    OUTPUT:  the number of nodes drawn: m, or less if there are fewer */
+/*             than m nodes with positive weight */
+/**/
+/*    EFFECT:  draws without replacement (successive sampling, each */
+/*             node with probability proportional to its weight among */
+/*             the nodes not drawn yet), in the order drawn; see */
+/*             RBWeightDrawDistinct, O(m log(n)) */
+/***********************************************************************/
+
+size_t RBSampleDistinct(rb_red_blk_tree* tree, rb_rng* rng, size_t m, rb_red_blk_node** nodes) {
+     return RBWeightDrawDistinct(tree,SamplerUniform,rng,m,nodes);
+}
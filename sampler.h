@@ -0,0 +1,52 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "red_black_tree.h"
+
+/**************************************************
+ * weighted random sampling of the nodes of a tree (with probabilities
+ * proportional to the weights, i.e. DistFunc)
+ *
+ * with replacement: RBSample draws each node by descending the sums from
+ * the root (RBWeightSelect, O(log(n)) per draw, in the order drawn);
+ * RBSampleSorted draws m sorted uniform numbers directly (from the
+ * partial sums of exponential variables) and finds all nodes in one
+ * traversal (RBWeightSelectSorted), the result is in key order
+ *
+ * without replacement: RBSampleDistinct sets the weight of each node
+ * drawn to zero temporarily (recomputing the sums on its path) and
+ * restores all of them at the end (RBWeightDrawDistinct), so there is
+ * no need to delete and insert the nodes again
+ *
+ * the random numbers come from an rb_rng: either the built-in
+ * xoshiro256** generator, or a function given by the user; RBSample and
+ * RBSampleSorted do not modify the tree, so several threads can sample
+ * from the same tree at the same time, each with its own rb_rng (e.g.
+ * made by RBRngSplit, which gives non-overlapping sequences); the tree
+ * must not be modified meanwhile, this includes RBSampleDistinct
+ **************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rb_rng {
+  uint64_t s[4]; /* state of the built-in generator */
+  double (*Uniform)(void* state); /* user generator in [0,1), or 0 for the built-in one */
+  void* state;
+} rb_rng;
+
+void RBRngSeed(rb_rng*, uint64_t seed); //!! use the built-in generator, with the given seed
+void RBRngSetFunc(rb_rng*, double (*Uniform)(void*), void* state); //!! use Uniform(state) instead
+void RBRngSplit(rb_rng* rng, rb_rng* child); //!! child continues the sequence of rng, rng jumps ahead 2^128 steps
+double RBRngUniform(rb_rng*); //!! uniform random number in [0,1)
+
+void RBSample(const rb_red_blk_tree*, rb_rng*, size_t m, rb_red_blk_node** nodes); //!! m draws with replacement (nil for an empty tree)
+void RBSampleSorted(const rb_red_blk_tree*, rb_rng*, size_t m, rb_red_blk_node** nodes); //!! m draws with replacement, in key order
+size_t RBSampleDistinct(rb_red_blk_tree*, rb_rng*, size_t m, rb_red_blk_node** nodes); //!! up to m draws without replacement, returns the number drawn
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
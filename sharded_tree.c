@@ -0,0 +1,413 @@
+#include "sharded_tree.h"
+
+/*  key-range sharded tree, see sharded_tree.h */
+
+#ifndef RB_NO_THREADS
+#define SHARD_LOCK(m) pthread_mutex_lock(m)
+#define SHARD_UNLOCK(m) pthread_mutex_unlock(m)
+#define SHARD_RDLOCK(l) pthread_rwlock_rdlock(l)
+#define SHARD_WRLOCK(l) pthread_rwlock_wrlock(l)
+#define SHARD_RWUNLOCK(l) pthread_rwlock_unlock(l)
+#else
+#define SHARD_LOCK(m) ((void)0)
+#define SHARD_UNLOCK(m) ((void)0)
+#define SHARD_RDLOCK(l) ((void)0)
+#define SHARD_WRLOCK(l) ((void)0)
+#define SHARD_RWUNLOCK(l) ((void)0)
+#endif
+
+/* the automatic rebalancing is not done for less nodes than this per shard */
+#define SHARD_MIN_AVG 16
+
+static void ShardNoDestroy(void* a) {
+     ;
+}
+
+
+/***********************************************************************
+ * Fenwick tree of the shard totals: FenwickAdd adds d to the total of
+ * shard i, FenwickPrefix returns the sum of the totals of shards 0..i-1
+ ***********************************************************************/
+static void FenwickAdd(rb_sharded_tree* st, size_t i, double d) {
+     size_t j;
+     for(j=i+1;j<=st->P;j+=(j&(~j+1))) st->fenwick[j] += d;
+}
+
+static double FenwickPrefix(const rb_sharded_tree* st, size_t i) {
+     double s = 0.0;
+     size_t j;
+     for(j=i;j>0;j-=(j&(~j+1))) s += st->fenwick[j];
+     return s;
+}
+
+static void FenwickRebuild(rb_sharded_tree* st) {
+     size_t i;
+     for(i=0;i<=st->P;i++) st->fenwick[i] = 0.0;
+     for(i=0;i<st->P;i++) {
+          st->totals[i] = RBTreeTotal(st->shards[i].tree);
+          FenwickAdd(st,i,st->totals[i]);
+     }
+}
+
+
+/***********************************************************************
+ * index of the shard containing key: the number of boundaries <= key
+ ***********************************************************************/
+static size_t ShardFind(const rb_sharded_tree* st, const void* key) {
+     size_t lo = 0;
+     size_t hi = st->P - 1;
+     while(lo < hi) {
+          size_t mid = lo + (hi-lo)/2;
+          if(!st->boundInf[mid] && st->Compare(st->bounds[mid],key) != 1) lo = mid + 1;
+          else hi = mid;
+     }
+     return lo;
+}
+
+
+/***********************************************************************
+ * update the stored total of shard i after a change of dn nodes in it
+ * (called with the lock of the shard held); returns nonzero if the
+ * shard got too large compared to the average
+ ***********************************************************************/
+static int ShardUpdateSum(rb_sharded_tree* st, size_t i, long dn) {
+     rb_shard* s = st->shards + i;
+     double total = RBTreeTotal(s->tree);
+     int ret = 0;
+     s->n += dn;
+     SHARD_LOCK(&(st->sumLock));
+     FenwickAdd(st,i,total - st->totals[i]);
+     st->totals[i] = total;
+     st->n += dn;
+     if(dn > 0 && st->maxImbalance > 0.0 && st->n >= SHARD_MIN_AVG*st->P &&
+          (double)(s->n) > st->maxImbalance * (double)(st->n) / (double)(st->P)) ret = 1;
+     SHARD_UNLOCK(&(st->sumLock));
+     return ret;
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  ShardedTreeCreate */
+/**/
+/*    INPUTS:  P is the number of shards; splits is an array of P-1 */
+/*             sorted keys to use as the initial boundaries (these are */
+/*             copied with CopyKey), or NULL to start with all keys in */
+/*             the first shard until the first rebalancing; the other */
+/*             arguments are used for each shard as in RBTreeCreate */
+/**/
+/*    OUTPUT:  a new, empty sharded tree */
+/***********************************************************************/
+
+rb_sharded_tree* ShardedTreeCreate(size_t P, void* const* splits,
+			     int  (*CompFunc)(const void*, const void*),
+			     void (*DestFunc)(void*),
+			     void (*InfoDestFunc)(void*),
+			     void (*PrintFunc)(const void*),
+			     void (*PrintInfo)(void*),
+			     double (*DistFunc)(const void*, const void*),
+			     void* dfparam,
+			     void* (*CopyKey)(const void*)) {
+     rb_sharded_tree* st = (rb_sharded_tree*)SafeMalloc(sizeof(rb_sharded_tree));
+     size_t i;
+     if(P < 1) P = 1;
+     st->P = P;
+     st->shards = (rb_shard*)SafeMalloc(sizeof(rb_shard)*P);
+     st->bounds = (void**)SafeMalloc(sizeof(void*)*P);
+     st->boundInf = (int*)SafeMalloc(sizeof(int)*P);
+     st->totals = (double*)SafeMalloc(sizeof(double)*P);
+     st->fenwick = (double*)SafeMalloc(sizeof(double)*(P+1));
+     st->n = 0;
+     st->maxImbalance = 2.0;
+     st->CopyKey = CopyKey;
+     st->DestroyKey = DestFunc;
+     st->Compare = CompFunc;
+     for(i=0;i<P;i++) {
+          st->shards[i].tree = RBTreeCreate(CompFunc,DestFunc,InfoDestFunc,PrintFunc,PrintInfo,DistFunc,dfparam);
+          st->shards[i].n = 0;
+#ifndef RB_NO_THREADS
+          pthread_mutex_init(&(st->shards[i].lock),0);
+#endif
+          st->totals[i] = 0.0;
+          st->bounds[i] = 0;
+          st->boundInf[i] = 1;
+          if(splits && i+1 < P) {
+               st->bounds[i] = CopyKey ? CopyKey(splits[i]) : splits[i];
+               st->boundInf[i] = 0;
+          }
+     }
+     for(i=0;i<=P;i++) st->fenwick[i] = 0.0;
+#ifndef RB_NO_THREADS
+     pthread_rwlock_init(&(st->layout),0);
+     pthread_mutex_init(&(st->sumLock),0);
+#endif
+     return st;
+}
+
+void ShardedTreeDestroy(rb_sharded_tree* st) {
+     size_t i;
+     for(i=0;i<st->P;i++) {
+          RBTreeDestroy(st->shards[i].tree);
+#ifndef RB_NO_THREADS
+          pthread_mutex_destroy(&(st->shards[i].lock));
+#endif
+          if(st->CopyKey && !st->boundInf[i]) st->DestroyKey(st->bounds[i]);
+     }
+#ifndef RB_NO_THREADS
+     pthread_rwlock_destroy(&(st->layout));
+     pthread_mutex_destroy(&(st->sumLock));
+#endif
+     free(st->shards);
+     free(st->bounds);
+     free(st->boundInf);
+     free(st->totals);
+     free(st->fenwick);
+     free(st);
+}
+
+void ShardedTreeSetImbalance(rb_sharded_tree* st, double maxImbalance) {
+     SHARD_LOCK(&(st->sumLock));
+     st->maxImbalance = maxImbalance;
+     SHARD_UNLOCK(&(st->sumLock));
+}
+
+
+static void ShardRebalance(rb_sharded_tree* st, int onlyIfNeeded);
+
+/***********************************************************************/
+/*  FUNCTION:  ShardedTreeInsert */
+/**/
+/*    EFFECT:  Inserts key and info into the shard containing key; only */
+/*             this shard is locked, for the time of RBTreeInsert. If the */
+/*             shard became too large, rebalances the shards afterwards. */
+/***********************************************************************/
+
+void ShardedTreeInsert(rb_sharded_tree* st, void* key, void* info) {
+     size_t i;
+     int rebalance;
+     SHARD_RDLOCK(&(st->layout));
+     i = ShardFind(st,key);
+     SHARD_LOCK(&(st->shards[i].lock));
+     RBTreeInsert(st->shards[i].tree,key,info);
+     rebalance = ShardUpdateSum(st,i,1);
+     SHARD_UNLOCK(&(st->shards[i].lock));
+     SHARD_RWUNLOCK(&(st->layout));
+     if(rebalance) ShardRebalance(st,1);
+}
+
+/***********************************************************************/
+/*  FUNCTION:  ShardedTreeDelete */
+/**/
+/*    OUTPUT:  1 if a node with key was found and deleted, 0 otherwise */
+/***********************************************************************/
+
+int ShardedTreeDelete(rb_sharded_tree* st, const void* key) {
+     size_t i;
+     rb_red_blk_node* x;
+     int ret = 0;
+     SHARD_RDLOCK(&(st->layout));
+     i = ShardFind(st,key);
+     SHARD_LOCK(&(st->shards[i].lock));
+     x = RBExactQuery(st->shards[i].tree,key);
+     if(x) {
+          RBDelete(st->shards[i].tree,x);
+          ShardUpdateSum(st,i,-1);
+          ret = 1;
+     }
+     SHARD_UNLOCK(&(st->shards[i].lock));
+     SHARD_RWUNLOCK(&(st->layout));
+     return ret;
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  ShardedTreeRank */
+/**/
+/*    OUTPUT:  the sum of DistFunc over the keys smaller than key: the */
+/*             totals of the shards before the one containing key (from */
+/*             the Fenwick tree) plus the rank in that shard */
+/***********************************************************************/
+
+double ShardedTreeRank(rb_sharded_tree* st, const void* key) {
+     size_t i;
+     double r = 0.0;
+     double pre;
+     void* k = (void*)key;
+     SHARD_RDLOCK(&(st->layout));
+     i = ShardFind(st,key);
+     SHARD_LOCK(&(st->sumLock));
+     pre = FenwickPrefix(st,i);
+     SHARD_UNLOCK(&(st->sumLock));
+     SHARD_LOCK(&(st->shards[i].lock));
+     RBSortedRank(st->shards[i].tree,&k,1,&r);
+     SHARD_UNLOCK(&(st->shards[i].lock));
+     SHARD_RWUNLOCK(&(st->layout));
+     return pre + r;
+}
+
+double ShardedTreeTotal(rb_sharded_tree* st) {
+     double total;
+     SHARD_LOCK(&(st->sumLock));
+     total = FenwickPrefix(st,st->P);
+     SHARD_UNLOCK(&(st->sumLock));
+     return total;
+}
+
+double ShardedTreeCDF(rb_sharded_tree* st, const void* key) {
+     double total = ShardedTreeTotal(st);
+     if(total == 0.0) return 0.0;
+     return ShardedTreeRank(st,key) / total;
+}
+
+size_t ShardedTreeSize(rb_sharded_tree* st) {
+     size_t n;
+     SHARD_LOCK(&(st->sumLock));
+     n = st->n;
+     SHARD_UNLOCK(&(st->sumLock));
+     return n;
+}
+
+
+/***********************************************************************
+ * move the node x from shard i to shard j (without freeing its key and
+ * info), using hint for the insert; returns the new node
+ ***********************************************************************/
+static rb_red_blk_node* ShardMoveNode(rb_sharded_tree* st, size_t i, size_t j,
+          rb_red_blk_node* x, rb_red_blk_node* hint) {
+     rb_red_blk_tree* from = st->shards[i].tree;
+     void (*dk)(void*) = from->DestroyKey;
+     void (*di)(void*) = from->DestroyInfo;
+     void* key = x->key;
+     void* info = x->info;
+     from->DestroyKey = ShardNoDestroy;
+     from->DestroyInfo = ShardNoDestroy;
+     RBDelete(from,x);
+     from->DestroyKey = dk;
+     from->DestroyInfo = di;
+     st->shards[i].n--;
+     st->shards[j].n++;
+     return RBTreeInsertHint(st->shards[j].tree,hint,key,info);
+}
+
+/***********************************************************************
+ * set boundary i to key (copying it) or to infinity if key is 0
+ ***********************************************************************/
+static void ShardSetBound(rb_sharded_tree* st, size_t i, const void* key, int inf) {
+     if(st->CopyKey && !st->boundInf[i]) st->DestroyKey(st->bounds[i]);
+     st->boundInf[i] = inf;
+     st->bounds[i] = 0;
+     if(!inf) st->bounds[i] = st->CopyKey ? st->CopyKey(key) : (void*)key;
+}
+
+
+/***********************************************************************
+ * new boundary keys for n nodes: boundary k-1 is the key of the node at
+ * global position k*n/P (k = 1, ..., P-1), where the nodes of shard s
+ * have positions start[s], ..., start[s]+n_s-1; in each shard, the
+ * boundaries falling into its first part are found by stepping from
+ * its first node, the others from its last node, so only the nodes
+ * leaving the shard (and equal keys next to a boundary) are visited
+ ***********************************************************************/
+static void ShardNewBounds(rb_sharded_tree* st, size_t n, void** nb) {
+     size_t P = st->P;
+     size_t s, k = 1, start = 0;
+     for(s=0;s<P;s++) {
+          rb_red_blk_tree* tree = st->shards[s].tree;
+          size_t ns = st->shards[s].n;
+          size_t k1 = k, k2;
+          while(k < P && k*n/P < start + ns) k++;
+          /* boundaries k1, ..., k-1 fall into shard s */
+          if(k1 < k) {
+               rb_red_blk_node* x = TreeFirst(tree);
+               size_t pos = start;
+               for(k2=k1;k2<k && k2<=s;k2++) {
+                    for(;pos<k2*n/P;pos++) x = TreeSuccessor(tree,x);
+                    nb[k2-1] = x->key;
+               }
+               x = TreeLast(tree);
+               pos = start + ns - 1;
+               for(k2=k;k2>k1 && k2-1>s;k2--) {
+                    for(;pos>(k2-1)*n/P;pos--) x = TreePredecessor(tree,x);
+                    nb[k2-2] = x->key;
+               }
+          }
+          start += ns;
+     }
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  ShardedTreeRebalance */
+/**/
+/*    EFFECT:  Moves nodes between shards, so that shards 0..i hold */
+/*             about (i+1)*n/P nodes for each i (up to runs of equal */
+/*             keys, which are never split). First, the new boundaries */
+/*             are found: boundary i is set to the key of the node at */
+/*             global position (i+1)*n/P. Then, in each shard, the */
+/*             nodes at its beginning which belong to an earlier shard */
+/*             and the nodes at its end which belong to a later shard */
+/*             are moved directly to the shard given by the new */
+/*             boundaries. So each node is moved at most once, and only */
+/*             nodes that have to change shards are moved or visited */
+/*             (besides equal keys next to a new boundary): */
+/*             O(m (log(n) + log(P))) for m nodes moved. */
+/**/
+/*             This holds the layout lock for writing, so the other */
+/*             operations wait until it finishes. */
+/***********************************************************************/
+
+static void ShardRebalance(rb_sharded_tree* st, int onlyIfNeeded) {
+     size_t P = st->P;
+     size_t n, i, j;
+     SHARD_WRLOCK(&(st->layout));
+     n = st->n;
+     if(onlyIfNeeded) {
+          /* another thread may have done it already */
+          int needed = 0;
+          for(i=0;i<P;i++) if((double)(st->shards[i].n) >
+               st->maxImbalance * (double)n / (double)P) needed = 1;
+          if(!needed || st->maxImbalance <= 0.0) {
+               SHARD_RWUNLOCK(&(st->layout));
+               return;
+          }
+     }
+     if(P > 1 && n > 0) {
+          void** nb = (void**)SafeMalloc(sizeof(void*)*(P-1));
+          /* last node moved to each shard, used as the hint for the next one */
+          rb_red_blk_node** hint = (rb_red_blk_node**)SafeMalloc(sizeof(rb_red_blk_node*)*P);
+          ShardNewBounds(st,n,nb);
+          /* the keys in nb are not freed while moving the nodes */
+          for(i=0;i+1<P;i++) ShardSetBound(st,i,nb[i],0);
+          for(i=0;i<P;i++) hint[i] = 0;
+          for(i=0;i<P;i++) {
+               rb_red_blk_tree* tree = st->shards[i].tree;
+               rb_red_blk_node* x;
+               /* the beginning of shard i goes to the end of earlier shards */
+               while(st->shards[i].n > 0) {
+                    x = TreeFirst(tree);
+                    j = ShardFind(st,x->key);
+                    if(j >= i) break;
+                    if(hint[j] == 0) hint[j] = TreeLast(st->shards[j].tree);
+                    hint[j] = ShardMoveNode(st,i,j,x,hint[j]);
+               }
+               /* the end of shard i goes to the beginning of later shards */
+               while(st->shards[i].n > 0) {
+                    x = TreeLast(tree);
+                    j = ShardFind(st,x->key);
+                    if(j <= i) break;
+                    if(hint[j] == 0) hint[j] = TreeFirst(st->shards[j].tree);
+                    hint[j] = ShardMoveNode(st,i,j,x,hint[j]);
+               }
+          }
+          free(hint);
+          free(nb);
+          SHARD_LOCK(&(st->sumLock));
+          FenwickRebuild(st);
+          SHARD_UNLOCK(&(st->sumLock));
+     }
+     SHARD_RWUNLOCK(&(st->layout));
+}
+
+void ShardedTreeRebalance(rb_sharded_tree* st) {
+     ShardRebalance(st,0);
+}
+
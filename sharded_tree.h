@@ -0,0 +1,95 @@
+#ifndef SHARDED_TREE_H
+#define SHARDED_TREE_H
+
+#include "red_black_tree.h"
+#ifndef RB_NO_THREADS
+#include <pthread.h>
+#endif
+
+/**************************************************
+ * key-range sharded tree for multiple writer threads
+ *
+ * the key space is split into P ranges by P-1 boundary keys, and the
+ * keys in each range are stored in a separate red-black tree (shard)
+ * with its own lock, so that threads writing to different ranges do
+ * not block each other; shard i holds the keys k with
+ * bounds[i-1] <= k < bounds[i]
+ *
+ * the sums of DistFunc in the shards (RBTreeTotal) are kept in
+ * a Fenwick tree, so the rank of a key (sum of DistFunc of the smaller
+ * keys) is a prefix sum over the shards before it plus a rank query in
+ * one shard, O(log(P) + log(n))
+ *
+ * rebalancing moves the boundaries so that each shard has about n/P
+ * nodes, and moves each node which is now in a different shard directly
+ * there; this is done automatically when a shard grows over maxImbalance
+ * times the average or can be requested by ShardedTreeRebalance; it
+ * holds all shards only for the time of moving the nodes,
+ * O(m (log(n) + log(P))) for m nodes moved
+ *
+ * the boundary keys are copies made by CopyKey (and freed by DestFunc);
+ * if CopyKey is 0, key pointers are used as boundaries directly, this is
+ * only correct if keys stay valid after their node is deleted (e.g. the
+ * int64_t keys stored in the pointers as with CmpInt64)
+ *
+ * a query running concurrently with writers sees each shard in a
+ * consistent state, but not necessarily all of them at the same time
+ * node pointers are not returned, since rebalancing moves the nodes
+ * to other trees
+ **************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct rb_shard {
+  rb_red_blk_tree* tree;
+  size_t n; /* number of nodes in this shard */
+#ifndef RB_NO_THREADS
+  pthread_mutex_t lock;
+#endif
+} rb_shard;
+
+typedef struct rb_sharded_tree {
+  size_t P; /* number of shards */
+  rb_shard* shards;
+  void** bounds; /* P-1 boundary keys, nondecreasing */
+  int* boundInf; /* if nonzero, the boundary is larger than any key */
+  double* totals; /* sum of DistFunc in each shard */
+  double* fenwick; /* Fenwick tree of totals (1-based, size P+1) */
+  size_t n; /* total number of nodes */
+  double maxImbalance; /* rebalance automatically above this, 0: never */
+  void* (*CopyKey)(const void* a);
+  void (*DestroyKey)(void* a);
+  int (*Compare)(const void* a, const void* b);
+#ifndef RB_NO_THREADS
+  pthread_rwlock_t layout; /* boundaries; held for writing only while rebalancing */
+  pthread_mutex_t sumLock; /* totals, fenwick and n */
+#endif
+} rb_sharded_tree;
+
+rb_sharded_tree* ShardedTreeCreate(size_t P, void* const* splits,
+			     int  (*CompFunc)(const void*, const void*),
+			     void (*DestFunc)(void*),
+			     void (*InfoDestFunc)(void*),
+			     void (*PrintFunc)(const void*),
+			     void (*PrintInfo)(void*),
+			     double (*DistFunc)(const void*, const void*),
+			     void* dfparam,
+			     void* (*CopyKey)(const void*));
+void ShardedTreeInsert(rb_sharded_tree*, void* key, void* info);
+int ShardedTreeDelete(rb_sharded_tree*, const void* key); //!! delete one node with the given key, returns 1 if found
+double ShardedTreeRank(rb_sharded_tree*, const void* key); //!! sum of DistFunc of the keys smaller than key
+double ShardedTreeCDF(rb_sharded_tree*, const void* key); //!! ShardedTreeRank divided by the total
+double ShardedTreeTotal(rb_sharded_tree*);
+size_t ShardedTreeSize(rb_sharded_tree*);
+void ShardedTreeSetImbalance(rb_sharded_tree*, double maxImbalance); //!! automatic rebalancing threshold (default 2, 0: off)
+void ShardedTreeRebalance(rb_sharded_tree*); //!! move nodes between shards to have about n/P in each
+void ShardedTreeDestroy(rb_sharded_tree*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,630 @@
+#include "tree_log.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+/*  write-ahead log and checkpoints, see tree_log.h
+ *
+ *  file formats (integers in the byte order of the machine):
+ *  log: "RBLOG001", generation (8 bytes), then records
+ *  checkpoint: "RBCKP001", generation (8 bytes), number of records
+ *    (8 bytes), then one insert record for each node, in order
+ *  record: op (1 byte), payload length (4 bytes), payload (from
+ *    rb_log_codec.Encode), checksum of the previous (4 bytes)
+ *
+ *  the generation is incremented by each checkpoint; a log is replayed
+ *  only if its generation is at least the one of the checkpoint, so a
+ *  crash between writing the checkpoint and emptying the log is safe
+ */
+
+#ifndef RB_NO_THREADS
+#define LOG_LOCK(log) pthread_mutex_lock(&((log)->lock))
+#define LOG_UNLOCK(log) pthread_mutex_unlock(&((log)->lock))
+#else
+#define LOG_LOCK(log) ((void)0)
+#define LOG_UNLOCK(log) ((void)0)
+#endif
+
+#define RB_LOG_INSERT 1
+#define RB_LOG_DELETE 2
+#define RB_LOG_UPDATE 3
+
+#define RB_LOG_HEADER 16 /* magic and generation */
+#define RB_LOG_RECORD 9 /* op, length and checksum */
+#define RB_LOG_BUFSIZE 65536
+#define RB_LOG_BATCH 4096 /* records replayed together */
+
+static const char gLogMagic[8] = {'R','B','L','O','G','0','0','1'};
+static const char gCkpMagic[8] = {'R','B','C','K','P','0','0','1'};
+
+
+/***********************************************************************
+ * codec for int64_t keys stored in the pointers (CmpInt64), no info
+ ***********************************************************************/
+static size_t Int64Encode(const void* key, const void* info, unsigned char* buf, size_t len) {
+     int64_t k = (int64_t)key;
+     if(len >= sizeof(int64_t)) memcpy(buf,&k,sizeof(int64_t));
+     return sizeof(int64_t);
+}
+
+static int Int64Decode(const unsigned char* buf, size_t len, void** key, void** info) {
+     int64_t k;
+     if(len != sizeof(int64_t)) return -1;
+     memcpy(&k,buf,sizeof(int64_t));
+     *key = (void*)k;
+     *info = 0;
+     return 0;
+}
+
+const rb_log_codec RBLogCodecInt64 = { Int64Encode, Int64Decode };
+
+
+/***********************************************************************
+ * helpers: FNV-1a checksum, time, writing and reading whole buffers
+ ***********************************************************************/
+static uint32_t LogChecksum(const unsigned char* p, size_t len) {
+     uint32_t h = 2166136261U;
+     size_t i;
+     for(i=0;i<len;i++) {
+          h ^= p[i];
+          h *= 16777619U;
+     }
+     return h;
+}
+
+static double LogTime(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC,&ts);
+     return (double)ts.tv_sec + 1e-9*(double)ts.tv_nsec;
+}
+
+static int LogWriteAll(int fd, const unsigned char* p, size_t len) {
+     while(len > 0) {
+          ssize_t r = write(fd,p,len);
+          if(r < 0) {
+               if(errno == EINTR) continue;
+               return -1;
+          }
+          p += r;
+          len -= (size_t)r;
+     }
+     return 0;
+}
+
+static int LogReadAll(FILE* f, void* p, size_t len) {
+     return (fread(p,1,len,f) == len) ? 0 : -1;
+}
+
+static int LogWriteHeader(int fd, const char* magic, uint64_t generation) {
+     unsigned char h[RB_LOG_HEADER];
+     memcpy(h,magic,8);
+     memcpy(h+8,&generation,8);
+     return LogWriteAll(fd,h,RB_LOG_HEADER);
+}
+
+/***********************************************************************
+ * finish the record at p: the payload of len bytes is already at p+5
+ ***********************************************************************/
+static size_t LogFinishRecord(unsigned char* p, int op, size_t len) {
+     uint32_t l = (uint32_t)len;
+     uint32_t c;
+     p[0] = (unsigned char)op;
+     memcpy(p+1,&l,4);
+     c = LogChecksum(p,len+5);
+     memcpy(p+5+len,&c,4);
+     return len + RB_LOG_RECORD;
+}
+
+/***********************************************************************
+ * write the buffer to the file (called with the lock held)
+ ***********************************************************************/
+static int LogFlush(rb_tree_log* log) {
+     if(log->bufLen == 0) return 0;
+     if(LogWriteAll(log->fd,log->buf,log->bufLen)) log->error = 1;
+     else log->written += log->bufLen;
+     log->bufLen = 0;
+     return log->error ? -1 : 0;
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBLogOpen */
+/**/
+/*    INPUTS:  path of the log file (created if it does not exist, */
+/*             otherwise new records are appended to it; RBLogRecover */
+/*             should be run before this if it exists), codec for */
+/*             the keys, fsync policy and interval (see tree_log.h) */
+/**/
+/*    OUTPUT:  the new log, or 0 on error */
+/***********************************************************************/
+
+rb_tree_log* RBLogOpen(const char* path, const rb_log_codec* codec, int syncPolicy, double syncInterval) {
+     rb_tree_log* log;
+     unsigned char h[RB_LOG_HEADER];
+     uint64_t generation = 0;
+     off_t size;
+     int fd = open(path,O_RDWR | O_CREAT,0644);
+     if(fd < 0) return 0;
+     size = lseek(fd,0,SEEK_END);
+     if(size >= RB_LOG_HEADER) {
+          if(pread(fd,h,RB_LOG_HEADER,0) != RB_LOG_HEADER || memcmp(h,gLogMagic,8)) {
+               close(fd);
+               return 0;
+          }
+          memcpy(&generation,h+8,8);
+     }
+     else if(ftruncate(fd,0) || lseek(fd,0,SEEK_SET) || LogWriteHeader(fd,gLogMagic,0)) {
+          close(fd);
+          return 0;
+     }
+
+     log = (rb_tree_log*)SafeMalloc(sizeof(rb_tree_log));
+     log->fd = fd;
+     log->codec = codec;
+     log->syncPolicy = syncPolicy;
+     log->syncInterval = syncInterval;
+     log->lastSync = LogTime();
+     log->generation = generation;
+     log->bufSize = RB_LOG_BUFSIZE;
+     log->buf = (unsigned char*)SafeMalloc(log->bufSize);
+     log->bufLen = 0;
+     log->scratch = 0;
+     log->scratchSize = 0;
+     log->appended = 0;
+     log->written = 0;
+     log->durable = 0;
+     log->syncing = 0;
+     log->error = 0;
+#ifndef RB_NO_THREADS
+     pthread_mutex_init(&(log->lock),0);
+     pthread_cond_init(&(log->synced),0);
+#endif
+     return log;
+}
+
+
+/***********************************************************************
+ * append a record to the buffer (writing the buffer out first if there
+ * is not enough space in it)
+ ***********************************************************************/
+static int LogAppend(rb_tree_log* log, int op, const void* key, const void* info) {
+     size_t len, room;
+     int ret;
+     LOG_LOCK(log);
+     room = (log->bufLen + RB_LOG_RECORD < log->bufSize) ? log->bufSize - log->bufLen - RB_LOG_RECORD : 0;
+     len = log->codec->Encode(key,info,log->buf + log->bufLen + 5,room);
+     if(len > room) {
+          LogFlush(log);
+          room = log->bufSize - RB_LOG_RECORD;
+          if(len <= room) log->codec->Encode(key,info,log->buf + 5,room);
+     }
+     if(len <= room) {
+          log->bufLen += LogFinishRecord(log->buf + log->bufLen,op,len);
+     }
+     else {
+          /* larger than the buffer, written directly */
+          if(log->scratchSize < len + RB_LOG_RECORD) {
+               free(log->scratch);
+               log->scratchSize = len + RB_LOG_RECORD;
+               log->scratch = (unsigned char*)SafeMalloc(log->scratchSize);
+          }
+          log->codec->Encode(key,info,log->scratch + 5,len);
+          LogFinishRecord(log->scratch,op,len);
+          if(LogWriteAll(log->fd,log->scratch,len + RB_LOG_RECORD)) log->error = 1;
+          else log->written += len + RB_LOG_RECORD;
+     }
+     log->appended += len + RB_LOG_RECORD;
+     ret = log->error ? -1 : 0;
+     LOG_UNLOCK(log);
+     return ret;
+}
+
+int RBLogInsert(rb_tree_log* log, const void* key, const void* info) {
+     return LogAppend(log,RB_LOG_INSERT,key,info);
+}
+
+int RBLogDelete(rb_tree_log* log, const void* key) {
+     return LogAppend(log,RB_LOG_DELETE,key,0);
+}
+
+int RBLogUpdate(rb_tree_log* log, const void* key, const void* info) {
+     return LogAppend(log,RB_LOG_UPDATE,key,info);
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBLogCommit */
+/**/
+/*    OUTPUT:  0 on success, -1 if writing to the log failed (now or */
+/*             before) */
+/**/
+/*    EFFECT:  Writes out the records appended so far by all threads. */
+/*             If an fsync is needed (by the policy), and another thread */
+/*             is already doing one, waits for it, and does another only */
+/*             if the records appended are still not covered; one fsync */
+/*             is done for the records of all the threads waiting. */
+/***********************************************************************/
+
+int RBLogCommit(rb_tree_log* log) {
+     uint64_t target;
+     int ret;
+     LOG_LOCK(log);
+     target = log->appended;
+     LogFlush(log);
+     if(log->syncPolicy == RB_LOG_SYNC_COMMIT || (log->syncPolicy == RB_LOG_SYNC_INTERVAL &&
+               LogTime() - log->lastSync >= log->syncInterval)) {
+          while(log->durable < target && !log->error) {
+               uint64_t upto;
+               int r;
+#ifndef RB_NO_THREADS
+               if(log->syncing) {
+                    pthread_cond_wait(&(log->synced),&(log->lock));
+                    continue;
+               }
+#endif
+               log->syncing = 1;
+               upto = log->written;
+               LOG_UNLOCK(log);
+               r = fsync(log->fd);
+               LOG_LOCK(log);
+               log->syncing = 0;
+               if(r) log->error = 1;
+               else if(upto > log->durable) log->durable = upto;
+               log->lastSync = LogTime();
+#ifndef RB_NO_THREADS
+               pthread_cond_broadcast(&(log->synced));
+#endif
+          }
+     }
+     ret = log->error ? -1 : 0;
+     LOG_UNLOCK(log);
+     return ret;
+}
+
+void RBLogClose(rb_tree_log* log) {
+     LOG_LOCK(log);
+     LogFlush(log);
+     if(log->syncPolicy != RB_LOG_SYNC_NONE) fsync(log->fd);
+     LOG_UNLOCK(log);
+     close(log->fd);
+#ifndef RB_NO_THREADS
+     pthread_mutex_destroy(&(log->lock));
+     pthread_cond_destroy(&(log->synced));
+#endif
+     free(log->buf);
+     free(log->scratch);
+     free(log);
+}
+
+
+/***********************************************************************
+ * logging and doing the operation on the tree; the record is only
+ * appended, the caller decides when to commit; if appending failed (now
+ * or before, see RBLogCommit), the tree is not changed, and 0 (insert)
+ * or -1 (delete and update) is returned
+ ***********************************************************************/
+rb_red_blk_node* RBLogTreeInsert(rb_tree_log* log, rb_red_blk_tree* tree, void* key, void* info) {
+     if(RBLogInsert(log,key,info)) return 0;
+     return RBTreeInsert(tree,key,info);
+}
+
+int RBLogTreeDelete(rb_tree_log* log, rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     if(RBLogDelete(log,x->key)) return -1;
+     RBDelete(tree,x);
+     return 0;
+}
+
+int RBLogTreeUpdate(rb_tree_log* log, rb_red_blk_tree* tree, rb_red_blk_node* x) {
+     if(RBLogUpdate(log,x->key,x->info)) return -1;
+     RBUpdateWeight(tree,x);
+     return 0;
+}
+
+
+/***********************************************************************
+ * fsync the directory containing path, so that a rename in it is on
+ * the disk
+ ***********************************************************************/
+static int LogSyncDir(const char* path) {
+     const char* slash = strrchr(path,'/');
+     size_t len = slash ? (size_t)(slash - path) : 0;
+     char* dir = (char*)SafeMalloc(len + 2);
+     int fd, ret;
+     if(slash == 0) strcpy(dir,".");
+     else if(len == 0) strcpy(dir,"/");
+     else {
+          memcpy(dir,path,len);
+          dir[len] = 0;
+     }
+     fd = open(dir,O_RDONLY | O_DIRECTORY);
+     free(dir);
+     if(fd < 0) return -1;
+     ret = fsync(fd);
+     close(fd);
+     return ret ? -1 : 0;
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBLogCheckpoint */
+/**/
+/*    INPUTS:  tree should contain the result of all operations logged */
+/*             so far, and should not change while this runs */
+/**/
+/*    OUTPUT:  0 on success, -1 on error (the previous checkpoint and the */
+/*             log stay valid in this case) */
+/**/
+/*    EFFECT:  Writes the nodes of the tree in order to a temporary file, */
+/*             syncs it and renames it to path, syncs the directory (so */
+/*             that the rename cannot be lost in a crash after the log */
+/*             is emptied), then empties the log, so that recovery time */
+/*             only depends on the operations after the checkpoint. */
+/*             If the directory cannot be synced, the checkpoint may or */
+/*             may not replace the previous one after a crash, so the */
+/*             log is not emptied, and no more records are accepted */
+/*             (as after a failed write). */
+/***********************************************************************/
+
+int RBLogCheckpoint(rb_tree_log* log, rb_red_blk_tree* tree, const char* path) {
+     size_t pathLen = strlen(path);
+     char* tmp = (char*)SafeMalloc(pathLen + 5);
+     unsigned char* buf = (unsigned char*)SafeMalloc(RB_LOG_BUFSIZE);
+     size_t bufSize = RB_LOG_BUFSIZE;
+     size_t bufLen = 0;
+     uint64_t count = 0;
+     uint64_t generation;
+     rb_red_blk_node* x;
+     int fd;
+     int ret = -1;
+
+     memcpy(tmp,path,pathLen);
+     memcpy(tmp+pathLen,".tmp",5);
+     LOG_LOCK(log);
+     generation = log->generation + 1;
+     fd = open(tmp,O_WRONLY | O_CREAT | O_TRUNC,0644);
+     if(fd < 0) goto done;
+     for(x = TreeFirst(tree); x != tree->nil; x = TreeSuccessor(tree,x)) count++;
+     if(LogWriteHeader(fd,gCkpMagic,generation) || LogWriteAll(fd,(unsigned char*)&count,8)) goto fail;
+     for(x = TreeFirst(tree); x != tree->nil; x = TreeSuccessor(tree,x)) {
+          size_t room = (bufLen + RB_LOG_RECORD < bufSize) ? bufSize - bufLen - RB_LOG_RECORD : 0;
+          size_t len = log->codec->Encode(x->key,x->info,buf + bufLen + 5,room);
+          if(len > room) {
+               if(LogWriteAll(fd,buf,bufLen)) goto fail;
+               bufLen = 0;
+               if(len + RB_LOG_RECORD > bufSize) {
+                    free(buf);
+                    bufSize = len + RB_LOG_RECORD;
+                    buf = (unsigned char*)SafeMalloc(bufSize);
+               }
+               log->codec->Encode(x->key,x->info,buf + 5,len);
+          }
+          bufLen += LogFinishRecord(buf + bufLen,RB_LOG_INSERT,len);
+     }
+     if(LogWriteAll(fd,buf,bufLen) || fsync(fd)) goto fail;
+     close(fd);
+     if(rename(tmp,path)) goto done;
+     if(LogSyncDir(path)) {
+          /* the records appended to the old log would be ignored after */
+          /* the new checkpoint, if the rename survives */
+          log->error = 1;
+          goto done;
+     }
+
+     /* the checkpoint is valid now, start the new log */
+     log->bufLen = 0;
+     if(ftruncate(log->fd,0) || lseek(log->fd,0,SEEK_SET) ||
+               LogWriteHeader(log->fd,gLogMagic,generation) || fsync(log->fd)) {
+          log->error = 1;
+          goto done;
+     }
+     log->generation = generation;
+     log->written = log->durable = log->appended;
+     ret = 0;
+     goto done;
+fail:
+     close(fd);
+     unlink(tmp);
+done:
+     LOG_UNLOCK(log);
+     free(tmp);
+     free(buf);
+     return ret;
+}
+
+
+/***********************************************************************
+ * recovery
+ ***********************************************************************/
+typedef struct rb_log_record {
+  int op;
+  void* key;
+  void* info;
+} rb_log_record;
+
+/***********************************************************************
+ * read the next record from f; returns 1 if a record was read, 0 at the
+ * end of the valid part (end of file, incomplete or corrupted record)
+ ***********************************************************************/
+static int LogReadRecord(FILE* f, const rb_log_codec* codec, unsigned char** buf,
+          size_t* bufSize, rb_log_record* r) {
+     uint32_t len, c;
+     if(*bufSize < 5 + RB_LOG_RECORD) {
+          free(*buf);
+          *bufSize = RB_LOG_BUFSIZE;
+          *buf = (unsigned char*)SafeMalloc(*bufSize);
+     }
+     if(LogReadAll(f,*buf,5)) return 0;
+     memcpy(&len,*buf + 1,4);
+     if(len + RB_LOG_RECORD > *bufSize) {
+          unsigned char* b2;
+          if(len > (1U << 30)) return 0;
+          b2 = (unsigned char*)SafeMalloc(len + RB_LOG_RECORD);
+          memcpy(b2,*buf,5);
+          free(*buf);
+          *buf = b2;
+          *bufSize = len + RB_LOG_RECORD;
+     }
+     if(LogReadAll(f,*buf + 5,len + 4)) return 0;
+     memcpy(&c,*buf + 5 + len,4);
+     if(c != LogChecksum(*buf,len + 5)) return 0;
+     r->op = (*buf)[0];
+     if(r->op < RB_LOG_INSERT || r->op > RB_LOG_UPDATE) return 0;
+     if(codec->Decode(*buf + 5,len,&(r->key),&(r->info))) return 0;
+     return 1;
+}
+
+/***********************************************************************
+ * stable merge sort of the records by key: operations on different keys
+ * can be done in any order, the ones on equal keys keep their order
+ ***********************************************************************/
+static void LogSortRecords(const rb_red_blk_tree* tree, rb_log_record* r, rb_log_record* tmp, size_t n) {
+     size_t mid, i, j, k;
+     if(n < 2) return;
+     mid = n/2;
+     LogSortRecords(tree,r,tmp,mid);
+     LogSortRecords(tree,r+mid,tmp,n-mid);
+     if(tree->Compare(r[mid-1].key,r[mid].key) != 1) return;
+     memcpy(tmp,r,mid*sizeof(rb_log_record));
+     i = 0; j = mid; k = 0;
+     while(i < mid && j < n) {
+          if(tree->Compare(tmp[i].key,r[j].key) == 1) r[k++] = r[j++];
+          else r[k++] = tmp[i++];
+     }
+     while(i < mid) r[k++] = tmp[i++];
+}
+
+/***********************************************************************
+ * apply a sorted batch of records to the tree; the inserts use the
+ * previous node as hint
+ ***********************************************************************/
+static void LogApplyRecords(rb_red_blk_tree* tree, rb_log_record* r, size_t n) {
+     rb_red_blk_node* hint = 0;
+     size_t i;
+     for(i=0;i<n;i++) {
+          rb_red_blk_node* x;
+          if(r[i].op == RB_LOG_INSERT) {
+               hint = RBTreeInsertHint(tree,hint,r[i].key,r[i].info);
+               continue;
+          }
+          x = RBExactQuery(tree,r[i].key);
+          if(x && r[i].op == RB_LOG_UPDATE) {
+               void* key = x->key;
+               void* info = x->info;
+               x->key = r[i].key;
+               x->info = r[i].info;
+               RBUpdateWeight(tree,x);
+               r[i].key = key;
+               r[i].info = info;
+          }
+          else if(x) {
+               if(x == hint) hint = 0;
+               RBDelete(tree,x);
+          }
+          tree->DestroyKey(r[i].key);
+          if(r[i].info) tree->DestroyInfo(r[i].info);
+     }
+}
+
+
+/***********************************************************************/
+/*  FUNCTION:  RBLogRecover */
+/**/
+/*    INPUTS:  tree is an empty tree, checkpoint and log are the paths */
+/*             given to RBLogCheckpoint and RBLogOpen (both can be */
+/*             missing) */
+/**/
+/*    OUTPUT:  0 on success, -1 if the checkpoint has a wrong format or */
+/*             the log cannot be written */
+/**/
+/*    EFFECT:  Inserts the nodes of the checkpoint (these are in order, */
+/*             so each insert starts from the previous node), then reads */
+/*             the log in batches of RB_LOG_BATCH records, sorts each */
+/*             batch by key and applies it to the tree. The log is */
+/*             truncated after the last complete record, so that new */
+/*             records can be appended to it (or created if it is missing */
+/*             or older than the checkpoint). */
+/***********************************************************************/
+
+int RBLogRecover(rb_red_blk_tree* tree, const char* checkpoint, const char* log, const rb_log_codec* codec) {
+     unsigned char h[RB_LOG_HEADER];
+     unsigned char* buf = 0;
+     size_t bufSize = 0;
+     uint64_t generation = 0;
+     uint64_t logGeneration;
+     rb_log_record r;
+     long valid = 0;
+     FILE* f;
+
+     f = fopen(checkpoint,"rb");
+     if(f) {
+          uint64_t count, i;
+          rb_red_blk_node* hint = 0;
+          if(LogReadAll(f,h,RB_LOG_HEADER) || memcmp(h,gCkpMagic,8) || LogReadAll(f,&count,8)) {
+               fclose(f);
+               return -1;
+          }
+          memcpy(&generation,h+8,8);
+          for(i=0;i<count;i++) {
+               if(!LogReadRecord(f,codec,&buf,&bufSize,&r)) {
+                    fclose(f);
+                    free(buf);
+                    return -1;
+               }
+               hint = RBTreeInsertHint(tree,hint,r.key,r.info);
+          }
+          fclose(f);
+     }
+
+     f = fopen(log,"rb");
+     if(f) {
+          rb_log_record* batch = (rb_log_record*)SafeMalloc(sizeof(rb_log_record)*RB_LOG_BATCH);
+          rb_log_record* tmp = (rb_log_record*)SafeMalloc(sizeof(rb_log_record)*RB_LOG_BATCH);
+          size_t n = 0;
+          int more = 1;
+          if(LogReadAll(f,h,RB_LOG_HEADER) || memcmp(h,gLogMagic,8)) more = 0;
+          else {
+               memcpy(&logGeneration,h+8,8);
+               valid = RB_LOG_HEADER;
+               /* an older log is already contained in the checkpoint */
+               if(logGeneration < generation) more = 0;
+          }
+          while(more) {
+               more = LogReadRecord(f,codec,&buf,&bufSize,&r);
+               if(more) {
+                    batch[n++] = r;
+                    valid = ftell(f);
+               }
+               if(n == RB_LOG_BATCH || (!more && n > 0)) {
+                    LogSortRecords(tree,batch,tmp,n);
+                    LogApplyRecords(tree,batch,n);
+                    n = 0;
+               }
+          }
+          fclose(f);
+          free(batch);
+          free(tmp);
+          if(valid > 0 && logGeneration >= generation) {
+               if(truncate(log,valid)) valid = 0;
+          }
+          else valid = 0;
+     }
+     /* start a new log if there was no valid one, with the generation */
+     /* of the checkpoint (so that it is not skipped at the next recovery) */
+     if(valid == 0) {
+          int fd = open(log,O_WRONLY | O_CREAT | O_TRUNC,0644);
+          int err = (fd < 0);
+          if(fd >= 0) {
+               err = LogWriteHeader(fd,gLogMagic,generation) || fsync(fd);
+               close(fd);
+          }
+          if(err) {
+               free(buf);
+               return -1;
+          }
+     }
+     free(buf);
+     return 0;
+}
+
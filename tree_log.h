@@ -0,0 +1,98 @@
+#ifndef TREE_LOG_H
+#define TREE_LOG_H
+
+#include "red_black_tree.h"
+#ifndef RB_NO_THREADS
+#include <pthread.h>
+#endif
+
+/**************************************************
+ * write-ahead log of the operations on a tree, and recovery from a
+ * checkpoint and the log
+ *
+ * the operations (insert, delete and weight update) are written to an
+ * append-only log file before they are done on the tree (the
+ * RBLogTree... functions do both); records are collected in a buffer
+ * and written out together on RBLogCommit (or when the buffer is full);
+ * when several threads commit at the same time, one fsync covers all of
+ * them (group commit)
+ *
+ * fsync policy (see RBLogOpen):
+ * RB_LOG_SYNC_NONE: RBLogCommit only writes the buffer to the file, the
+ *   OS writes it to the disk later (survives a crash of the process,
+ *   but not of the machine)
+ * RB_LOG_SYNC_COMMIT: RBLogCommit returns after fsync
+ * RB_LOG_SYNC_INTERVAL: fsync is done on commit only if at least
+ *   syncInterval seconds passed since the last one
+ *
+ * RBLogCheckpoint writes all nodes (in order) to a checkpoint file and
+ * starts a new, empty log; RBLogRecover loads the checkpoint and replays
+ * the log after it, in sorted batches; records at the end of the log
+ * which were not written completely are ignored (and removed)
+ *
+ * keys and infos are converted to bytes by the functions of an
+ * rb_log_codec; RBLogCodecInt64 is one for the int64_t keys used with
+ * CmpInt64 (without info); deletes and updates are logged by key (an
+ * update logs the key after the change, which should compare equal to
+ * the key before it), and replayed on a node with an equal key
+ **************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RB_LOG_SYNC_NONE 0
+#define RB_LOG_SYNC_COMMIT 1
+#define RB_LOG_SYNC_INTERVAL 2
+
+typedef struct rb_log_codec {
+  /* write key and info (info is 0 for deletes) to buf if they fit in */
+  /* len bytes; return the number of bytes needed */
+  size_t (*Encode)(const void* key, const void* info, unsigned char* buf, size_t len);
+  /* create key and info from len bytes; return 0 on success */
+  int (*Decode)(const unsigned char* buf, size_t len, void** key, void** info);
+} rb_log_codec;
+
+extern const rb_log_codec RBLogCodecInt64;
+
+typedef struct rb_tree_log {
+  int fd;
+  const rb_log_codec* codec;
+  int syncPolicy;
+  double syncInterval; /* seconds, for RB_LOG_SYNC_INTERVAL */
+  double lastSync;
+  uint64_t generation; /* incremented by each checkpoint */
+  unsigned char* buf; /* records not yet written to the file */
+  size_t bufLen;
+  size_t bufSize;
+  unsigned char* scratch; /* for records larger than the buffer */
+  size_t scratchSize;
+  uint64_t appended; /* bytes of records appended (written or in buf) */
+  uint64_t written; /* bytes written to the file */
+  uint64_t durable; /* bytes synced to the disk */
+  int syncing; /* nonzero while a thread is doing fsync */
+  int error; /* nonzero after a failed write or fsync */
+#ifndef RB_NO_THREADS
+  pthread_mutex_t lock;
+  pthread_cond_t synced;
+#endif
+} rb_tree_log;
+
+rb_tree_log* RBLogOpen(const char* path, const rb_log_codec* codec, int syncPolicy, double syncInterval);
+int RBLogInsert(rb_tree_log*, const void* key, const void* info); //!! append records, 0 on success
+int RBLogDelete(rb_tree_log*, const void* key);
+int RBLogUpdate(rb_tree_log*, const void* key, const void* info);
+int RBLogCommit(rb_tree_log*); //!! write out the records appended so far (and fsync, depending on the policy)
+rb_red_blk_node* RBLogTreeInsert(rb_tree_log*, rb_red_blk_tree*, void* key, void* info); //!! log, then RBTreeInsert (0 if logging failed, the tree is not changed then)
+int RBLogTreeDelete(rb_tree_log*, rb_red_blk_tree*, rb_red_blk_node*); //!! log, then RBDelete (-1 if logging failed)
+int RBLogTreeUpdate(rb_tree_log*, rb_red_blk_tree*, rb_red_blk_node*); //!! log, then RBUpdateWeight (-1 if logging failed)
+int RBLogCheckpoint(rb_tree_log*, rb_red_blk_tree*, const char* path); //!! write all nodes to path, then empty the log
+int RBLogRecover(rb_red_blk_tree*, const char* checkpoint, const char* log, const rb_log_codec* codec); //!! load the checkpoint and replay the log, 0 on success
+void RBLogClose(rb_tree_log*); //!! commit and close
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,97 @@
+#include "tree_perf.h"
+#include <string.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*  hardware counters, see tree_perf.h */
+
+
+#ifdef __linux__
+static int PerfOpenCounter(uint32_t type, uint64_t config) {
+     struct perf_event_attr pe;
+     int fd;
+     memset(&pe,0,sizeof(pe));
+     pe.type = type;
+     pe.size = sizeof(pe);
+     pe.config = config;
+     pe.disabled = 1;
+     pe.exclude_kernel = 1;
+     pe.exclude_hv = 1;
+     fd = (int)syscall(__NR_perf_event_open,&pe,0,-1,-1,0);
+     if(fd < 0) return -1;
+     ioctl(fd,PERF_EVENT_IOC_RESET,0);
+     ioctl(fd,PERF_EVENT_IOC_ENABLE,0);
+     return fd;
+}
+#endif
+
+static uint64_t PerfRead(int fd) {
+#ifdef __linux__
+     uint64_t x;
+     if(read(fd,&x,sizeof(x)) == (ssize_t)sizeof(x)) return x;
+#endif
+     return 0;
+}
+
+int RBPerfOpen(rb_perf* p) {
+     int i, n = 0;
+     for(i=0;i<RB_PERF_NCOUNTERS;i++) p->fd[i] = -1;
+#ifdef __linux__
+     p->fd[RB_PERF_CACHE_MISSES] = PerfOpenCounter(PERF_TYPE_HARDWARE,PERF_COUNT_HW_CACHE_MISSES);
+     p->fd[RB_PERF_DTLB_MISSES] = PerfOpenCounter(PERF_TYPE_HW_CACHE,PERF_COUNT_HW_CACHE_DTLB |
+          (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+     p->fd[RB_PERF_BRANCH_MISSES] = PerfOpenCounter(PERF_TYPE_HARDWARE,PERF_COUNT_HW_BRANCH_MISSES);
+#endif
+     for(i=0;i<RB_PERF_NCOUNTERS;i++) if(p->fd[i] >= 0) n++;
+     RBPerfReset(p);
+     return n;
+}
+
+void RBPerfStart(rb_perf* p) {
+     int i;
+     for(i=0;i<RB_PERF_NCOUNTERS;i++) if(p->fd[i] >= 0) p->start[i] = PerfRead(p->fd[i]);
+}
+
+void RBPerfStop(rb_perf* p, uint64_t ops) {
+     int i;
+     for(i=0;i<RB_PERF_NCOUNTERS;i++) if(p->fd[i] >= 0) p->total[i] += PerfRead(p->fd[i]) - p->start[i];
+     p->ops += ops;
+}
+
+void RBPerfReset(rb_perf* p) {
+     int i;
+     for(i=0;i<RB_PERF_NCOUNTERS;i++) p->start[i] = p->total[i] = 0;
+     p->ops = 0;
+}
+
+double RBPerfPerOp(const rb_perf* p, int counter) {
+     if(counter < 0 || counter >= RB_PERF_NCOUNTERS || p->fd[counter] < 0) return -1.0;
+     if(p->ops == 0) return 0.0;
+     return (double)(p->total[counter]) / (double)(p->ops);
+}
+
+void RBPerfPrint(const rb_perf* p, FILE* f, const char* label) {
+     static const char* names[RB_PERF_NCOUNTERS] = {"cache misses","dTLB misses","branch misses"};
+     int i;
+     fprintf(f,"%s: %llu operations",label,(unsigned long long)(p->ops));
+     for(i=0;i<RB_PERF_NCOUNTERS;i++) {
+          if(p->fd[i] >= 0) fprintf(f,", %.3f %s",RBPerfPerOp(p,i),names[i]);
+          else fprintf(f,", %s n/a",names[i]);
+     }
+     fprintf(f," per operation\n");
+}
+
+void RBPerfClose(rb_perf* p) {
+     int i;
+     for(i=0;i<RB_PERF_NCOUNTERS;i++) {
+#ifdef __linux__
+          if(p->fd[i] >= 0) close(p->fd[i]);
+#endif
+          p->fd[i] = -1;
+     }
+}
+
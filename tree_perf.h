@@ -0,0 +1,66 @@
+#ifndef TREE_PERF_H
+#define TREE_PERF_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/**************************************************
+ * hardware counters per tree operation (Linux perf_event_open)
+ *
+ * RBPerfOpen opens counters for the calling thread (user space only):
+ * RB_PERF_CACHE_MISSES: last level cache misses
+ * RB_PERF_DTLB_MISSES: data TLB misses of loads
+ * RB_PERF_BRANCH_MISSES: mispredicted branches
+ * the counters are read by RBPerfStart and RBPerfStop around a batch of
+ * operations (reading them costs a system call for each counter, so
+ * measuring each operation separately would mostly count the
+ * measurement itself); RBPerfStop adds the difference and the number of
+ * operations in the batch to the totals, and RBPerfPerOp gives the
+ * average per operation over all batches since RBPerfOpen or RBPerfReset
+ *
+ * counters which cannot be opened (not supported by the CPU or inside a
+ * virtual machine, or not allowed by kernel.perf_event_paranoid) are
+ * skipped, their results are -1; on other systems than Linux, no counter
+ * is available; the counters are not multiplexed (the three of them fit
+ * on any CPU which has them), so the results are not scaled
+ *
+ * example:
+ *   rb_perf p;
+ *   RBPerfOpen(&p);
+ *   RBPerfStart(&p);
+ *   for(i=0;i<m;i++) RBExactQuery(tree,keys[i]);
+ *   RBPerfStop(&p,m);
+ *   RBPerfPrint(&p,stderr,"query");
+ *   RBPerfClose(&p);
+ **************************************************/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RB_PERF_CACHE_MISSES 0
+#define RB_PERF_DTLB_MISSES 1
+#define RB_PERF_BRANCH_MISSES 2
+#define RB_PERF_NCOUNTERS 3
+
+typedef struct rb_perf {
+  int fd[RB_PERF_NCOUNTERS]; /* -1 if the counter is not available */
+  uint64_t start[RB_PERF_NCOUNTERS]; /* values at RBPerfStart */
+  uint64_t total[RB_PERF_NCOUNTERS]; /* sum over the batches */
+  uint64_t ops; /* number of operations in the batches */
+} rb_perf;
+
+int RBPerfOpen(rb_perf*); //!! open the counters, returns the number available
+void RBPerfStart(rb_perf*); //!! start a batch
+void RBPerfStop(rb_perf*, uint64_t ops); //!! end a batch of ops operations
+void RBPerfReset(rb_perf*); //!! clear the totals
+double RBPerfPerOp(const rb_perf*, int counter); //!! average per operation, -1 if not available
+void RBPerfPrint(const rb_perf*, FILE* f, const char* label); //!! write the averages as one line
+void RBPerfClose(rb_perf*);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,956 @@
+#include "red_black_tree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+
+/*  regression tests for the functions of the tree: random sequences of
+ * 	operations are done both on a tree and on a simple model (the number
+ * 	of nodes with each key and the weight of each key), and the tree is
+ * 	compared to the model after every few operations (structure, keys in
+ * 	order, the rank of every node and the total); the queries are
+ * 	compared to results computed by brute force from the model
+ *
+ * 	parameters:
+ * 	-N n       number of operations in each test (default: 20000)
+ * 	-K k       keys are in [0,k) (default: 1000)
+ * 	-s seed    random seed (default: the current time)
+ * 	-v         print the name of each test as it runs
+ *
+ * 	the tests for the optional parts are compiled in if RB_RANGE_UPDATE,
+ * 	RB_TRACK_CHANGES or RB_STATS is defined; the program returns 1 if
+ * 	there were errors */
+
+
+static int64_t K = 1000; /* number of different keys */
+static double* W; /* weight of each key (used by DistW) */
+static double* W2; /* other weights, for RBTreeSetDistFunc */
+static unsigned int* count; /* number of nodes with each key in the model */
+static size_t nodes; /* total number of nodes in the model */
+static const double* weights = 0; /* weights used by the tree currently (W or W2) */
+static double peak = 0.0; /* largest total so far (decayed with the weights) */
+static const char* testName = "";
+static int errors = 0;
+
+static double DistW(const void* a, const void* par) {
+	return W[(int64_t)a];
+}
+
+static double DistW2(const void* a, const void* par) {
+	return W2[(int64_t)a];
+}
+
+static void Error(const char* fmt, ...) {
+	va_list ap;
+	errors++;
+	if(errors > 20) return;
+	fprintf(stderr,"%s: ",testName);
+	va_start(ap,fmt);
+	vfprintf(stderr,fmt,ap);
+	va_end(ap);
+	fprintf(stderr,"\n");
+}
+
+/* a and b are equal up to rounding errors in sums of about scale */
+static inline int Close(double a, double b, double scale) {
+	return fabs(a-b) <= 1e-9*(fabs(a) + fabs(b) + scale);
+}
+
+static inline int64_t RandKey(void) {
+	return ((int64_t)rand()) % K;
+}
+
+/* random weight; some keys have zero weight */
+static inline double RandWeight(void) {
+	if(rand()%10 == 0) return 0.0;
+	return (double)(1 + rand()%50);
+}
+
+static rb_red_blk_tree* NewTree(int engine) {
+	rb_red_blk_tree* tree = RBTreeCreate(CmpInt64,(void (*)(void*))NullFunction,
+		(void (*)(void*))NullFunction,NullFunction,(void (*)(void*))NullFunction,DistW,0);
+	if(!RBTreeSetEngine(tree,engine)) Error("RBTreeSetEngine failed on an empty tree");
+	return tree;
+}
+
+static void ResetModel(void) {
+	int64_t k;
+	for(k=0;k<K;k++) {
+		W[k] = RandWeight();
+		count[k] = 0;
+	}
+	nodes = 0;
+	weights = W;
+	peak = 0.0;
+}
+
+static double ModelTotal(void) {
+	double r = 0.0;
+	int64_t k;
+	for(k=0;k<K;k++) r += weights[k]*count[k];
+	return r;
+}
+
+
+/* check the links and the balance of the subtree of x (the colors, or
+ * the heap order of the priorities of a treap), returns the black height
+ * (for red-black trees) */
+static int CheckNode(rb_red_blk_tree* tree, rb_red_blk_node* x, int* ok) {
+	rb_red_blk_node* nil = tree->nil;
+	int bl, br;
+	if(x == nil) return 1;
+	if(x->left != nil && (x->left->parent != x || tree->Compare(x->left->key,x->key) == 1)) *ok = 0;
+	if(x->right != nil && (x->right->parent != x || tree->Compare(x->key,x->right->key) == 1)) *ok = 0;
+	bl = CheckNode(tree,x->left,ok);
+	br = CheckNode(tree,x->right,ok);
+	if(tree->engine == RB_ENGINE_RB) {
+		if(bl != br) *ok = 0;
+		if(x->red && (x->left->red || x->right->red)) *ok = 0;
+	}
+	else if((x->left != nil && x->left->priority > x->priority) ||
+			(x->right != nil && x->right->priority > x->priority)) *ok = 0;
+	return bl + (x->red ? 0 : 1);
+}
+
+/* compare the tree to the model */
+static void CheckTree(rb_red_blk_tree* tree, const char* where) {
+	rb_red_blk_node* nil = tree->nil;
+	rb_red_blk_node* x;
+	int ok = 1;
+	int64_t k = 0;
+	unsigned int c = 0;
+	size_t n = 0;
+	double sum = 0.0;
+	double total = ModelTotal();
+	/* the sums are updated by adding and subtracting the changes, so the
+	 * rounding errors are relative to the largest sums seen */
+	if(peak > total) total = peak;
+
+	if(tree->root->left != nil && tree->root->left->parent != tree->root) ok = 0;
+	if(tree->engine == RB_ENGINE_RB && tree->root->left->red) ok = 0;
+	if(nil->red) ok = 0;
+	CheckNode(tree,tree->root->left,&ok);
+	if(!ok) {
+		Error("%s: invalid tree structure",where);
+		return;
+	}
+
+	for(x = TreeFirst(tree); x != nil; x = TreeSuccessor(tree,x)) {
+		double r;
+		while(k < K && c == count[k]) {
+			k++;
+			c = 0;
+		}
+		if(k == K || (int64_t)x->key != k) {
+			Error("%s: node %zu has key %ld instead of %ld",where,n,(long)(int64_t)x->key,(long)k);
+			return;
+		}
+		r = GetNodeRank(tree,x);
+		if(!Close(r,sum,total)) {
+			Error("%s: rank of node %zu (key %ld) is %g instead of %g",where,n,(long)k,r,sum);
+			return;
+		}
+		sum += weights[k];
+		c++;
+		n++;
+	}
+	if(n != nodes || tree->nodes != nodes) {
+		Error("%s: %zu nodes (%zu counted by the tree) instead of %zu",where,n,(size_t)tree->nodes,nodes);
+		return;
+	}
+	if(!Close(RBTreeTotal(tree),sum,total)) Error("%s: total is %g instead of %g",where,RBTreeTotal(tree),sum);
+}
+
+/* any node with key k, or 0 */
+static rb_red_blk_node* FindKey(rb_red_blk_tree* tree, int64_t k) {
+	return RBExactQuery(tree,(void*)k);
+}
+
+/* set the weight of key k, and update all nodes with this key */
+static void SetWeight(rb_red_blk_tree* tree, int64_t k, double w) {
+	rb_red_blk_node* nil = tree->nil;
+	rb_red_blk_node* x = FindKey(tree,k);
+	rb_red_blk_node* y;
+	W[k] = w;
+	if(!x) return;
+	RBUpdateWeight(tree,x);
+	for(y = TreePredecessor(tree,x); y != nil && (int64_t)y->key == k; y = TreePredecessor(tree,y))
+		RBUpdateWeight(tree,y);
+	for(y = TreeSuccessor(tree,x); y != nil && (int64_t)y->key == k; y = TreeSuccessor(tree,y))
+		RBUpdateWeight(tree,y);
+}
+
+static unsigned int merges = 0; /* calls to CountMerge */
+static void CountMerge(rb_red_blk_node* x, void* key, void* info) {
+	merges++;
+}
+
+/* one random change of the tree, using all insert and delete functions;
+ * topDown: the top-down variants can be used (not in batch mode) */
+static void RandomChange(rb_red_blk_tree* tree, int topDown) {
+	int64_t k = RandKey();
+	int op = rand()%12;
+	unsigned int m;
+	rb_red_blk_node* x;
+
+	switch(op) {
+		case 0:
+		case 1:
+			RBTreeInsert(tree,(void*)k,0);
+			break;
+		case 2:
+			/* a hint close to the key, or anywhere */
+			x = FindKey(tree,k + rand()%5 - 2);
+			if(!x && rand()%2) x = tree->nil;
+			if(!x) x = TreeFirst(tree);
+			RBTreeInsertHint(tree,x,(void*)k,0);
+			break;
+		case 3:
+			if(topDown) RBTreeInsertTopDown(tree,(void*)k,0);
+			else RBTreeInsert(tree,(void*)k,0);
+			break;
+		case 4:
+			m = merges;
+			x = RBUpsert(tree,(void*)k,0,CountMerge);
+			if(!x || (int64_t)x->key != k) Error("RBUpsert returned a wrong node");
+			if((merges != m) != (count[k] != 0)) Error("RBUpsert: Merge called %u times for key %ld",merges - m,(long)k);
+			if(count[k]) return; /* updated the existing node */
+			break;
+		case 5:
+		case 6:
+			x = (op == 5) ? RBTreeAccess(tree,(void*)k) : FindKey(tree,k);
+			if((x != 0) != (count[k] != 0)) {
+				Error("%s: key %ld found: %d, in the model: %u",(op == 5) ? "RBTreeAccess" : "RBExactQuery",(long)k,x != 0,count[k]);
+				return;
+			}
+			if(x) RBDelete(tree,x);
+			break;
+		case 7:
+			if(RBDeleteKey(tree,(void*)k) != (count[k] != 0)) {
+				Error("RBDeleteKey: wrong result for key %ld",(long)k);
+				return;
+			}
+			break;
+		case 8:
+			if(!topDown) {
+				RBDeleteKey(tree,(void*)k);
+			}
+			else if(RBDeleteTopDown(tree,(void*)k) != (count[k] != 0)) {
+				Error("RBDeleteTopDown: wrong result for key %ld",(long)k);
+				return;
+			}
+			break;
+		default:
+			SetWeight(tree,k,RandWeight());
+			return;
+	}
+	if(op < 5) {
+		count[k]++;
+		nodes++;
+	}
+	else if(count[k]) {
+		count[k]--;
+		nodes--;
+	}
+}
+
+/* fill the tree with about n random nodes */
+static void Fill(rb_red_blk_tree* tree, size_t n) {
+	size_t i;
+	for(i=0;i<n;i++) {
+		int64_t k = RandKey();
+		RBTreeInsert(tree,(void*)k,0);
+		count[k]++;
+		nodes++;
+	}
+}
+
+
+/* insert, delete and update with all variants */
+static void TestChanges(int engine, unsigned int N) {
+	rb_red_blk_tree* tree = NewTree(engine);
+	unsigned int i;
+	ResetModel();
+	CheckTree(tree,"empty tree");
+	for(i=0;i<N;i++) {
+		RandomChange(tree,1);
+		if(i % 1000 == 500) {
+			/* a sorted run, with the previous new node as the hint */
+			rb_red_blk_node* x = TreeFirst(tree);
+			int64_t k;
+			for(k=RandKey();k<K;k+=rand()%3) {
+				x = RBTreeInsertHint(tree,x,(void*)k,0);
+				count[k]++;
+				nodes++;
+				if(rand()%50 == 0) break;
+			}
+		}
+		if(i % 97 == 0) CheckTree(tree,"after random changes");
+		/* grow and shrink the tree */
+		if(i % 5000 == 4999) while(nodes > 10) {
+			int64_t k = RandKey();
+			if(count[k]) {
+				RBDelete(tree,FindKey(tree,k));
+				count[k]--;
+				nodes--;
+			}
+		}
+	}
+	CheckTree(tree,"after random changes");
+
+	/* RBExactQuery does not change the tree (not even the treap),
+	 * RBTreeAccess can rotate it */
+	{
+		rb_red_blk_node* top = tree->root->left;
+		rb_tree_shape before, after;
+		int64_t k;
+		RBTreeShape(tree,&before);
+		for(k=0;k<K;k++) FindKey(tree,k);
+		RBTreeShape(tree,&after);
+		if(tree->root->left != top || after.height != before.height || after.avgDepth != before.avgDepth)
+			Error("RBExactQuery changed the tree");
+		for(i=0;i<1000;i++) {
+			k = RandKey();
+			if((RBTreeAccess(tree,(void*)k) != 0) != (count[k] != 0)) {
+				Error("RBTreeAccess: wrong result for key %ld",(long)k);
+				break;
+			}
+		}
+		CheckTree(tree,"after RBTreeAccess");
+	}
+	RBTreeDestroy(tree);
+}
+
+/* bulk loading */
+static void TestBuildSorted(int engine, unsigned int N) {
+	rb_red_blk_tree* tree = NewTree(engine);
+	size_t n = N/4 + 1;
+	void** keys = (void**)SafeMalloc(sizeof(void*)*n);
+	size_t i, j;
+	int64_t k;
+
+	ResetModel();
+	if(!RBTreeBuildSorted(tree,keys,0,0)) Error("RBTreeBuildSorted failed with no keys");
+	CheckTree(tree,"built from no keys");
+	for(k=0,i=0;i<n;i++) {
+		k += rand()%3; /* with duplicates */
+		k %= K;
+		count[k]++;
+	}
+	for(k=0,i=0;k<K;k++) for(j=0;j<count[k];j++) keys[i++] = (void*)k;
+	nodes = n;
+	if(!RBTreeBuildSorted(tree,keys,0,n)) Error("RBTreeBuildSorted failed on an empty tree");
+	CheckTree(tree,"built from sorted keys");
+	if(RBTreeBuildSorted(tree,keys,0,n)) Error("RBTreeBuildSorted succeeded on a nonempty tree");
+	CheckTree(tree,"second RBTreeBuildSorted");
+	for(i=0;i<N/4;i++) RandomChange(tree,1);
+	CheckTree(tree,"changes after RBTreeBuildSorted");
+	free(keys);
+	RBTreeDestroy(tree);
+}
+
+/* RBSortedRank, RBBatchRank, RBBatchQuery, GetNodeRankCached */
+static void TestQueries(int engine, unsigned int N) {
+	rb_red_blk_tree* tree = NewTree(engine);
+	size_t m = 500;
+	void** keys = (void**)SafeMalloc(sizeof(void*)*m);
+	double* out = (double*)SafeMalloc(sizeof(double)*m);
+	rb_red_blk_node** found = (rb_red_blk_node**)SafeMalloc(sizeof(rb_red_blk_node*)*m);
+	double* prefix = (double*)SafeMalloc(sizeof(double)*(K+2));
+	unsigned int round;
+	size_t i;
+	int64_t k;
+
+	ResetModel();
+	for(round=0;round<N/1000+1;round++) {
+		Fill(tree,rand()%200);
+		for(i=0;i<100;i++) RandomChange(tree,1);
+		prefix[0] = 0.0;
+		for(k=0;k<=K;k++) prefix[k+1] = prefix[k] + (k < K ? W[k]*count[k] : 0.0);
+
+		/* sorted queries, including keys outside [0,K) */
+		for(i=0,k=-1;i<m;i++) {
+			if(rand()%3) k += rand()%3;
+			if(k > K) k = K;
+			keys[i] = (void*)k;
+		}
+		RBSortedRank(tree,keys,m,out);
+		for(i=0;i<m;i++) {
+			k = (int64_t)keys[i];
+			if(!Close(out[i],prefix[k < 0 ? 0 : k],prefix[K])) {
+				Error("RBSortedRank: %g instead of %g for key %ld",out[i],prefix[k < 0 ? 0 : k],(long)k);
+				break;
+			}
+		}
+
+		/* unsorted queries */
+		for(i=0;i<m;i++) keys[i] = (void*)(int64_t)(rand()%(K+2) - 1);
+		RBBatchRank(tree,keys,m,out);
+		RBBatchQuery(tree,keys,m,found);
+		for(i=0;i<m;i++) {
+			k = (int64_t)keys[i];
+			if(!Close(out[i],prefix[k < 0 ? 0 : k],prefix[K])) {
+				Error("RBBatchRank: %g instead of %g for key %ld",out[i],prefix[k < 0 ? 0 : k],(long)k);
+				break;
+			}
+			if((found[i] != 0) != (k >= 0 && k < K && count[k] != 0) || (found[i] && (int64_t)found[i]->key != k)) {
+				Error("RBBatchQuery: wrong result for key %ld",(long)k);
+				break;
+			}
+		}
+
+		/* the cached ranks stay correct while the tree changes */
+		for(i=0;i<m;i++) {
+			rb_red_blk_node* x = FindKey(tree,RandKey());
+			double r;
+			if(!x) continue;
+			r = GetNodeRank(tree,x);
+			if(GetNodeRankCached(tree,x) != r || GetNodeRankCached(tree,x) != r) {
+				Error("GetNodeRankCached: %g instead of %g",GetNodeRankCached(tree,x),r);
+				break;
+			}
+			if(i % 100 == 0) SetWeight(tree,(int64_t)x->key,RandWeight());
+			if(i % 10 == 0) RandomChange(tree,1); /* can delete x */
+		}
+		CheckTree(tree,"queries");
+	}
+	free(keys);
+	free(out);
+	free(found);
+	free(prefix);
+	RBTreeDestroy(tree);
+}
+
+/* check that x is the node where the sums cross target (before is the
+ * sum before x returned by the search); strict: x cannot have zero
+ * weight (unless all weights are zero) */
+static int CheckSelect(rb_red_blk_tree* tree, rb_red_blk_node* x, double target, double before, int strict) {
+	double r, w, tol;
+	if(x == tree->nil) return tree->root->left == tree->nil;
+	r = GetNodeRank(tree,x);
+	w = weights[(int64_t)x->key];
+	tol = 1e-9*(1.0 + RBTreeTotal(tree));
+	if(fabs(r - before) > tol) return 0;
+	if(r > target + tol) return 0;
+	if(r + w <= target - tol && TreeSuccessor(tree,x) != tree->nil) return 0;
+	return !strict || w > 0.0 || RBTreeTotal(tree) == 0.0;
+}
+
+static double UniformRand(void* state) {
+	return ((double)rand()) / ((double)RAND_MAX + 1.0);
+}
+
+/* RBWeightSelect, RBWeightSelectSorted, RBWeightDrawDistinct */
+static void TestSelect(int engine, unsigned int N) {
+	rb_red_blk_tree* tree = NewTree(engine);
+	size_t m = 300;
+	double* targets = (double*)SafeMalloc(sizeof(double)*m);
+	rb_red_blk_node** res = (rb_red_blk_node**)SafeMalloc(sizeof(rb_red_blk_node*)*m);
+	unsigned int round;
+	size_t i, j;
+
+	ResetModel();
+	for(round=0;round<N/1000+1;round++) {
+		double total, before;
+		size_t k, positive = 0;
+		Fill(tree,rand()%300);
+		for(i=0;i<100;i++) RandomChange(tree,1);
+		total = RBTreeTotal(tree);
+
+		for(i=0;i<m;i++) {
+			double t = total*UniformRand(0);
+			rb_red_blk_node* x = RBWeightSelect(tree,t,&before);
+			if(!CheckSelect(tree,x,t,before,1)) {
+				Error("RBWeightSelect: wrong node for %g (total %g)",t,total);
+				break;
+			}
+		}
+
+		for(i=0;i<m;i++) targets[i] = total*UniformRand(0);
+		for(i=1;i<m;i++) for(j=i;j>0 && targets[j-1] > targets[j];j--) {
+			double tmp = targets[j];
+			targets[j] = targets[j-1];
+			targets[j-1] = tmp;
+		}
+		RBWeightSelectSorted(tree,targets,m,res);
+		for(i=0;i<m;i++) if(!CheckSelect(tree,res[i],targets[i],res[i] == tree->nil ? 0.0 : GetNodeRank(tree,res[i]),1)) {
+			Error("RBWeightSelectSorted: wrong node for %g (total %g)",targets[i],total);
+			break;
+		}
+
+		/* sampling without replacement leaves the tree as it was */
+		for(i=0;i<(size_t)K;i++) if(W[i] > 0.0) positive += count[i];
+		k = RBWeightDrawDistinct(tree,UniformRand,0,m,res);
+		if(k != (positive < m ? positive : m)) Error("RBWeightDrawDistinct: %zu nodes drawn instead of %zu",k,positive < m ? positive : m);
+		for(i=0;i<k;i++) {
+			if(W[(int64_t)res[i]->key] == 0.0) Error("RBWeightDrawDistinct: node with zero weight drawn");
+			for(j=i+1;j<k;j++) if(res[i] == res[j]) Error("RBWeightDrawDistinct: node drawn twice");
+		}
+		CheckTree(tree,"RBWeightDrawDistinct");
+	}
+
+	/* empty tree */
+	while(nodes) {
+		int64_t k = RandKey();
+		if(count[k]) {
+			RBDelete(tree,FindKey(tree,k));
+			count[k]--;
+			nodes--;
+		}
+	}
+	if(RBWeightSelect(tree,0.0,0) != tree->nil) Error("RBWeightSelect: not nil for an empty tree");
+	if(RBWeightDrawDistinct(tree,UniformRand,0,m,res) != 0) Error("RBWeightDrawDistinct: nodes drawn from an empty tree");
+	free(targets);
+	free(res);
+	RBTreeDestroy(tree);
+}
+
+/* quantile fingers while the tree changes, also in batches */
+static void CheckFingers(rb_red_blk_tree* tree, rb_quantile_finger** f, int nf, const char* where) {
+	int i;
+	for(i=0;i<nf;i++) {
+		double before;
+		rb_red_blk_node* x = RBQuantileGet(tree,f[i],&before);
+		double target = f[i]->p*RBTreeTotal(tree);
+		if(x == tree->nil) {
+			if(tree->root->left != tree->nil) Error("%s: finger %g is nil in a nonempty tree",where,f[i]->p);
+			continue;
+		}
+		if(!CheckSelect(tree,x,target,before,0)) {
+			Error("%s: finger %g is at a wrong node",where,f[i]->p);
+			return;
+		}
+	}
+}
+
+static void TestQuantiles(int engine, unsigned int N) {
+	rb_red_blk_tree* tree = NewTree(engine);
+	double ps[5] = {0.0, 0.25, 0.5, 0.9, 1.0};
+	rb_quantile_finger* f[5];
+	unsigned int i;
+	int j;
+
+	ResetModel();
+	f[0] = RBQuantileTrack(tree,ps[0]);
+	CheckFingers(tree,f,1,"finger of an empty tree");
+	Fill(tree,200);
+	for(j=1;j<5;j++) f[j] = RBQuantileTrack(tree,ps[j]);
+	CheckFingers(tree,f,5,"new fingers");
+	for(i=0;i<N;i++) {
+		RandomChange(tree,1);
+		if(i % 1000 == 500) {
+			/* a batch of changes */
+			unsigned int b, nb = rand()%200;
+			RBTreeBeginBatch(tree);
+			for(b=0;b<nb;b++) RandomChange(tree,0);
+			RBTreeEndBatch(tree);
+		}
+		if(i % 1000 == 700) {
+			double factor = 0.5;
+			int64_t k;
+			RBTreeDecay(tree,factor);
+			for(k=0;k<K;k++) W[k] *= factor;
+		}
+		if(i % 1000 == 900) {
+			j = rand()%5;
+			RBQuantileUntrack(tree,f[j]);
+			f[j] = RBQuantileTrack(tree,ps[j]);
+		}
+		CheckFingers(tree,f,5,"after a change");
+	}
+	CheckTree(tree,"fingers");
+	for(j=0;j<5;j++) RBQuantileUntrack(tree,f[j]);
+	RBTreeDestroy(tree);
+}
+
+/* batches of changes with the sums recomputed at the end */
+static void TestBatch(int engine, unsigned int N) {
+	rb_red_blk_tree* tree = NewTree(engine);
+	unsigned int i = 0;
+	ResetModel();
+	Fill(tree,300);
+	while(i < N) {
+		unsigned int b, nb = 1 + rand()%300;
+		RBTreeBeginBatch(tree);
+		for(b=0;b<nb;b++) RandomChange(tree,0);
+		RBTreeEndBatch(tree);
+		CheckTree(tree,"after a batch");
+		i += nb;
+	}
+	RBTreeDestroy(tree);
+}
+
+/* RBTreeDecay and the range updates */
+static void TestDecay(int engine, unsigned int N) {
+	rb_red_blk_tree* tree = NewTree(engine);
+	unsigned int i;
+	int64_t k;
+	ResetModel();
+	for(i=0;i<N;i++) {
+		double t;
+		RandomChange(tree,1);
+		t = ModelTotal();
+		if(t > peak) peak = t;
+		if(i % 50 == 0) {
+			/* many decays with no other change, so that the weights are rescaled */
+			double factor = (rand()%2) ? 0.5 : 0.9;
+			int d, nd = (rand()%10 == 0) ? 200 : 1;
+			for(d=0;d<nd;d++) {
+				RBTreeDecay(tree,factor);
+				for(k=0;k<K;k++) W[k] *= factor;
+				peak *= factor;
+			}
+			if(RBTreeTotal(tree) < 1e-100) for(k=0;k<K;k++) SetWeight(tree,k,RandWeight());
+		}
+#ifdef RB_RANGE_UPDATE
+		if(i % 50 == 25) {
+			int64_t lo = RandKey();
+			int64_t hi = lo + rand()%(K/4);
+			if(rand()%2) {
+				double factor = 0.5 + UniformRand(0);
+				RBRangeMultiply(tree,(void*)lo,(void*)hi,factor);
+				for(k=lo;k<=hi && k<K;k++) W[k] *= factor;
+				if(factor > 1.0) peak *= factor;
+			}
+			else {
+				double delta = (double)(rand()%5);
+				RBRangeAdd(tree,(void*)lo,(void*)hi,delta);
+				for(k=lo;k<=hi && k<K;k++) W[k] += delta;
+			}
+		}
+#endif
+		if(i % 97 == 0) CheckTree(tree,"decay and range updates");
+	}
+	CheckTree(tree,"decay and range updates");
+	RBTreeDestroy(tree);
+}
+
+/* brute force KS distance of two trees with the current weights */
+static double BruteKS(rb_red_blk_tree* a, const unsigned int* ca, rb_red_blk_tree* b, const unsigned int* cb) {
+	double ta = 0.0, tb = 0.0, sa = 0.0, sb = 0.0, d = 0.0;
+	int64_t k;
+	for(k=0;k<K;k++) {
+		ta += W[k]*ca[k];
+		tb += W[k]*cb[k];
+	}
+	if(ta == 0.0 || tb == 0.0) return 0.0;
+	for(k=0;k<K;k++) {
+		sa += W[k]*ca[k];
+		sb += W[k]*cb[k];
+		if(fabs(sa/ta - sb/tb) > d) d = fabs(sa/ta - sb/tb);
+	}
+	return d;
+}
+
+/* RBTreeKSDistance and RBTreeKSDistanceApprox; b uses the given engine */
+static void TestKS(int engine, unsigned int N) {
+	unsigned int* ca = (unsigned int*)SafeMalloc(sizeof(unsigned int)*K);
+	unsigned int round;
+	int64_t k;
+	ResetModel();
+	for(round=0;round<N/100+1;round++) {
+		rb_red_blk_tree* a = NewTree(RB_ENGINE_RB);
+		rb_red_blk_tree* b = NewTree(engine);
+		int i, na = rand()%400, nb = rand()%400;
+		int64_t shift = rand()%(K/5);
+		double d, bf, ap0, ap;
+		for(k=0;k<K;k++) {
+			ca[k] = 0;
+			count[k] = 0;
+		}
+		for(i=0;i<na;i++) {
+			k = RandKey();
+			RBTreeInsert(a,(void*)k,0);
+			ca[k]++;
+		}
+		for(i=0;i<nb;i++) {
+			k = (RandKey()/2 + shift) % K;
+			RBTreeInsert(b,(void*)k,0);
+			count[k]++;
+		}
+		d = RBTreeKSDistance(a,b);
+		bf = BruteKS(a,ca,b,count);
+		ap0 = RBTreeKSDistanceApprox(a,b,0.0);
+		ap = RBTreeKSDistanceApprox(a,b,0.02);
+		if(!Close(d,bf,1.0) || !Close(ap0,bf,1.0) || ap > bf + 1e-12 || ap < bf - 0.02 - 1e-12)
+			Error("KS distance %g, approx %g / %g instead of %g",d,ap0,ap,bf);
+		RBTreeDestroy(a);
+		RBTreeDestroy(b);
+	}
+	free(ca);
+}
+
+/* RBTreeCompact, RBTreeCompactStep and RBTreeSetNodeStorage */
+static void TestCompact(int engine, unsigned int N) {
+	int storage;
+	for(storage = RB_STORAGE_HEAP; storage <= RB_STORAGE_THP; storage++) {
+		rb_red_blk_tree* tree = NewTree(engine);
+		unsigned int i;
+		ResetModel();
+		if(!RBTreeSetNodeStorage(tree,storage)) Error("RBTreeSetNodeStorage failed on an empty tree");
+		Fill(tree,100);
+		if(RBTreeSetNodeStorage(tree,RB_STORAGE_HEAP)) Error("RBTreeSetNodeStorage succeeded on a nonempty tree");
+		for(i=0;i<N;i++) {
+			RandomChange(tree,1);
+			if(i % 1000 == 100) {
+				RBTreeCompact(tree,RB_LAYOUT_DFS);
+				CheckTree(tree,"RBTreeCompact(RB_LAYOUT_DFS)");
+			}
+			if(i % 1000 == 400) {
+				RBTreeCompact(tree,RB_LAYOUT_VEB);
+				CheckTree(tree,"RBTreeCompact(RB_LAYOUT_VEB)");
+			}
+			if(i % 1000 == 700) {
+				/* changes between the steps of the compaction */
+				while(!RBTreeCompactStep(tree,1 + rand()%50)) RandomChange(tree,1);
+				CheckTree(tree,"RBTreeCompactStep");
+			}
+		}
+		CheckTree(tree,"compaction");
+		RBTreeCompactStep(tree,3); /* destroy in the middle of a compaction */
+		RBTreeDestroy(tree);
+	}
+}
+
+/* RBTreeShape and RBTreeSetDistFunc */
+static void TestShape(int engine, unsigned int N) {
+	rb_red_blk_tree* tree = NewTree(engine);
+	rb_tree_shape shape;
+	int64_t k;
+	ResetModel();
+	RBTreeShape(tree,&shape);
+	if(shape.nodes != 0 || shape.height != 0) Error("RBTreeShape: wrong shape of an empty tree");
+	Fill(tree,N/2);
+	RBTreeShape(tree,&shape);
+	if(shape.nodes != nodes || shape.avgDepth >= (double)shape.height || (double)shape.height < log2((double)nodes + 1.0))
+		Error("RBTreeShape: %zu nodes, height %u, average depth %g",shape.nodes,shape.height,shape.avgDepth);
+	if(engine == RB_ENGINE_RB && (shape.height > 2*shape.blackHeight || (double)shape.height > 2.0*log2((double)nodes + 1.0)))
+		Error("RBTreeShape: height %u, black height %u for %zu nodes",shape.height,shape.blackHeight,nodes);
+
+	for(k=0;k<K;k++) W2[k] = RandWeight();
+	RBTreeSetDistFunc(tree,DistW2,0);
+	weights = W2;
+	CheckTree(tree,"RBTreeSetDistFunc");
+	RBTreeSetDistFunc(tree,DistW,0);
+	weights = W;
+	CheckTree(tree,"RBTreeSetDistFunc back");
+	RBTreeDestroy(tree);
+}
+
+#ifdef RB_TRACK_CHANGES
+/* state of the nodes at the last export (the keys are distinct here) */
+typedef struct {
+	int64_t key;
+	double before;
+	double weight;
+} export_entry;
+
+typedef struct {
+	export_entry* old;
+	export_entry* cur;
+	int* pos; /* index of each key in old, or -1 */
+	size_t nold;
+	size_t ncur;
+	double total;
+} export_state;
+
+static void ExportChanged(const rb_red_blk_node* x, double before, double weight, void* arg) {
+	export_state* s = (export_state*)arg;
+	s->cur[s->ncur].key = (int64_t)x->key;
+	s->cur[s->ncur].before = before;
+	s->cur[s->ncur].weight = weight;
+	s->ncur++;
+}
+
+static void ExportUnchanged(const rb_red_blk_node* first, const rb_red_blk_node* last,
+		double before, double shift, void* arg) {
+	export_state* s = (export_state*)arg;
+	int i = s->pos[(int64_t)first->key];
+	int j = s->pos[(int64_t)last->key];
+	if(i < 0 || j < i) {
+		Error("RBTreeExportChanges: run of nodes which were not exported before");
+		return;
+	}
+	if(!Close(s->old[i].before + shift,before,s->total)) Error("RBTreeExportChanges: wrong shift");
+	for(;i<=j;i++) {
+		s->cur[s->ncur] = s->old[i];
+		s->cur[s->ncur].before += shift;
+		s->ncur++;
+	}
+}
+
+/* RBTreeExportChanges reports the same as a full walk */
+static void TestExport(int engine, unsigned int N) {
+	rb_red_blk_tree* tree = NewTree(engine);
+	export_state s;
+	unsigned int round;
+	size_t i;
+	int64_t k;
+
+	ResetModel();
+	s.old = (export_entry*)SafeMalloc(sizeof(export_entry)*K);
+	s.cur = (export_entry*)SafeMalloc(sizeof(export_entry)*K);
+	s.pos = (int*)SafeMalloc(sizeof(int)*K);
+	s.nold = 0;
+	for(k=0;k<K;k++) s.pos[k] = -1;
+	for(round=0;round<N/50+1;round++) {
+		unsigned int c, nc = (round % 50 == 0) ? 500 : 1 + rand()%20;
+		rb_red_blk_node* x;
+		double before = 0.0;
+		export_entry* tmp;
+		for(c=0;c<nc;c++) {
+			/* keep the keys distinct */
+			k = RandKey();
+			x = FindKey(tree,k);
+			if(x && rand()%2) {
+				RBDelete(tree,x);
+				count[k]--;
+				nodes--;
+			}
+			else if(x) SetWeight(tree,k,RandWeight());
+			else {
+				if(rand()%2) RBTreeInsert(tree,(void*)k,0);
+				else RBUpsert(tree,(void*)k,0,0);
+				count[k]++;
+				nodes++;
+			}
+		}
+		if(round % 37 == 5) RBTreeCompact(tree,RB_LAYOUT_VEB);
+		if(round % 61 == 7) {
+			RBTreeDecay(tree,0.5);
+			for(k=0;k<K;k++) W[k] *= 0.5;
+		}
+		s.ncur = 0;
+		s.total = ModelTotal();
+		RBTreeExportChanges(tree,ExportChanged,ExportUnchanged,&s);
+		for(x = TreeFirst(tree), i = 0; x != tree->nil; x = TreeSuccessor(tree,x), i++) {
+			double w = weights[(int64_t)x->key];
+			if(i >= s.ncur || s.cur[i].key != (int64_t)x->key || !Close(s.cur[i].before,before,s.total) || !Close(s.cur[i].weight,w,0.0)) {
+				Error("RBTreeExportChanges: node %zu differs",i);
+				break;
+			}
+			before += w;
+		}
+		if(i != s.ncur) Error("RBTreeExportChanges: %zu nodes reported instead of %zu",s.ncur,i);
+		for(i=0;i<s.nold;i++) s.pos[s.old[i].key] = -1;
+		tmp = s.old;
+		s.old = s.cur;
+		s.cur = tmp;
+		s.nold = s.ncur;
+		for(i=0;i<s.nold;i++) s.pos[s.old[i].key] = (int)i;
+	}
+	/* no changes: nothing is visited */
+	s.ncur = 0;
+	if(RBTreeExportChanges(tree,ExportChanged,ExportUnchanged,&s) != 0 || s.ncur != s.nold)
+		Error("RBTreeExportChanges: nodes visited without changes");
+	CheckTree(tree,"RBTreeExportChanges");
+	free(s.old);
+	free(s.cur);
+	free(s.pos);
+	RBTreeDestroy(tree);
+}
+#endif
+
+#ifdef RB_STATS
+/* the counters follow the operations */
+static void TestStats(int engine, unsigned int N) {
+	rb_red_blk_tree* tree = NewTree(engine);
+	rb_tree_stats stats;
+	ResetModel();
+	Fill(tree,N/10);
+	RBTreeGetStats(tree,&stats);
+	if(stats.nodesAlloc < nodes || stats.compare == 0 || stats.distFunc < nodes || stats.sumSteps == 0)
+		Error("RBTreeGetStats: wrong counters after %zu inserts",nodes);
+	if(engine == RB_ENGINE_RB && stats.leftRotate + stats.rightRotate == 0 && nodes > 2)
+		Error("RBTreeGetStats: no rotations counted");
+	RBTreeResetStats(tree);
+	RBTreeGetStats(tree,&stats);
+	if(stats.compare || stats.distFunc || stats.leftRotate || stats.rightRotate || stats.deleteFixUp ||
+			stats.sumSteps || stats.nodesAlloc || stats.nodesFree)
+		Error("RBTreeResetStats: counters are not zero");
+	RBDelete(tree,TreeFirst(tree));
+	RBTreeGetStats(tree,&stats);
+	if(stats.nodesFree != 1) Error("RBTreeGetStats: %lu nodes freed instead of 1",(unsigned long)stats.nodesFree);
+	RBTreeDestroy(tree);
+}
+#endif
+
+
+typedef struct {
+	const char* name;
+	void (*Run)(int engine, unsigned int N);
+} tree_test;
+
+static const tree_test tests[] = {
+	{"insert / delete / update", TestChanges},
+	{"RBTreeBuildSorted", TestBuildSorted},
+	{"rank queries", TestQueries},
+	{"weighted selection", TestSelect},
+	{"quantile fingers", TestQuantiles},
+	{"batches", TestBatch},
+	{"decay / range updates", TestDecay},
+	{"KS distance", TestKS},
+	{"compaction / node storage", TestCompact},
+	{"shape / DistFunc", TestShape},
+#ifdef RB_TRACK_CHANGES
+	{"RBTreeExportChanges", TestExport},
+#endif
+#ifdef RB_STATS
+	{"stats", TestStats},
+#endif
+	{0, 0}
+};
+
+
+int main(int argc, char** argv) {
+	unsigned int N = 20000;
+	unsigned int seed = (unsigned int)time(0);
+	int verbose = 0;
+	int i, engine;
+
+	for(i=1;i<argc;i++) if(argv[i][0] == '-') switch(argv[i][1]) {
+		case 'N':
+			if(i+1 < argc) N = atoi(argv[i+1]);
+			break;
+		case 'K':
+			if(i+1 < argc) K = atol(argv[i+1]);
+			break;
+		case 's':
+			if(i+1 < argc) seed = atoi(argv[i+1]);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr,"unrecognized parameter: %s!\n",argv[i]);
+			break;
+	}
+	if(K < 20) K = 20;
+
+	srand(seed);
+	W = (double*)SafeMalloc(sizeof(double)*K);
+	W2 = (double*)SafeMalloc(sizeof(double)*K);
+	count = (unsigned int*)SafeMalloc(sizeof(unsigned int)*K);
+
+	for(engine = RB_ENGINE_RB; engine <= RB_ENGINE_TREAP; engine++)
+		for(i=0;tests[i].name;i++) {
+			int before = errors;
+			testName = tests[i].name;
+			if(verbose) fprintf(stderr,"%s (engine %d)\n",testName,engine);
+			tests[i].Run(engine,N);
+			if(errors > before) fprintf(stderr,"%s (engine %d): %d errors\n",testName,engine,errors - before);
+		}
+
+	free(W);
+	free(W2);
+	free(count);
+	if(errors) {
+		fprintf(stderr,"%d errors (seed: %u)\n",errors,seed);
+		return 1;
+	}
+	fprintf(stderr,"all tests passed (seed: %u)\n",seed);
+	return 0;
+}